@@ -0,0 +1,208 @@
+#pragma once
+
+#include "EngineCommon.hpp"
+
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+// Checks the pairs each broadphase finds against testing every pair, then
+// times them while some or all of the colliders move, over worlds of
+// different sizes and shapes.
+class BroadphaseTest {
+  static constexpr const u32 NUM_COLLIDERS = 20000;
+  static constexpr const u32 NUM_MOVING_FRAMES = 50;
+  // fewer frames for the big worlds, about this many collider updates in all
+  static constexpr const u32 MOVING_COLLIDERS_TIMED = 2000000;
+  // every broadphase of a configuration gets the same world and moves
+  static constexpr const u32 SEED = 1;
+  static constexpr const u32 NUM_CHECKED_COLLIDERS = 2000;
+  static constexpr const u32 NUM_CHECKED_FRAMES = 20;
+  static u64 getPairKey( EntityHandle a, EntityHandle b );
+  // frames whose pairs weren't the same
+  static u32 checkPairs( ColliderManager::Broadphase broadphase, float cellSize );
+  static void benchmarkMovingCollisions( u32 colliderCount, u32 movingPercent, Vec2 worldSize,
+                                         ColliderManager::Broadphase broadphase, float cellSize );
+public:
+  // colliders spread over the test area moving a little every frame, over a
+  // world 10 times as wide, over a long narrow band and from 10k to 1M of them
+  // as dense as in the test area
+  static void run();
+};
+
+constexpr const u32 BroadphaseTest::NUM_MOVING_FRAMES;
+
+u64 BroadphaseTest::getPairKey( EntityHandle a, EntityHandle b ) {
+  u64 low = std::min( a.index, b.index ), high = std::max( a.index, b.index );
+  return low << 32 | high;
+}
+
+// Colliders crowded in a small world, a third of them moving every frame, a
+// few of those far, and a few replaced by new ones, while they get sorted in
+// memory, so the persistent broadphases have to restructure and the pairs
+// kept between the colliders that stay still have to follow the ones moved
+// to other indices.
+u32 BroadphaseTest::checkPairs( ColliderManager::Broadphase broadphase, float cellSize ) {
+  std::srand( SEED );
+  ColliderManager::setBroadphase( broadphase );
+  ColliderManager::setQuadCellSize( cellSize );
+  Vec2 worldSize = { 160.0f, 92.0f };
+  std::vector< EntityHandle > entities;
+  EntityManager::createBatch( NUM_CHECKED_COLLIDERS, &entities );
+  for ( u32 i = 0; i < NUM_CHECKED_COLLIDERS; ++i ) {
+    Vec2 position = Vec2{ std::rand() / ( float )RAND_MAX - 0.5f, std::rand() / ( float )RAND_MAX - 0.5f } * worldSize;
+    TransformManager::set( entities[ i ], { position, VEC2_ONE, 0.0f } );
+    ColliderManager::addCircle( entities[ i ], { {}, 1.0f } );
+  }
+  std::vector< EntityHandle > moving;
+  std::vector< Vec2 > steps;
+  std::vector< std::pair< EntityHandle, EntityHandle > > found;
+  std::vector< u64 > foundKeys, expectedKeys;
+  u32 wrongFrames = 0;
+  for ( u32 frame = 0; frame < NUM_CHECKED_FRAMES; ++frame ) {
+    ColliderManager::updateAndCollide();
+    found.clear();
+    ColliderManager::getCandidatePairs( &found );
+    foundKeys.clear();
+    for ( u32 pairInd = 0; pairInd < found.size(); ++pairInd ) {
+      foundKeys.push_back( getPairKey( found[ pairInd ].first, found[ pairInd ].second ) );
+    }
+    // the bounds of a unit circle at each position
+    LookupResult lookupResult;
+    TransformManager::lookup( entities, &lookupResult );
+    std::vector< Transform > transforms;
+    TransformManager::getWorld( lookupResult.indices, &transforms );
+    expectedKeys.clear();
+    for ( u32 i = 0; i < transforms.size(); ++i ) {
+      Vec2 a = transforms[ i ].position;
+      for ( u32 j = i + 1; j < transforms.size(); ++j ) {
+        Vec2 b = transforms[ j ].position;
+        if ( fabsf( a.x - b.x ) <= 2.0f && fabsf( a.y - b.y ) <= 2.0f ) {
+          expectedKeys.push_back( getPairKey( entities[ i ], entities[ j ] ) );
+        }
+      }
+    }
+    std::sort( foundKeys.begin(), foundKeys.end() );
+    std::sort( expectedKeys.begin(), expectedKeys.end() );
+    if ( foundKeys != expectedKeys ) {
+      ++wrongFrames;
+    }
+    EntityManager::flushDeferred();
+    for ( u32 i = 0; i < NUM_CHECKED_COLLIDERS / 100; ++i ) {
+      u32 replaced = std::rand() % NUM_CHECKED_COLLIDERS;
+      EntityManager::destroy( entities[ replaced ] );
+      entities[ replaced ] = EntityManager::create();
+      Vec2 position = Vec2{ std::rand() / ( float )RAND_MAX - 0.5f, std::rand() / ( float )RAND_MAX - 0.5f } * worldSize;
+      TransformManager::set( entities[ replaced ], { position, VEC2_ONE, 0.0f } );
+      ColliderManager::addCircle( entities[ replaced ], { {}, 1.0f } );
+    }
+    moving.clear();
+    steps.clear();
+    for ( u32 i = 0; i < NUM_CHECKED_COLLIDERS; i += 3 ) {
+      float reach = i % 50 == 0 ? worldSize.x / 4.0f : 0.5f;
+      moving.push_back( entities[ i ] );
+      steps.push_back( Vec2{ std::rand() / ( float )RAND_MAX - 0.5f, std::rand() / ( float )RAND_MAX - 0.5f } * 2.0f * reach );
+    }
+    TransformManager::translate( moving, steps );
+    ColliderManager::defragment( NUM_CHECKED_COLLIDERS );
+  }
+  EntityManager::destroyBatch( entities );
+  EntityManager::flushDeferred();
+  ColliderManager::setQuadCellSize( 0.0f );
+  ColliderManager::setBroadphase( ColliderManager::QUADTREE );
+  return wrongFrames;
+}
+
+void BroadphaseTest::benchmarkMovingCollisions( u32 colliderCount, u32 movingPercent, Vec2 worldSize,
+                                                  ColliderManager::Broadphase broadphase, float cellSize ) {
+  std::srand( SEED );
+  ColliderManager::setBroadphase( broadphase );
+  ColliderManager::setQuadCellSize( cellSize );
+  std::vector< EntityHandle > entities;
+  EntityManager::createBatch( colliderCount, &entities );
+  for ( u32 i = 0; i < colliderCount; ++i ) {
+    Vec2 position = Vec2{ std::rand() / ( float )RAND_MAX - 0.5f, std::rand() / ( float )RAND_MAX - 0.5f } * worldSize;
+    TransformManager::set( entities[ i ], { position, VEC2_ONE, 0.0f } );
+    ColliderManager::addCircle( entities[ i ], { {}, 1.0f } );
+  }
+  ColliderManager::updateAndCollide();
+  EntityManager::flushDeferred();
+  std::vector< EntityHandle > moving( entities.begin(), entities.begin() + colliderCount * movingPercent / 100 );
+  std::vector< Vec2 > steps( moving.size() );
+  u64 nanos = 0, broadphaseNanos = 0, pairsTested = 0;
+  u64 collisionCount = 0;
+  u32 frameCount = std::max( 2u, std::min( NUM_MOVING_FRAMES, MOVING_COLLIDERS_TIMED / colliderCount ) );
+  for ( u32 frame = 0; frame < frameCount; ++frame ) {
+    for ( u32 i = 0; i < steps.size(); ++i ) {
+      steps[ i ] = { ( std::rand() % 101 - 50 ) / 100.0f, ( std::rand() % 101 - 50 ) / 100.0f };
+    }
+    TransformManager::translate( moving, steps );
+    TimePoint start = Clock::now();
+    ColliderManager::updateAndCollide();
+    nanos += elapsedNanos( start );
+    broadphaseNanos += ColliderManager::getBroadphaseStats().nanos;
+    pairsTested += ColliderManager::getBroadphaseStats().pairsTested;
+    std::vector< std::vector< Collision > >& collisions = ColliderManager::getCollisions( 1, colliderCount );
+    for ( u32 i = 0; i < collisions.size(); ++i ) {
+      collisionCount += collisions[ i ].size();
+    }
+    EntityManager::flushDeferred();
+  }
+  double perCollider = 1.0 / colliderCount / frameCount;
+  Debug::write( "%7d colliders, %3d%% moving, %5.0f x %-4.0f world, %s", colliderCount, movingPercent, worldSize.x, worldSize.y,
+                ColliderManager::BROADPHASE_NAMES[ broadphase ] );
+  if ( cellSize > 0.0f ) {
+    Debug::write( " in %.0f cells", cellSize );
+  }
+  Debug::write( ": %.3f ms per frame, per collider %.1f ns of broadphase, %.1f pairs tested, %.2f collisions\n",
+                nanos / 1.0e6 / frameCount, broadphaseNanos * perCollider, pairsTested * perCollider,
+                collisionCount * perCollider );
+  EntityManager::destroyBatch( entities );
+  EntityManager::flushDeferred();
+  ColliderManager::setQuadCellSize( 0.0f );
+  ColliderManager::setBroadphase( ColliderManager::QUADTREE );
+}
+
+void BroadphaseTest::run() {
+  Debug::write( "Running broadphase pair check...\n" );
+  for ( u32 broadphase = 0; broadphase < ColliderManager::NUM_BROADPHASES; ++broadphase ) {
+    u32 wrongFrames = checkPairs( ( ColliderManager::Broadphase )broadphase, 0.0f );
+    ASSERT( wrongFrames == 0, "%s found the wrong pairs in %d frames", ColliderManager::BROADPHASE_NAMES[ broadphase ], wrongFrames );
+    Debug::write( "%s: %d of %d frames with the wrong pairs\n", ColliderManager::BROADPHASE_NAMES[ broadphase ], wrongFrames,
+                  NUM_CHECKED_FRAMES );
+  }
+  u32 wrongFrames = checkPairs( ColliderManager::QUADTREE, 16.0f );
+  ASSERT( wrongFrames == 0, "Quadtree in cells found the wrong pairs in %d frames", wrongFrames );
+  Debug::write( "%s in 16 cells: %d of %d frames with the wrong pairs\n", ColliderManager::BROADPHASE_NAMES[ ColliderManager::QUADTREE ],
+                wrongFrames, NUM_CHECKED_FRAMES );
+  Debug::write( "Running moving collision detection benchmark...\n" );
+  u32 colliderCounts[] = { 1500, NUM_COLLIDERS };
+  u32 movingPercents[] = { 0, 10, 100 };
+  Vec2 testArea = { 800.0f, 460.0f };
+  for ( u32 colliderCount : colliderCounts ) {
+    for ( u32 movingPercent : movingPercents ) {
+      for ( u32 broadphase = 0; broadphase < ColliderManager::NUM_BROADPHASES; ++broadphase ) {
+        benchmarkMovingCollisions( colliderCount, movingPercent, testArea, ( ColliderManager::Broadphase )broadphase, 0.0f );
+      }
+    }
+  }
+  float cellSizes[] = { 0.0f, 64.0f, 256.0f };
+  for ( float cellSize : cellSizes ) {
+    benchmarkMovingCollisions( NUM_COLLIDERS, 100, testArea * 10.0f, ColliderManager::QUADTREE, cellSize );
+  }
+  benchmarkMovingCollisions( NUM_COLLIDERS, 100, testArea * 10.0f, ColliderManager::SWEEP_AND_PRUNE, 0.0f );
+  benchmarkMovingCollisions( NUM_COLLIDERS, 100, testArea * 10.0f, ColliderManager::SPATIAL_HASH, 0.0f );
+  benchmarkMovingCollisions( NUM_COLLIDERS, 100, testArea * 10.0f, ColliderManager::AABB_TREE, 0.0f );
+  benchmarkMovingCollisions( NUM_COLLIDERS, 100, testArea * 10.0f, ColliderManager::LINEAR_QUADTREE, 0.0f );
+  Vec2 band = { 32000.0f, 100.0f };
+  for ( u32 broadphase = 0; broadphase < ColliderManager::NUM_BROADPHASES; ++broadphase ) {
+    benchmarkMovingCollisions( NUM_COLLIDERS, 100, band, ( ColliderManager::Broadphase )broadphase, 0.0f );
+  }
+  u32 manyCounts[] = { 10000, 100000, 1000000 };
+  for ( u32 colliderCount : manyCounts ) {
+    Vec2 worldSize = testArea * sqrtf( colliderCount / ( float )NUM_COLLIDERS );
+    for ( u32 broadphase = 0; broadphase < ColliderManager::NUM_BROADPHASES; ++broadphase ) {
+      benchmarkMovingCollisions( colliderCount, 100, worldSize, ( ColliderManager::Broadphase )broadphase, 0.0f );
+    }
+  }
+}
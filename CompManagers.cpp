@@ -1,311 +1,2146 @@
 #include "EngineCommon.hpp"
 
-ComponentMap< TransformManager::TransformComp > TransformManager::componentMap;
+SoAComponentMap< Vec2, Vec2, float, Transform, Vec2,
+                 ComponentIndex, ComponentIndex, ComponentIndex, ComponentIndex, u8 > TransformManager::componentMap;
+Defragmentation TransformManager::defragmentation;
+bool TransformManager::ordered = true;
+ComponentIndex TransformManager::dirtyFrom = 1;
+u32 TransformManager::parentedCount = 0;
+std::vector< ComponentIndex > TransformManager::rotated;
+std::vector< EntityHandle > TransformManager::previousUpdated;
+std::vector< EntityHandle > TransformManager::updated;
+std::vector< u32 > TransformManager::updatedMarks;
+std::vector< ComponentIndex > TransformManager::resolvedIndices;
+std::vector< std::pair< ComponentIndex, u32 > > TransformManager::resolvedOrder;
 
 void TransformManager::initialize() {
+  componentMap.initialize( ComponentType::TRANSFORM, { &TransformManager::remove, &TransformManager::removeBatch,
+                                                       &TransformManager::flushDeferred, &TransformManager::onLoaded } );
+  componentMap.moved = &TransformManager::relink;
+  EntityManager::initializeDefragmentation( &defragmentation, ComponentType::TRANSFORM, &TransformManager::getSortKeys );
 }
 
 void TransformManager::shutdown() {
 }
 
+void TransformManager::markUpdated( EntityHandle entity ) {
+  if ( entity.index >= updatedMarks.size() ) {
+    updatedMarks.resize( entity.index + 1, 0 );
+  }
+  if ( updatedMarks[ entity.index ] != entity ) {
+    updatedMarks[ entity.index ] = entity;
+    updated.push_back( entity );
+  }
+}
+
+void TransformManager::onLoaded() {
+  // the marks may be of entities that don't exist anymore
+  std::fill( updatedMarks.begin(), updatedMarks.end(), 0 );
+  previousUpdated.clear();
+  updated.clear();
+  const std::vector< ComponentIndex >& parents = componentMap.column< PARENT >();
+  const std::vector< u8 >& dirty = componentMap.column< DIRTY >();
+  ordered = true;
+  dirtyFrom = componentMap.size();
+  parentedCount = 0;
+  for ( u32 compInd = 1; compInd < componentMap.size(); ++compInd ) {
+    markUpdated( componentMap.entities[ compInd ] );
+    if ( parents[ compInd ] != 0 ) {
+      ++parentedCount;
+      ordered = ordered && parents[ compInd ] < compInd;
+    }
+    if ( dirty[ compInd ] ) {
+      dirtyFrom = std::min( dirtyFrom, compInd );
+    }
+  }
+}
+
+void TransformManager::markDirty( ComponentIndex compInd ) {
+  componentMap.change< DIRTY >( compInd ) = 1;
+  dirtyFrom = std::min( dirtyFrom, compInd );
+}
+
+// The components at a and b traded places, or the one at b was copied over
+// the removed one at a, so the links to either one are swapped.
+void TransformManager::relink( ComponentIndex compIndA, ComponentIndex compIndB ) {
+  const std::vector< ComponentIndex >& parents = componentMap.column< PARENT >();
+  const std::vector< ComponentIndex >& firstChildren = componentMap.column< FIRST_CHILD >();
+  const std::vector< ComponentIndex >& nextSiblings = componentMap.column< NEXT_SIBLING >();
+  const std::vector< ComponentIndex >& prevSiblings = componentMap.column< PREV_SIBLING >();
+  const std::vector< u8 >& dirty = componentMap.column< DIRTY >();
+  if ( dirty[ compIndA ] || dirty[ compIndB ] ) {
+    dirtyFrom = std::min( dirtyFrom, std::min( compIndA, compIndB ) );
+  }
+  if ( parentedCount == 0 ) {
+    // only roots without children
+    return;
+  }
+  // the links still hold the old indices
+  auto relabel = [ compIndA, compIndB ]( ComponentIndex compInd ) {
+    return compInd == compIndA ? compIndB : ( compInd == compIndB ? compIndA : compInd );
+  };
+  static std::vector< ComponentIndex > linked;
+  linked.clear();
+  ComponentIndex moved[] = { compIndA, compIndB };
+  for ( ComponentIndex compInd : moved ) {
+    linked.push_back( compInd );
+    if ( parents[ compInd ] != 0 ) {
+      linked.push_back( relabel( parents[ compInd ] ) );
+    }
+    if ( nextSiblings[ compInd ] != 0 ) {
+      linked.push_back( relabel( nextSiblings[ compInd ] ) );
+    }
+    if ( prevSiblings[ compInd ] != 0 ) {
+      linked.push_back( relabel( prevSiblings[ compInd ] ) );
+    }
+    for ( ComponentIndex child = relabel( firstChildren[ compInd ] ); child != 0; child = relabel( nextSiblings[ child ] ) ) {
+      linked.push_back( child );
+    }
+  }
+  std::sort( linked.begin(), linked.end() );
+  linked.erase( std::unique( linked.begin(), linked.end() ), linked.end() );
+  for ( ComponentIndex compInd : linked ) {
+    componentMap.change< PARENT >( compInd ) = relabel( parents[ compInd ] );
+    componentMap.change< FIRST_CHILD >( compInd ) = relabel( firstChildren[ compInd ] );
+    componentMap.change< NEXT_SIBLING >( compInd ) = relabel( nextSiblings[ compInd ] );
+    componentMap.change< PREV_SIBLING >( compInd ) = relabel( prevSiblings[ compInd ] );
+  }
+  for ( ComponentIndex compInd : moved ) {
+    bool misplaced = parents[ compInd ] > compInd;
+    for ( ComponentIndex child = firstChildren[ compInd ]; child != 0 && !misplaced; child = nextSiblings[ child ] ) {
+      misplaced = child < compInd;
+    }
+    ordered = ordered && !misplaced;
+  }
+}
+
+// take the component out of its parent's children
+void TransformManager::detach( ComponentIndex compInd ) {
+  ComponentIndex parent = componentMap.column< PARENT >()[ compInd ];
+  if ( parent == 0 ) {
+    return;
+  }
+  ComponentIndex next = componentMap.column< NEXT_SIBLING >()[ compInd ];
+  ComponentIndex prev = componentMap.column< PREV_SIBLING >()[ compInd ];
+  if ( prev != 0 ) {
+    componentMap.change< NEXT_SIBLING >( prev ) = next;
+  } else {
+    componentMap.change< FIRST_CHILD >( parent ) = next;
+  }
+  if ( next != 0 ) {
+    componentMap.change< PREV_SIBLING >( next ) = prev;
+  }
+  componentMap.change< PARENT >( compInd ) = 0;
+  componentMap.change< NEXT_SIBLING >( compInd ) = 0;
+  componentMap.change< PREV_SIBLING >( compInd ) = 0;
+  --parentedCount;
+}
+
+// detach the component, its children become roots
+void TransformManager::unlink( ComponentIndex compInd ) {
+  if ( parentedCount == 0 ) {
+    return;
+  }
+  detach( compInd );
+  ComponentIndex child = componentMap.column< FIRST_CHILD >()[ compInd ];
+  while ( child != 0 ) {
+    ComponentIndex next = componentMap.column< NEXT_SIBLING >()[ child ];
+    componentMap.change< PARENT >( child ) = 0;
+    componentMap.change< NEXT_SIBLING >( child ) = 0;
+    componentMap.change< PREV_SIBLING >( child ) = 0;
+    markDirty( child );
+    --parentedCount;
+    child = next;
+  }
+  componentMap.change< FIRST_CHILD >( compInd ) = 0;
+}
+
 void TransformManager::set( EntityHandle entity, Transform transform ) {
-  componentMap.set( entity, { entity, transform, transform, 0, 0, 0, 0 }, &TransformManager::remove );
+  // it is appended dirty, a group may swap it forward
+  dirtyFrom = std::min( dirtyFrom, componentMap.size() );
+  Vec2 rotation = unitRotation( transform.orientation );
+  componentMap.set( entity, transform.position, transform.scale, transform.orientation, transform, rotation, 0, 0, 0, 0, 1 );
+  markUpdated( entity );
+}
+
+void TransformManager::remove( EntityHandle entity ) {
+  unlink( componentMap.map.get( entity.index ) );
+  componentMap.remove( entity );
+}
+
+void TransformManager::removeBatch( const std::vector< EntityHandle >& entities ) {
+  for ( u32 entInd = 0; entInd < entities.size(); ++entInd ) {
+    unlink( componentMap.map.get( entities[ entInd ].index ) );
+  }
+  componentMap.removeBatch( entities );
+}
+
+void TransformManager::setDeferred( EntityHandle entity, Transform transform ) {
+  Vec2 rotation = unitRotation( transform.orientation );
+  componentMap.setDeferred( entity, transform.position, transform.scale, transform.orientation, transform, rotation, 0, 0, 0, 0, 1 );
+  // it is still marked in the next frame, when it will have been set
+  markUpdated( entity );
+}
+
+void TransformManager::removeDeferred( EntityHandle entity ) {
+  componentMap.removeDeferred( entity );
+}
+
+void TransformManager::flushDeferred() {
+  std::vector< EntityHandle >& removes = componentMap.deferredRemoves;
+  for ( u32 entInd = 0; entInd < removes.size(); ++entInd ) {
+    if ( EntityManager::isAlive( removes[ entInd ] ) && componentMap.map.get( removes[ entInd ].index ) > 0 ) {
+      unlink( componentMap.map.get( removes[ entInd ].index ) );
+    }
+  }
+  u32 setCount = componentMap.deferredSets.size();
+  componentMap.flushDeferred();
+  // the appended ones are dirty, at most setCount of them
+  dirtyFrom = std::min( dirtyFrom, ( ComponentIndex )std::max( 1, ( int )componentMap.size() - ( int )setCount ) );
+  // the frame ends, this frame's changes become the last frame's
+  previousUpdated.swap( updated );
+  updated.clear();
+  for ( u32 i = 0; i < previousUpdated.size(); ++i ) {
+    updatedMarks[ previousUpdated[ i ].index ] = 0;
+  }
+}
+
+// validates the indices into raw ones and marks their transforms changed
+const std::vector< ComponentIndex >& TransformManager::markChanged( const std::vector< ComponentIndex >& indices ) {
+  static std::vector< ComponentIndex > rawIndices;
+  rawIndices.resize( indices.size() );
+  for ( u32 i = 0; i < indices.size(); ++i ) {
+    ComponentIndex componentInd = componentMap.validate( indices[ i ] );
+    rawIndices[ i ] = componentInd;
+    markDirty( componentInd );
+    markUpdated( componentMap.entities[ componentInd ] );
+  }
+  return rawIndices;
+}
+
+void TransformManager::rotate( const std::vector< ComponentIndex >& indices, const std::vector< float >& rotations ) {
+  PROFILE;
+  ASSERT( indices.size() == rotations.size(), "" );
+  const std::vector< ComponentIndex >& rawIndices = markChanged( indices );
+  SIMD::add( componentMap.changeColumn< ORIENTATION >( rawIndices ).data(), rawIndices.data(), rotations.data(), rawIndices.size() );
+}
+
+void TransformManager::rotateAround( const std::vector< ComponentIndex >& indices, const std::vector< std::pair< Vec2, float > >& rotations ) {
+  PROFILE;
+  ASSERT( indices.size() == rotations.size(), "" );
+  const std::vector< ComponentIndex >& rawIndices = markChanged( indices );
+  static std::vector< Vec2 > points;
+  static std::vector< float > angles, sines, cosines;
+  points.resize( rotations.size() );
+  angles.resize( rotations.size() );
+  sines.resize( rotations.size() );
+  cosines.resize( rotations.size() );
+  for ( u32 i = 0; i < rotations.size(); ++i ) {
+    points[ i ] = rotations[ i ].first;
+    angles[ i ] = rotations[ i ].second;
+  }
+  SIMD::sinCos( angles.data(), angles.size(), sines.data(), cosines.data() );
+  SIMD::add( componentMap.changeColumn< ORIENTATION >( rawIndices ).data(), rawIndices.data(), angles.data(), rawIndices.size() );
+  SIMD::rotateAround( componentMap.changeColumn< POSITION >( rawIndices ).data(), rawIndices.data(), points.data(),
+                      sines.data(), cosines.data(), rawIndices.size() );
+}
+
+void TransformManager::translate( const std::vector< ComponentIndex >& indices, const std::vector< Vec2 >& translations ) {
+  PROFILE;
+  ASSERT( indices.size() == translations.size(), "" );
+  const std::vector< ComponentIndex >& rawIndices = markChanged( indices );
+  SIMD::add( componentMap.changeColumn< POSITION >( rawIndices ).data(), rawIndices.data(), translations.data(), rawIndices.size() );
+}
+
+// Fewer entities than this are applied in the order given, sorting them cost
+// more than it saved while the columns they reach still fit in the caches.
+const u32 RESOLVE_SORT_MIN_ENTITIES = 1 << 19;
+
+// looks up the entities' components into resolvedIndices, sorted so the
+// columns are walked forward when there are enough of them, and
+// resolvedOrder, where each one came from
+void TransformManager::resolve( const std::vector< EntityHandle >& entities ) {
+  VALIDATE_ENTITIES( entities );
+  resolvedOrder.resize( entities.size() );
+  bool sorted = true;
+  for ( u32 i = 0; i < entities.size(); ++i ) {
+    ComponentIndex compInd = componentMap.map.get( entities[ i ].index );
+    ASSERT( compInd > 0, "Entity %d has no transform", entities[ i ].index );
+    resolvedOrder[ i ] = { compInd, i };
+    sorted = sorted && ( i == 0 || resolvedOrder[ i - 1 ].first <= compInd );
+  }
+  // Radix sort on the component index, 11 bits a pass, which is stable so
+  // repeated entities keep their order. A comparison sort cost more than the
+  // locality saved.
+  if ( !sorted && entities.size() >= RESOLVE_SORT_MIN_ENTITIES ) {
+    static std::vector< std::pair< ComponentIndex, u32 > > buffer;
+    buffer.resize( resolvedOrder.size() );
+    const u32 DIGIT_BITS = 11;
+    for ( u32 shift = 0; ( componentMap.size() - 1 ) >> shift > 0; shift += DIGIT_BITS ) {
+      u32 offsets[ 1 << DIGIT_BITS ] = {};
+      for ( u32 i = 0; i < resolvedOrder.size(); ++i ) {
+        ++offsets[ ( resolvedOrder[ i ].first >> shift ) & ( ( 1 << DIGIT_BITS ) - 1 ) ];
+      }
+      u32 offset = 0;
+      for ( u32 digit = 0; digit < 1 << DIGIT_BITS; ++digit ) {
+        u32 count = offsets[ digit ];
+        offsets[ digit ] = offset;
+        offset += count;
+      }
+      for ( u32 i = 0; i < resolvedOrder.size(); ++i ) {
+        buffer[ offsets[ ( resolvedOrder[ i ].first >> shift ) & ( ( 1 << DIGIT_BITS ) - 1 ) ]++ ] = resolvedOrder[ i ];
+      }
+      resolvedOrder.swap( buffer );
+    }
+  }
+  resolvedIndices.resize( resolvedOrder.size() );
+  for ( u32 i = 0; i < resolvedOrder.size(); ++i ) {
+    resolvedIndices[ i ] = componentMap.stamp( resolvedOrder[ i ].first );
+  }
+}
+
+// and the values in the same order
+template< typename T >
+const std::vector< T >& TransformManager::resolve( const std::vector< EntityHandle >& entities, const std::vector< T >& values ) {
+  ASSERT( entities.size() == values.size(), "" );
+  static std::vector< T > sortedValues;
+  resolve( entities );
+  sortedValues.resize( resolvedOrder.size() );
+  for ( u32 i = 0; i < resolvedOrder.size(); ++i ) {
+    sortedValues[ i ] = values[ resolvedOrder[ i ].second ];
+  }
+  return sortedValues;
+}
+
+void TransformManager::rotate( const std::vector< EntityHandle >& entities, const std::vector< float >& rotations ) {
+  const std::vector< float >& sortedRotations = resolve( entities, rotations );
+  rotate( resolvedIndices, sortedRotations );
+}
+
+void TransformManager::rotateAround( const std::vector< EntityHandle >& entities, const std::vector< std::pair< Vec2, float > >& rotations ) {
+  const std::vector< std::pair< Vec2, float > >& sortedRotations = resolve( entities, rotations );
+  rotateAround( resolvedIndices, sortedRotations );
+}
+
+void TransformManager::translate( const std::vector< EntityHandle >& entities, const std::vector< Vec2 >& translations ) {
+  const std::vector< Vec2 >& sortedTranslations = resolve( entities, translations );
+  translate( resolvedIndices, sortedTranslations );
+}
+
+void TransformManager::scale( const std::vector< EntityHandle >& entities, const std::vector< Vec2 >& scales ) {
+  const std::vector< Vec2 >& sortedScales = resolve( entities, scales );
+  scale( resolvedIndices, sortedScales );
+}
+
+void TransformManager::update( const std::vector< EntityHandle >& entities, const std::vector< Transform >& transforms ) {
+  const std::vector< Transform >& sortedTransforms = resolve( entities, transforms );
+  update( resolvedIndices, sortedTransforms );
+}
+
+// the raw index of the entity's transform, marked changed
+ComponentIndex TransformManager::markChanged( EntityHandle entity ) {
+  VALIDATE_ENTITY( entity );
+  ComponentIndex compInd = componentMap.map.get( entity.index );
+  ASSERT( compInd > 0, "Entity %d has no transform", entity.index );
+  markDirty( compInd );
+  markUpdated( entity );
+  return compInd;
+}
+
+// The single entity operations skip the lookup and sort of the batch ones,
+// with the same kernels on one element.
+void TransformManager::rotate( EntityHandle entity, float rotation ) {
+  ComponentIndex compInd = markChanged( entity );
+  componentMap.change< ORIENTATION >( compInd ) += rotation;
+}
+
+void TransformManager::rotateAround( EntityHandle entity, Vec2 point, float rotation ) {
+  ComponentIndex compInd = markChanged( entity );
+  float sine, cosine;
+  SIMD::sinCos( &rotation, 1, &sine, &cosine );
+  componentMap.change< ORIENTATION >( compInd ) += rotation;
+  SIMD::rotateAround( componentMap.changeColumn< POSITION >( compInd, 1 ).data(), &compInd, &point, &sine, &cosine, 1 );
+}
+
+void TransformManager::translate( EntityHandle entity, Vec2 translation ) {
+  ComponentIndex compInd = markChanged( entity );
+  componentMap.change< POSITION >( compInd ) += translation;
+}
+
+void TransformManager::scale( EntityHandle entity, Vec2 scale ) {
+  ComponentIndex compInd = markChanged( entity );
+  componentMap.change< SCALE >( compInd ) = scale;
+}
+
+void TransformManager::update( EntityHandle entity, Transform transform ) {
+  ComponentIndex compInd = markChanged( entity );
+  componentMap.change< POSITION >( compInd ) = transform.position;
+  componentMap.change< SCALE >( compInd ) = transform.scale;
+  componentMap.change< ORIENTATION >( compInd ) = transform.orientation;
+}
+
+void TransformManager::translate( ComponentIndex first, const std::vector< Vec2 >& translations ) {
+  PROFILE;
+  ASSERT( first + translations.size() <= componentMap.size(), "" );
+  SIMD::add( &componentMap.changeColumn< POSITION >( first, translations.size() )[ first ], translations.data(),
+             translations.size() );
+  u8* dirty = &componentMap.changeColumn< DIRTY >( first, translations.size() )[ first ];
+  const EntityHandle* entities = &componentMap.entities[ first ];
+  for ( u32 i = 0; i < translations.size(); ++i ) {
+    dirty[ i ] = 1;
+    markUpdated( entities[ i ] );
+  }
+  if ( !translations.empty() ) {
+    dirtyFrom = std::min( dirtyFrom, first );
+  }
+}
+
+void TransformManager::scale( const std::vector< ComponentIndex >& indices, const std::vector< Vec2 >& scales ) {
+  PROFILE;
+  ASSERT( indices.size() == scales.size(), "" );
+  for ( u32 i = 0; i < indices.size(); ++i ) {
+    ComponentIndex componentInd = componentMap.validate( indices[ i ] );
+    componentMap.change< SCALE >( componentInd ) = scales[ i ];
+    markDirty( componentInd );
+    markUpdated( componentMap.entities[ componentInd ] );
+  }
+}
+
+void TransformManager::update( const std::vector< ComponentIndex >& indices, const std::vector< Transform >& transforms ) {
+  PROFILE;
+  ASSERT( indices.size() == transforms.size(), "" );
+  for ( u32 i = 0; i < indices.size(); ++i ) {
+    ComponentIndex componentInd = componentMap.validate( indices[ i ] );
+    componentMap.change< POSITION >( componentInd ) = transforms[ i ].position;
+    componentMap.change< SCALE >( componentInd ) = transforms[ i ].scale;
+    componentMap.change< ORIENTATION >( componentInd ) = transforms[ i ].orientation;
+    markDirty( componentInd );
+    markUpdated( componentMap.entities[ componentInd ] );
+  }
+}
+
+void TransformManager::get( const std::vector< ComponentIndex >& indices, std::vector< Transform >* result ) {
+  result->reserve( indices.size() );
+  const std::vector< Vec2 >& positions = componentMap.column< POSITION >();
+  const std::vector< Vec2 >& scales = componentMap.column< SCALE >();
+  const std::vector< float >& orientations = componentMap.column< ORIENTATION >();
+  for ( u32 i = 0; i < indices.size(); ++i ) {
+    ComponentIndex componentInd = componentMap.validate( indices[ i ] );
+    result->push_back( { positions[ componentInd ], scales[ componentInd ], orientations[ componentInd ] } );
+  }
+}
+
+void TransformManager::getWorld( const std::vector< ComponentIndex >& indices, std::vector< Transform >* result ) {
+  result->reserve( indices.size() );
+  const std::vector< Transform >& worlds = componentMap.column< WORLD >();
+  for ( u32 i = 0; i < indices.size(); ++i ) {
+    result->push_back( worlds[ componentMap.validate( indices[ i ] ) ] );
+  }
+}
+
+void TransformManager::setParent( EntityHandle child, EntityHandle parent ) {
+  VALIDATE_ENTITY( child );
+  ComponentIndex childInd = componentMap.map.get( child.index );
+  ASSERT( childInd > 0, "Entity %d has no transform", child );
+  ComponentIndex parentInd = 0;
+  if ( parent.index != 0 ) {
+    VALIDATE_ENTITY( parent );
+    parentInd = componentMap.map.get( parent.index );
+    ASSERT( parentInd > 0, "Entity %d has no transform", parent );
+  }
+#ifndef NDEBUG
+  const std::vector< ComponentIndex >& parents = componentMap.column< PARENT >();
+  for ( ComponentIndex ancestor = parentInd; ancestor != 0; ancestor = parents[ ancestor ] ) {
+    ASSERT( ancestor != childInd, "Entity %d would be its own ancestor", child );
+  }
+#endif
+  detach( childInd );
+  if ( parentInd != 0 ) {
+    ComponentIndex next = componentMap.column< FIRST_CHILD >()[ parentInd ];
+    componentMap.change< PARENT >( childInd ) = parentInd;
+    componentMap.change< NEXT_SIBLING >( childInd ) = next;
+    if ( next != 0 ) {
+      componentMap.change< PREV_SIBLING >( next ) = childInd;
+    }
+    componentMap.change< FIRST_CHILD >( parentInd ) = childInd;
+    ++parentedCount;
+    ordered = ordered && parentInd < childInd;
+  }
+  markDirty( childInd );
+}
+
+// from the parent's world transform, which must be up to date
+void TransformManager::updateWorld( ComponentIndex compInd ) {
+  const std::vector< Vec2 >& positions = componentMap.column< POSITION >();
+  const std::vector< Vec2 >& scales = componentMap.column< SCALE >();
+  const std::vector< float >& orientations = componentMap.column< ORIENTATION >();
+  ComponentIndex parent = componentMap.column< PARENT >()[ compInd ];
+  Transform& world = componentMap.change< WORLD >( compInd );
+  float previousOrientation = world.orientation;
+  if ( parent != 0 ) {
+    const Transform& parentWorld = componentMap.column< WORLD >()[ parent ];
+    Vec2 parentRotation = componentMap.column< ROTATION >()[ parent ];
+    world = { parentWorld.position + rotateVec2( positions[ compInd ] * parentWorld.scale, parentRotation ),
+              parentWorld.scale * scales[ compInd ], parentWorld.orientation + orientations[ compInd ] };
+  } else {
+    world = { positions[ compInd ], scales[ compInd ], orientations[ compInd ] };
+  }
+  if ( world.orientation != previousOrientation ) {
+    // the children need it now, the rest are done together at the end
+    if ( componentMap.column< FIRST_CHILD >()[ compInd ] != 0 ) {
+      componentMap.change< ROTATION >( compInd ) = unitRotation( world.orientation );
+    } else {
+      rotated.push_back( compInd );
+    }
+  }
+  componentMap.change< DIRTY >( compInd ) = 0;
+  markUpdated( componentMap.entities[ compInd ] );
+}
+
+void TransformManager::updateRotations() {
+  static std::vector< float > angles, sines, cosines;
+  angles.resize( rotated.size() );
+  sines.resize( rotated.size() );
+  cosines.resize( rotated.size() );
+  const std::vector< Transform >& worlds = componentMap.column< WORLD >();
+  for ( u32 i = 0; i < rotated.size(); ++i ) {
+    angles[ i ] = worlds[ rotated[ i ] ].orientation;
+  }
+  SIMD::sinCos( angles.data(), angles.size(), sines.data(), cosines.data() );
+  for ( u32 i = 0; i < rotated.size(); ++i ) {
+    componentMap.change< ROTATION >( rotated[ i ] ) = { cosines[ i ], sines[ i ] };
+  }
+  rotated.clear();
+}
+
+void TransformManager::updateWorldTransforms() {
+  PROFILE;
+  if ( !ordered ) {
+    sortHierarchy();
+  }
+  if ( !ordered ) {
+    propagateUnordered();
+    updateRotations();
+    return;
+  }
+  const std::vector< ComponentIndex >& parents = componentMap.column< PARENT >();
+  const std::vector< u8 >& dirty = componentMap.column< DIRTY >();
+  // parents come first, so one sweep sees every change to them before their children
+  static std::vector< u8 > changed;
+  changed.resize( componentMap.size() );
+  for ( ComponentIndex compInd = dirtyFrom; compInd < componentMap.size(); ++compInd ) {
+    ComponentIndex parent = parents[ compInd ];
+    // nothing before dirtyFrom changed
+    bool recompute = dirty[ compInd ] || ( parent >= dirtyFrom && changed[ parent ] );
+    changed[ compInd ] = recompute;
+    if ( recompute ) {
+      updateWorld( compInd );
+    }
+  }
+  dirtyFrom = componentMap.size();
+  updateRotations();
+}
+
+// Reorders the components breadth-first: the roots in their current order,
+// then their children, then their grandchildren... The components owned by a
+// group keep their place, it can't be done if any of them has a parent.
+void TransformManager::sortHierarchy() {
+  PROFILE;
+  const std::vector< ComponentIndex >& parents = componentMap.column< PARENT >();
+  const std::vector< ComponentIndex >& firstChildren = componentMap.column< FIRST_CHILD >();
+  const std::vector< ComponentIndex >& nextSiblings = componentMap.column< NEXT_SIBLING >();
+  const std::vector< ComponentIndex >& prevSiblings = componentMap.column< PREV_SIBLING >();
+  u32 ownedCount = EntityManager::getOwnedCount( ComponentType::TRANSFORM );
+  static std::vector< ComponentIndex > order;
+  order.clear();
+  order.reserve( componentMap.size() - 1 );
+  // we count from 1
+  for ( ComponentIndex compInd = 1; compInd <= ownedCount; ++compInd ) {
+    if ( parents[ compInd ] != 0 ) {
+      return;
+    }
+    order.push_back( compInd );
+  }
+  for ( ComponentIndex compInd = ownedCount + 1; compInd < componentMap.size(); ++compInd ) {
+    if ( parents[ compInd ] == 0 ) {
+      order.push_back( compInd );
+    }
+  }
+  for ( u32 orderInd = 0; orderInd < order.size(); ++orderInd ) {
+    for ( ComponentIndex child = firstChildren[ order[ orderInd ] ]; child != 0; child = nextSiblings[ child ] ) {
+      order.push_back( child );
+    }
+  }
+  ASSERT( order.size() + 1 == componentMap.size(), "Hierarchy with %d of %d transforms", ( u32 )order.size(), componentMap.size() - 1 );
+  componentMap.permute( order );
+  static std::vector< ComponentIndex > newIndices;
+  newIndices.resize( componentMap.size() );
+  newIndices[ 0 ] = 0;
+  for ( u32 orderInd = 0; orderInd < order.size(); ++orderInd ) {
+    newIndices[ order[ orderInd ] ] = orderInd + 1;
+  }
+  const std::vector< u8 >& dirty = componentMap.column< DIRTY >();
+  dirtyFrom = componentMap.size();
+  for ( ComponentIndex compInd = 1; compInd < componentMap.size(); ++compInd ) {
+    componentMap.change< PARENT >( compInd ) = newIndices[ parents[ compInd ] ];
+    componentMap.change< FIRST_CHILD >( compInd ) = newIndices[ firstChildren[ compInd ] ];
+    componentMap.change< NEXT_SIBLING >( compInd ) = newIndices[ nextSiblings[ compInd ] ];
+    componentMap.change< PREV_SIBLING >( compInd ) = newIndices[ prevSiblings[ compInd ] ];
+    if ( dirty[ compInd ] && compInd < dirtyFrom ) {
+      dirtyFrom = compInd;
+    }
+  }
+  ordered = true;
+}
+
+// depth first from every root, for when the storage can't be sorted
+void TransformManager::propagateUnordered() {
+  PROFILE;
+  const std::vector< ComponentIndex >& parents = componentMap.column< PARENT >();
+  const std::vector< ComponentIndex >& firstChildren = componentMap.column< FIRST_CHILD >();
+  const std::vector< ComponentIndex >& nextSiblings = componentMap.column< NEXT_SIBLING >();
+  const std::vector< u8 >& dirty = componentMap.column< DIRTY >();
+  // with whether the parent changed
+  static std::vector< std::pair< ComponentIndex, bool > > stack;
+  for ( ComponentIndex root = 1; root < componentMap.size(); ++root ) {
+    if ( parents[ root ] != 0 ) {
+      continue;
+    }
+    stack.push_back( { root, false } );
+    while ( !stack.empty() ) {
+      ComponentIndex compInd = stack.back().first;
+      bool recompute = dirty[ compInd ] || stack.back().second;
+      stack.pop_back();
+      if ( recompute ) {
+        updateWorld( compInd );
+      }
+      for ( ComponentIndex child = firstChildren[ compInd ]; child != 0; child = nextSiblings[ child ] ) {
+        stack.push_back( { child, recompute } );
+      }
+    }
+  }
+  dirtyFrom = componentMap.size();
+}
+
+void TransformManager::getRotations( const std::vector< ComponentIndex >& indices, std::vector< Vec2 >* result ) {
+  result->reserve( indices.size() );
+  const std::vector< Vec2 >& rotations = componentMap.column< ROTATION >();
+  for ( u32 i = 0; i < indices.size(); ++i ) {
+    result->push_back( rotations[ componentMap.validate( indices[ i ] ) ] );
+  }
+}
+
+void TransformManager::lookup( const std::vector< EntityHandle >& entities, LookupResult* result ) {
+  return componentMap.lookup( entities, result );
+}
+
+ComponentMemory TransformManager::getMemoryUsage() {
+  return componentMap.getMemoryUsage();
+}
+
+u32 TransformManager::getSortKeys( ComponentIndex first, u32 count, SortEntry* result ) {
+  u32 end = std::min( first + count, componentMap.size() );
+  const std::vector< Vec2 >& positions = componentMap.column< POSITION >();
+  for ( u32 compInd = first; compInd < end; ++compInd ) {
+    result[ compInd - first ] = { mortonCode( positions[ compInd ], SORT_CELL_SIZE ), componentMap.entities[ compInd ] };
+  }
+  return ( end > first ) ? end - first : 0;
+}
+
+bool TransformManager::defragment( u32 budget ) {
+  if ( parentedCount > 0 ) {
+    return true;
+  }
+  return EntityManager::defragment( defragmentation, budget );
+}
+
+std::vector< EntityHandle >& TransformManager::getLastUpdated() {
+  static std::vector< EntityHandle > result;
+  result.clear();
+  // the ones that also moved in this frame are only listed once, in updated
+  for ( u32 i = 0; i < previousUpdated.size(); ++i ) {
+    EntityHandle entity = previousUpdated[ i ];
+    if ( entity.index >= updatedMarks.size() || updatedMarks[ entity.index ] != entity ) {
+      result.push_back( entity );
+    }
+  }
+  result.insert( result.end(), updated.begin(), updated.end() );
+  return result;
+}
+
+SoAComponentMap< Shape, Vec2, Vec2, Shape, Rect, u32, u32, u32, u32 > ColliderManager::componentMap;
+std::vector< EntityHandle > ColliderManager::added;
+std::vector< std::vector< Collision > > ColliderManager::collisions;
+std::vector< ColliderManager::ColliderPair > ColliderManager::candidatePairs;
+const char* ColliderManager::BROADPHASE_NAMES[ NUM_BROADPHASES ] = { "quadtree", "sweep and prune", "spatial hash", "AABB tree",
+                                                                       "linear quadtree" };
+ColliderManager::Broadphase ColliderManager::broadphase = ColliderManager::QUADTREE;
+ColliderManager::BroadphaseStats ColliderManager::broadphaseStats = {};
+std::vector< ColliderManager::QuadNode > ColliderManager::quadTree;
+std::vector< u32 > ColliderManager::freeQuadNodes;
+float ColliderManager::quadCellSize = 0.0f;
+std::unordered_map< u64, u32 > ColliderManager::quadCells;
+std::vector< u32 > ColliderManager::freeQuadCells;
+std::vector< ColliderManager::ColliderPair > ColliderManager::quadPairs;
+bool ColliderManager::quadPairsKept = false;
+std::vector< ComponentIndex > ColliderManager::quadStale;
+std::vector< u8 > ColliderManager::quadRequeried;
+std::vector< ColliderManager::SweepEntry > ColliderManager::sweepList;
+u32 ColliderManager::sweepAxis = 0;
+u32 ColliderManager::sweepAppended = 0;
+u32 ColliderManager::sweepRemoved = 0;
+Vec2 ColliderManager::gridOrigin = {};
+float ColliderManager::gridCellSize = 0.0f;
+u32 ColliderManager::gridRowStride = 0;
+bool ColliderManager::gridWrapped = false;
+std::vector< ColliderManager::BoundsEntry > ColliderManager::gridEntries;
+std::vector< u32 > ColliderManager::gridBucketStarts;
+std::vector< u32 > ColliderManager::gridBucketStamps;
+std::vector< ColliderManager::BoundsEntry > ColliderManager::gridOversized;
+std::vector< ColliderManager::TreeNode > ColliderManager::aabbTree;
+u32 ColliderManager::aabbTreeRoot = 0;
+std::vector< u32 > ColliderManager::freeTreeNodes;
+std::vector< u32 > ColliderManager::linearQuadKeys;
+std::vector< ColliderManager::BoundsEntry > ColliderManager::linearQuadEntries;
+std::vector< ColliderManager::LinearQuadNode > ColliderManager::linearQuadTree;
+Defragmentation ColliderManager::defragmentation;
+
+// the bounds of colliders without a transform yet, which take no space
+const Rect EMPTY_BOUNDS = { { INFINITY, INFINITY }, { -INFINITY, -INFINITY } };
+// The quadtree's boundary is the colliders' extent with a quarter of it more
+// on each side, and is only made smaller again once the extent fits in a
+// third of it on both axes, half as big as when the boundary was set.
+const float QUAD_BOUNDARY_MARGIN = 0.25f;
+const float QUAD_BOUNDARY_MIN_MARGIN = 1.0f;
+const float QUAD_SHRINK_RATIO = 1.0f / 3.0f;
+// the sweep axis changes when the colliders spread this much more along the other
+const float SWEEP_AXIS_SWITCH_RATIO = 1.5f;
+// more new entries than this get sorted in with the rest from scratch
+const u32 SWEEP_MAX_INSERTIONS = 64;
+// the spatial hash cells are this many median radii wide
+const float GRID_CELL_RADII = 4.0f;
+// and there are at least this many buckets per collider in the table
+const u32 GRID_BUCKETS_PER_COLLIDER = 2;
+// The AABB tree leaves are this much bigger than the colliders on each side,
+// and this many frames of their last move further ahead. A moving collider
+// whose leaf is bigger than this many times both is put back in a tighter one.
+const float AABB_TREE_MARGIN = 1.0f;
+const float AABB_TREE_PREDICTION = 2.0f;
+const float AABB_TREE_SLACK = 4.0f;
+
+static Rect getBounds( Shape shape ) {
+  if ( shape.type == ShapeType::CIRCLE ) {
+    Vec2 extent = { shape.circle.radius, shape.circle.radius };
+    return { shape.circle.center - extent, shape.circle.center + extent };
+  }
+  return shape.aaRect;
+}
+
+static bool overlaps( Rect a, Rect b ) {
+  return a.min.x <= b.max.x && b.min.x <= a.max.x && a.min.y <= b.max.y && b.min.y <= a.max.y;
+}
+
+static bool contains( Rect outer, Rect inner ) {
+  return inner.min.x >= outer.min.x && inner.min.y >= outer.min.y &&
+         inner.max.x <= outer.max.x && inner.max.y <= outer.max.y;
+}
+
+static Rect getUnion( Rect a, Rect b ) {
+  return { { std::min( a.min.x, b.min.x ), std::min( a.min.y, b.min.y ) },
+           { std::max( a.max.x, b.max.x ), std::max( a.max.y, b.max.y ) } };
+}
+
+static float getPerimeter( Rect rect ) {
+  return 2.0f * ( rect.max.x - rect.min.x + rect.max.y - rect.min.y );
+}
+
+// the bounds with the AABB tree's margin and prediction, scaled
+static Rect fattenBounds( Rect bounds, Vec2 displacement, float scale ) {
+  float margin = AABB_TREE_MARGIN * scale;
+  Vec2 ahead = displacement * ( AABB_TREE_PREDICTION * scale );
+  Rect fat = { { bounds.min.x - margin, bounds.min.y - margin }, { bounds.max.x + margin, bounds.max.y + margin } };
+  if ( ahead.x < 0.0f ) {
+    fat.min.x += ahead.x;
+  } else {
+    fat.max.x += ahead.x;
+  }
+  if ( ahead.y < 0.0f ) {
+    fat.min.y += ahead.y;
+  } else {
+    fat.max.y += ahead.y;
+  }
+  return fat;
+}
+
+// LSD radix sort by the upper 32 bits, a byte at a time, skipping the bytes
+// that are the same in all of them
+static void radixSortUpperHalves( std::vector< u64 >* items, std::vector< u64 >* scratch ) {
+  scratch->resize( items->size() );
+  for ( u32 shift = 32; shift < 64; shift += 8 ) {
+    u32 starts[ 257 ] = {};
+    for ( u32 itemInd = 0; itemInd < items->size(); ++itemInd ) {
+      ++starts[ ( ( *items )[ itemInd ] >> shift & 0xff ) + 1 ];
+    }
+    if ( items->empty() || starts[ ( ( *items )[ 0 ] >> shift & 0xff ) + 1 ] == items->size() ) {
+      continue;
+    }
+    for ( u32 byte = 1; byte < 257; ++byte ) {
+      starts[ byte ] += starts[ byte - 1 ];
+    }
+    for ( u32 itemInd = 0; itemInd < items->size(); ++itemInd ) {
+      u64 item = ( *items )[ itemInd ];
+      ( *scratch )[ starts[ item >> shift & 0xff ]++ ] = item;
+    }
+    items->swap( *scratch );
+  }
+}
+
+// The spatial hash bucket of a grid cell, the mask is the table size - 1. The
+// grid is wrapped around the table row after row, so the cells next to each
+// other in a row are in buckets next to each other.
+static u32 getCellBucket( s32 cellX, s32 cellY, u32 rowStride, u32 mask ) {
+  return ( ( u32 )cellX + ( u32 )cellY * rowStride ) & mask;
+}
+
+// grid cells are keyed by their coordinates
+static u64 getCellKey( s32 cellX, s32 cellY ) {
+  return ( u64 )( u32 )cellX << 32 | ( u32 )cellY;
+}
+
+// empties the tree and puts back every collider that was in it
+void ColliderManager::buildQuadTree( Rect boundary ) {
+  PROFILE;
+  quadTree.resize( 2 );
+  freeQuadNodes.clear();
+  quadCells.clear();
+  freeQuadCells.clear();
+  initQuadNode( 1, boundary, 0, 0 );
+  const std::vector< u32 >& nodes = componentMap.column< QUAD_NODE >();
+  for ( u32 colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    if ( nodes[ colliderInd ] != 0 ) {
+      componentMap.change< QUAD_NODE >( colliderInd ) = 0;
+      insertIntoQuadTree( colliderInd );
+    }
+  }
+}
+
+// Rebuilds the tree around the colliders when they got out of its boundary
+// or shrank well inside it, the margins keep it from happening every frame.
+void ColliderManager::fitQuadTree() {
+  const std::vector< Rect >& bounds = componentMap.column< WORLD_BOUNDS >();
+  Rect extent = SIMD::bounds( bounds.data() + 1, componentMap.size() - 1 );
+  if ( extent.min.x > extent.max.x ) {
+    return;
+  }
+  const Rect& boundary = quadTree[ 1 ].boundary;
+  Vec2 extentSize = extent.max - extent.min;
+  Vec2 boundarySize = boundary.max - boundary.min;
+  bool shrunk = extentSize.x < boundarySize.x * QUAD_SHRINK_RATIO && extentSize.y < boundarySize.y * QUAD_SHRINK_RATIO;
+  if ( contains( boundary, extent ) && !shrunk ) {
+    return;
+  }
+  Vec2 margin = extentSize * QUAD_BOUNDARY_MARGIN;
+  margin.x = std::max( margin.x, QUAD_BOUNDARY_MIN_MARGIN );
+  margin.y = std::max( margin.y, QUAD_BOUNDARY_MIN_MARGIN );
+  buildQuadTree( { extent.min - margin, extent.max + margin } );
+}
+
+void ColliderManager::initQuadNode( u32 nodeInd, Rect boundary, u32 parent, u32 depth ) {
+  QuadNode& node = quadTree[ nodeInd ];
+  Vec2 halfSize = ( boundary.max - boundary.min ) / 2.0f;
+  node.boundary = boundary;
+  node.looseBoundary = { boundary.min - halfSize, boundary.max + halfSize };
+  node.parent = parent;
+  node.firstChild = 0;
+  node.count = 0;
+  node.depth = depth;
+  node.elements.clear();
+}
+
+// the child whose boundary has the point, points outside go to the closest one
+u32 ColliderManager::getQuadChild( u32 nodeInd, Vec2 point ) {
+  const QuadNode& node = quadTree[ nodeInd ];
+  Vec2 center = node.boundary.min + ( node.boundary.max - node.boundary.min ) / 2.0f;
+  bool right = point.x >= center.x;
+  bool top = point.y >= center.y;
+  // top-right, bottom-right, bottom-left, top-left
+  return node.firstChild + ( right ? ( top ? 0 : 1 ) : ( top ? 3 : 2 ) );
+}
+
+// the root takes anything
+bool ColliderManager::fitsQuadNode( Rect bounds, u32 nodeInd ) {
+  return nodeInd == 1 || contains( quadTree[ nodeInd ].looseBoundary, bounds );
+}
+
+// the root of a cell's tree, a child of the root with no siblings
+u32 ColliderManager::addQuadCell( u64 key, Rect boundary ) {
+  u32 nodeInd;
+  if ( !freeQuadCells.empty() ) {
+    nodeInd = freeQuadCells.back();
+    freeQuadCells.pop_back();
+  } else {
+    nodeInd = quadTree.size();
+    quadTree.resize( quadTree.size() + 1 );
+  }
+  initQuadNode( nodeInd, boundary, 1, 0 );
+  quadCells[ key ] = nodeInd;
+  return nodeInd;
+}
+
+void ColliderManager::removeQuadCell( u32 nodeInd ) {
+  Vec2 center = ( quadTree[ nodeInd ].boundary.min + quadTree[ nodeInd ].boundary.max ) / 2.0f;
+  quadCells.erase( getCellKey( ( s32 )floorf( center.x / quadCellSize ), ( s32 )floorf( center.y / quadCellSize ) ) );
+  freeQuadCells.push_back( nodeInd );
+}
+
+// the nodes a query for the bounds starts from, the root and in an unbounded
+// world the cells whose loose boundary the bounds overlap
+void ColliderManager::getQuadRoots( Rect bounds, std::vector< u32 >* result ) {
+  result->assign( 1, 1 );
+  if ( quadCellSize == 0.0f ) {
+    return;
+  }
+  // loose boundaries reach half a cell into the neighbours
+  float minX = ceilf( bounds.min.x / quadCellSize - 1.5f ), maxX = floorf( bounds.max.x / quadCellSize + 0.5f );
+  float minY = ceilf( bounds.min.y / quadCellSize - 1.5f ), maxY = floorf( bounds.max.y / quadCellSize + 0.5f );
+  if ( ( maxX - minX + 1.0f ) * ( maxY - minY + 1.0f ) > quadCells.size() ) {
+    for ( std::unordered_map< u64, u32 >::const_iterator cell = quadCells.begin(); cell != quadCells.end(); ++cell ) {
+      if ( overlaps( bounds, quadTree[ cell->second ].looseBoundary ) ) {
+        result->push_back( cell->second );
+      }
+    }
+    return;
+  }
+  for ( s32 cellY = ( s32 )minY; cellY <= ( s32 )maxY; ++cellY ) {
+    for ( s32 cellX = ( s32 )minX; cellX <= ( s32 )maxX; ++cellX ) {
+      std::unordered_map< u64, u32 >::const_iterator cell = quadCells.find( getCellKey( cellX, cellY ) );
+      if ( cell != quadCells.end() && overlaps( bounds, quadTree[ cell->second ].looseBoundary ) ) {
+        result->push_back( cell->second );
+      }
+    }
+  }
+}
+
+void ColliderManager::subdivideQuadNode( u32 nodeInd ) {
+  PROFILE;
+  u32 firstChild;
+  if ( !freeQuadNodes.empty() ) {
+    firstChild = freeQuadNodes.back();
+    freeQuadNodes.pop_back();
+  } else {
+    firstChild = quadTree.size();
+    quadTree.resize( quadTree.size() + 4 );
+  }
+  Vec2 min = quadTree[ nodeInd ].boundary.min;
+  Vec2 max = quadTree[ nodeInd ].boundary.max;
+  Vec2 center = min + ( max - min ) / 2.0f;
+  u32 depth = quadTree[ nodeInd ].depth + 1;
+  initQuadNode( firstChild, { center, max }, nodeInd, depth );
+  initQuadNode( firstChild + 1, { { center.x, min.y }, { max.x, center.y } }, nodeInd, depth );
+  initQuadNode( firstChild + 2, { min, center }, nodeInd, depth );
+  initQuadNode( firstChild + 3, { { min.x, center.y }, { center.x, max.y } }, nodeInd, depth );
+  QuadNode& node = quadTree[ nodeInd ];
+  node.firstChild = firstChild;
+  // move down the colliders that fit in a child, the rest stay
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  u32 kept = 0;
+  for ( u32 elemInd = 0; elemInd < node.elements.size(); ++elemInd ) {
+    ComponentIndex colliderInd = node.elements[ elemInd ];
+    Rect bounds = worldBounds[ colliderInd ];
+    u32 childInd = getQuadChild( nodeInd, ( bounds.min + bounds.max ) / 2.0f );
+    if ( fitsQuadNode( bounds, childInd ) ) {
+      QuadNode& child = quadTree[ childInd ];
+      componentMap.change< QUAD_NODE >( colliderInd ) = childInd;
+      componentMap.change< QUAD_SLOT >( colliderInd ) = child.elements.size();
+      child.elements.push_back( colliderInd );
+      ++child.count;
+    } else {
+      componentMap.change< QUAD_SLOT >( colliderInd ) = kept;
+      node.elements[ kept++ ] = colliderInd;
+    }
+  }
+  node.elements.resize( kept );
+}
+
+// brings every collider in the subtree up to the node, which becomes a leaf
+void ColliderManager::mergeQuadNode( u32 nodeInd ) {
+  PROFILE;
+  static std::vector< u32 > blocks;
+  blocks.assign( 1, quadTree[ nodeInd ].firstChild );
+  quadTree[ nodeInd ].firstChild = 0;
+  while ( !blocks.empty() ) {
+    u32 firstChild = blocks.back();
+    blocks.pop_back();
+    freeQuadNodes.push_back( firstChild );
+    for ( u32 childInd = firstChild; childInd < firstChild + 4; ++childInd ) {
+      QuadNode& child = quadTree[ childInd ];
+      for ( u32 elemInd = 0; elemInd < child.elements.size(); ++elemInd ) {
+        ComponentIndex colliderInd = child.elements[ elemInd ];
+        componentMap.change< QUAD_NODE >( colliderInd ) = nodeInd;
+        componentMap.change< QUAD_SLOT >( colliderInd ) = quadTree[ nodeInd ].elements.size();
+        quadTree[ nodeInd ].elements.push_back( colliderInd );
+      }
+      child.elements.clear();
+      if ( child.firstChild != 0 ) {
+        blocks.push_back( child.firstChild );
+      }
+    }
+  }
+}
+
+void ColliderManager::insertIntoQuadTree( ComponentIndex colliderInd ) {
+  ASSERT( colliderInd < componentMap.size(), "Component index %d out of bounds", colliderInd );
+  ASSERT( componentMap.column< QUAD_NODE >()[ colliderInd ] == 0, "Collider %d already in the quadtree", colliderInd );
+  Rect bounds = componentMap.column< WORLD_BOUNDS >()[ colliderInd ];
+  Vec2 center = ( bounds.min + bounds.max ) / 2.0f;
+  u32 nodeInd = 1;
+  bool descend = true;
+  if ( quadCellSize > 0.0f ) {
+    // the root keeps what is too big for the cell that has its center
+    ++quadTree[ 1 ].count;
+    s32 cellX = ( s32 )floorf( center.x / quadCellSize ), cellY = ( s32 )floorf( center.y / quadCellSize );
+    Rect cellBoundary = { { cellX * quadCellSize, cellY * quadCellSize }, { ( cellX + 1 ) * quadCellSize, ( cellY + 1 ) * quadCellSize } };
+    Vec2 halfSize = { quadCellSize / 2.0f, quadCellSize / 2.0f };
+    descend = contains( { cellBoundary.min - halfSize, cellBoundary.max + halfSize }, bounds );
+    if ( descend ) {
+      u64 key = getCellKey( cellX, cellY );
+      std::unordered_map< u64, u32 >::const_iterator cell = quadCells.find( key );
+      nodeInd = ( cell != quadCells.end() ) ? cell->second : addQuadCell( key, cellBoundary );
+    }
+  }
+  while ( descend ) {
+    ++quadTree[ nodeInd ].count;
+    if ( quadTree[ nodeInd ].firstChild == 0 ) {
+      if ( quadTree[ nodeInd ].elements.size() < QUAD_NODE_CAPACITY || quadTree[ nodeInd ].depth == QUAD_TREE_MAX_DEPTH ) {
+        break;
+      }
+      subdivideQuadNode( nodeInd );
+    }
+    u32 childInd = getQuadChild( nodeInd, center );
+    if ( !fitsQuadNode( bounds, childInd ) ) {
+      break;
+    }
+    nodeInd = childInd;
+  }
+  componentMap.change< QUAD_NODE >( colliderInd ) = nodeInd;
+  componentMap.change< QUAD_SLOT >( colliderInd ) = quadTree[ nodeInd ].elements.size();
+  quadTree[ nodeInd ].elements.push_back( colliderInd );
+}
+
+void ColliderManager::removeFromQuadTree( ComponentIndex colliderInd ) {
+  const std::vector< u32 >& nodes = componentMap.column< QUAD_NODE >();
+  const std::vector< u32 >& slots = componentMap.column< QUAD_SLOT >();
+  u32 nodeInd = nodes[ colliderInd ];
+  if ( nodeInd == 0 ) {
+    return;
+  }
+  std::vector< ComponentIndex >& elements = quadTree[ nodeInd ].elements;
+  ComponentIndex last = elements.back();
+  elements[ slots[ colliderInd ] ] = last;
+  componentMap.change< QUAD_SLOT >( last ) = slots[ colliderInd ];
+  elements.pop_back();
+  componentMap.change< QUAD_NODE >( colliderInd ) = 0;
+  // the highest subtree that got small enough merges
+  u32 mergeInd = 0, cellInd = 0;
+  for ( u32 ancestor = nodeInd; ancestor != 0; ancestor = quadTree[ ancestor ].parent ) {
+    --quadTree[ ancestor ].count;
+    if ( quadTree[ ancestor ].firstChild != 0 && quadTree[ ancestor ].count <= QUAD_NODE_CAPACITY / 2 ) {
+      mergeInd = ancestor;
+    }
+    if ( quadTree[ ancestor ].parent == 1 ) {
+      cellInd = ancestor;
+    }
+  }
+  if ( mergeInd != 0 ) {
+    mergeQuadNode( mergeInd );
+  }
+  // empty cells go away
+  if ( quadCellSize > 0.0f && cellInd != 0 && quadTree[ cellInd ].count == 0 ) {
+    removeQuadCell( cellInd );
+  }
+}
+
+// The components at a and b traded places, or the one at b was copied over
+// the removed one at a, which had already left the broadphase.
+void ColliderManager::relinkBroadphase( ComponentIndex colliderIndA, ComponentIndex colliderIndB ) {
+  const std::vector< u32 >& nodes = componentMap.column< QUAD_NODE >();
+  const std::vector< u32 >& slots = componentMap.column< QUAD_SLOT >();
+  const std::vector< u32 >& sweepSlots = componentMap.column< SWEEP_SLOT >();
+  const std::vector< u32 >& leaves = componentMap.column< TREE_LEAF >();
+  if ( nodes[ colliderIndB ] != 0 ) {
+    quadTree[ nodes[ colliderIndB ] ].elements[ slots[ colliderIndB ] ] = colliderIndB;
+  }
+  if ( nodes[ colliderIndA ] != 0 ) {
+    quadTree[ nodes[ colliderIndA ] ].elements[ slots[ colliderIndA ] ] = colliderIndA;
+  }
+  if ( broadphase == QUADTREE ) {
+    quadStale.push_back( colliderIndA );
+    quadStale.push_back( colliderIndB );
+  }
+  if ( sweepSlots[ colliderIndB ] != 0 ) {
+    sweepList[ sweepSlots[ colliderIndB ] ].collider = colliderIndB;
+  }
+  if ( sweepSlots[ colliderIndA ] != 0 ) {
+    sweepList[ sweepSlots[ colliderIndA ] ].collider = colliderIndA;
+  }
+  if ( leaves[ colliderIndB ] != 0 ) {
+    aabbTree[ leaves[ colliderIndB ] ].collider = colliderIndB;
+  }
+  if ( leaves[ colliderIndA ] != 0 ) {
+    aabbTree[ leaves[ colliderIndA ] ].collider = colliderIndA;
+  }
+}
+
+void ColliderManager::updateQuadTree( const std::vector< ComponentIndex >& refreshed ) {
+  PROFILE;
+  if ( quadCellSize == 0.0f ) {
+    fitQuadTree();
+  }
+  // only the colliders that left their node's loose boundary go somewhere
+  // else in the quadtree
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  const std::vector< u32 >& nodes = componentMap.column< QUAD_NODE >();
+  for ( u32 refreshedInd = 0; refreshedInd < refreshed.size(); ++refreshedInd ) {
+    ComponentIndex colliderInd = refreshed[ refreshedInd ];
+    if ( nodes[ colliderInd ] == 0 ) {
+      insertIntoQuadTree( colliderInd );
+    } else if ( !fitsQuadNode( worldBounds[ colliderInd ], nodes[ colliderInd ] ) ) {
+      removeFromQuadTree( colliderInd );
+      insertIntoQuadTree( colliderInd );
+    }
+  }
+  broadphaseStats.colliderCount = quadTree[ 1 ].count;
+}
+
+// The pairs kept from the last update whose colliders are still where they
+// were, then each collider looked up again against the ones in the nodes
+// whose loose boundary its bounds overlap, but the ones after it that are
+// looked up too, which find it themselves.
+void ColliderManager::findQuadTreePairs( const std::vector< ComponentIndex >& refreshed ) {
+  PROFILE;
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  const std::vector< u32 >& nodes = componentMap.column< QUAD_NODE >();
+  static std::vector< ComponentIndex > requeried;
+  static std::vector< u32 > nodeStack;
+  // flags are left cleared for the next update
+  quadRequeried.resize( componentMap.size(), 0 );
+  requeried.clear();
+  // when most of them have to be looked up again, all of them are
+  bool everyCollider = !quadPairsKept || ( refreshed.size() + quadStale.size() ) * 2 >= componentMap.size();
+  if ( !everyCollider ) {
+    quadStale.insert( quadStale.end(), refreshed.begin(), refreshed.end() );
+    for ( u32 staleInd = 0; staleInd < quadStale.size(); ++staleInd ) {
+      ComponentIndex colliderInd = quadStale[ staleInd ];
+      if ( colliderInd < componentMap.size() && !quadRequeried[ colliderInd ] ) {
+        quadRequeried[ colliderInd ] = 1;
+        requeried.push_back( colliderInd );
+      }
+    }
+    u32 keptCount = 0;
+    for ( u32 pairInd = 0; pairInd < quadPairs.size(); ++pairInd ) {
+      ColliderPair pair = quadPairs[ pairInd ];
+      // the last collider was removed without anything moved over it
+      if ( pair.b < componentMap.size() && !quadRequeried[ pair.a ] && !quadRequeried[ pair.b ] ) {
+        quadPairs[ keptCount++ ] = pair;
+      }
+    }
+    quadPairs.resize( keptCount );
+  } else {
+    quadPairs.clear();
+  }
+  u32 pairsTested = 0;
+  u32 queryCount = everyCollider ? componentMap.size() - 1 : requeried.size();
+  for ( u32 queryInd = 0; queryInd < queryCount; ++queryInd ) {
+    ComponentIndex collI = everyCollider ? queryInd + 1 : requeried[ queryInd ];
+    if ( nodes[ collI ] == 0 ) {
+      continue;
+    }
+    Rect bounds = worldBounds[ collI ];
+    getQuadRoots( bounds, &nodeStack );
+    while ( !nodeStack.empty() ) {
+      const QuadNode& quadNode = quadTree[ nodeStack.back() ];
+      nodeStack.pop_back();
+      for ( u32 elemInd = 0; elemInd < quadNode.elements.size(); ++elemInd ) {
+        ComponentIndex collJ = quadNode.elements[ elemInd ];
+        if ( collJ <= collI && ( everyCollider || collJ == collI || quadRequeried[ collJ ] ) ) {
+          continue;
+        }
+        ++pairsTested;
+        if ( overlaps( bounds, worldBounds[ collJ ] ) ) {
+          quadPairs.push_back( collI < collJ ? ColliderPair { collI, collJ } : ColliderPair { collJ, collI } );
+        }
+      }
+      if ( quadNode.firstChild == 0 ) {
+        continue;
+      }
+      for ( u32 childInd = quadNode.firstChild; childInd < quadNode.firstChild + 4; ++childInd ) {
+        if ( quadTree[ childInd ].count > 0 && overlaps( bounds, quadTree[ childInd ].looseBoundary ) ) {
+          nodeStack.push_back( childInd );
+        }
+      }
+    }
+  }
+  for ( u32 requeriedInd = 0; requeriedInd < requeried.size(); ++requeriedInd ) {
+    quadRequeried[ requeried[ requeriedInd ] ] = 0;
+  }
+  quadStale.clear();
+  quadPairsKept = true;
+  candidatePairs.insert( candidatePairs.end(), quadPairs.begin(), quadPairs.end() );
+  broadphaseStats.pairsTested = pairsTested;
+}
+
+// every collider with a sweep slot gets back in, sorted from scratch
+void ColliderManager::buildSweepList() {
+  PROFILE;
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  const std::vector< u32 >& sweepSlots = componentMap.column< SWEEP_SLOT >();
+  sweepList.assign( 1, { -INFINITY, -INFINITY, EMPTY_BOUNDS, 0 } );
+  for ( ComponentIndex colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    if ( sweepSlots[ colliderInd ] != 0 ) {
+      Rect bounds = worldBounds[ colliderInd ];
+      float min = sweepAxis == 0 ? bounds.min.x : bounds.min.y;
+      float max = sweepAxis == 0 ? bounds.max.x : bounds.max.y;
+      sweepList.push_back( { min, max, bounds, colliderInd } );
+    }
+  }
+  std::sort( sweepList.begin() + 1, sweepList.end(), []( const SweepEntry& a, const SweepEntry& b ) {
+    return a.min < b.min;
+  } );
+  for ( u32 entryInd = 1; entryInd < sweepList.size(); ++entryInd ) {
+    componentMap.change< SWEEP_SLOT >( sweepList[ entryInd ].collider ) = entryInd;
+  }
+  sweepAppended = 0;
+  sweepRemoved = 0;
+}
+
+// the entry stays, so the list stays sorted, until the next update drops it
+void ColliderManager::removeFromSweepList( ComponentIndex colliderInd ) {
+  const std::vector< u32 >& sweepSlots = componentMap.column< SWEEP_SLOT >();
+  if ( sweepSlots[ colliderInd ] != 0 ) {
+    sweepList[ sweepSlots[ colliderInd ] ].collider = 0;
+    componentMap.change< SWEEP_SLOT >( colliderInd ) = 0;
+    ++sweepRemoved;
+  }
+}
+
+// Insertion sort, only the entries that moved past others get moved. Many
+// new ones at the end would each go a long way, so then it sorts it all.
+void ColliderManager::sortSweepList() {
+  PROFILE;
+  if ( sweepAppended > SWEEP_MAX_INSERTIONS ) {
+    buildSweepList();
+    return;
+  }
+  sweepAppended = 0;
+  for ( u32 entryInd = 2; entryInd < sweepList.size(); ++entryInd ) {
+    if ( sweepList[ entryInd ].min >= sweepList[ entryInd - 1 ].min ) {
+      continue;
+    }
+    SweepEntry entry = sweepList[ entryInd ];
+    u32 slot = entryInd;
+    // the sentinel stops it
+    for ( ; entry.min < sweepList[ slot - 1 ].min; --slot ) {
+      sweepList[ slot ] = sweepList[ slot - 1 ];
+      componentMap.change< SWEEP_SLOT >( sweepList[ slot ].collider ) = slot;
+    }
+    sweepList[ slot ] = entry;
+    componentMap.change< SWEEP_SLOT >( entry.collider ) = slot;
+  }
+}
+
+void ColliderManager::updateSweepList( const std::vector< ComponentIndex >& refreshed ) {
+  PROFILE;
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  const std::vector< u32 >& sweepSlots = componentMap.column< SWEEP_SLOT >();
+  // drop the removed colliders
+  if ( sweepRemoved > 0 ) {
+    u32 kept = 1;
+    for ( u32 entryInd = 1; entryInd < sweepList.size(); ++entryInd ) {
+      if ( sweepList[ entryInd ].collider != 0 ) {
+        sweepList[ kept ] = sweepList[ entryInd ];
+        componentMap.change< SWEEP_SLOT >( sweepList[ kept ].collider ) = kept;
+        ++kept;
+      }
+    }
+    sweepList.resize( kept );
+    sweepRemoved = 0;
+  }
+  // sweep along the axis the colliders spread the most, with some slack so
+  // that it doesn't go back and forth
+  Rect extent = SIMD::bounds( worldBounds.data() + 1, componentMap.size() - 1 );
+  Vec2 extentSize = extent.max - extent.min;
+  float along = sweepAxis == 0 ? extentSize.x : extentSize.y;
+  float across = sweepAxis == 0 ? extentSize.y : extentSize.x;
+  bool switchAxis = across > along * SWEEP_AXIS_SWITCH_RATIO;
+  if ( switchAxis ) {
+    sweepAxis = 1 - sweepAxis;
+  }
+  for ( u32 refreshedInd = 0; refreshedInd < refreshed.size(); ++refreshedInd ) {
+    ComponentIndex colliderInd = refreshed[ refreshedInd ];
+    Rect bounds = worldBounds[ colliderInd ];
+    SweepEntry entry = { sweepAxis == 0 ? bounds.min.x : bounds.min.y, sweepAxis == 0 ? bounds.max.x : bounds.max.y,
+                         bounds, colliderInd };
+    if ( sweepSlots[ colliderInd ] == 0 ) {
+      componentMap.change< SWEEP_SLOT >( colliderInd ) = sweepList.size();
+      sweepList.push_back( entry );
+      ++sweepAppended;
+    } else {
+      sweepList[ sweepSlots[ colliderInd ] ] = entry;
+    }
+  }
+  if ( switchAxis ) {
+    buildSweepList();
+  } else {
+    sortSweepList();
+  }
+  broadphaseStats.colliderCount = sweepList.size() - 1;
 }
 
-void TransformManager::remove( EntityHandle entity ) {
-  componentMap.remove( entity );
+// each entry against the ones after it that start before it ends
+void ColliderManager::findSweepPairs() {
+  PROFILE;
+  u32 pairsTested = 0;
+  u32 entryCount = sweepList.size();
+  for ( u32 entryI = 1; entryI < entryCount; ++entryI ) {
+    const SweepEntry& entry = sweepList[ entryI ];
+    for ( u32 entryJ = entryI + 1; entryJ < entryCount && sweepList[ entryJ ].min <= entry.max; ++entryJ ) {
+      ++pairsTested;
+      if ( overlaps( entry.bounds, sweepList[ entryJ ].bounds ) ) {
+        ComponentIndex collI = entry.collider, collJ = sweepList[ entryJ ].collider;
+        candidatePairs.push_back( collI < collJ ? ColliderPair{ collI, collJ } : ColliderPair{ collJ, collI } );
+      }
+    }
+  }
+  broadphaseStats.pairsTested = pairsTested;
 }
 
-// TODO verify that component indices have not been invalidated
-void TransformManager::rotate( const std::vector< ComponentIndex >& indices, const std::vector< float >& rotations ) {
+// every collider with bounds goes in the bucket of the cell that has its center,
+// in one counting sort so the buckets are contiguous in gridEntries
+void ColliderManager::buildSpatialHash() {
   PROFILE;
-  ASSERT( indices.size() == rotations.size(), "" );
-  for ( u32 i = 0; i < indices.size(); ++i ) {
-    componentMap.components[ indices[ i ] ].local.orientation += rotations[ i ];
-    // TODO mark transform component as updated
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  static std::vector< float > radii;
+  radii.clear();
+  for ( ComponentIndex colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    Rect bounds = worldBounds[ colliderInd ];
+    if ( bounds.min.x <= bounds.max.x ) {
+      radii.push_back( 0.5f * std::max( bounds.max.x - bounds.min.x, bounds.max.y - bounds.min.y ) );
+    }
+  }
+  gridEntries.clear();
+  gridOversized.clear();
+  gridBucketStarts.assign( 2, 0 );
+  broadphaseStats.colliderCount = radii.size();
+  if ( radii.empty() ) {
+    return;
+  }
+  std::nth_element( radii.begin(), radii.begin() + radii.size() / 2, radii.end() );
+  gridCellSize = GRID_CELL_RADII * radii[ radii.size() / 2 ];
+  // colliders scaled down to points still need cells of some size
+  if ( gridCellSize <= 0.0f ) {
+    gridCellSize = 1.0f;
+  }
+  // anything bigger than a cell could overlap colliders more than a cell away
+  float maxRadius = 0.5f * gridCellSize;
+  // the cells count from a cell off the corner of the colliders' extent, so
+  // the neighbours of theirs aren't below 0
+  Rect extent = SIMD::bounds( worldBounds.data() + 1, componentMap.size() - 1 );
+  gridOrigin = extent.min - Vec2{ gridCellSize, gridCellSize };
+  gridRowStride = ( u32 )std::min( ( extent.max.x - extent.min.x ) / gridCellSize, 1.0e9f ) + 3;
+  u32 bucketCount = 1;
+  while ( bucketCount < GRID_BUCKETS_PER_COLLIDER * radii.size() ) {
+    bucketCount *= 2;
+  }
+  // with a row of cells to spare on each side nothing near the colliders shares a bucket
+  float rowCount = floorf( ( extent.max.y - extent.min.y ) / gridCellSize ) + 3.0f;
+  gridWrapped = rowCount * gridRowStride > bucketCount;
+  u32 mask = bucketCount - 1;
+  float cellsPerUnit = 1.0f / gridCellSize;
+  static std::vector< BoundsEntry > unsorted;
+  static std::vector< u32 > buckets;
+  unsorted.clear();
+  buckets.clear();
+  gridBucketStarts.assign( bucketCount + 1, 0 );
+  for ( ComponentIndex colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    Rect bounds = worldBounds[ colliderInd ];
+    if ( bounds.min.x > bounds.max.x ) {
+      continue;
+    }
+    if ( bounds.max.x - bounds.min.x > 2.0f * maxRadius || bounds.max.y - bounds.min.y > 2.0f * maxRadius ) {
+      gridOversized.push_back( { bounds, colliderInd } );
+      continue;
+    }
+    Vec2 center = ( bounds.min + bounds.max ) * 0.5f - gridOrigin;
+    u32 bucket = getCellBucket( ( s32 )( center.x * cellsPerUnit ), ( s32 )( center.y * cellsPerUnit ), gridRowStride, mask );
+    unsorted.push_back( { bounds, colliderInd } );
+    buckets.push_back( bucket );
+    ++gridBucketStarts[ bucket ];
+  }
+  // the starts count up to the end of each bucket, then back down while filling it
+  for ( u32 bucket = 1; bucket <= bucketCount; ++bucket ) {
+    gridBucketStarts[ bucket ] += gridBucketStarts[ bucket - 1 ];
+  }
+  gridEntries.resize( unsorted.size() );
+  for ( u32 entryInd = unsorted.size(); entryInd-- > 0; ) {
+    gridEntries[ --gridBucketStarts[ buckets[ entryInd ] ] ] = unsorted[ entryInd ];
   }
 }
 
-void TransformManager::rotateAround( const std::vector< ComponentIndex >& indices, const std::vector< std::pair< Vec2, float > >& rotations ) {
+// Each collider looks in the 3 by 3 cells around its own, which have all the
+// ones whose bounds can reach it. If the grid wraps different cells can share a
+// bucket, so the stamps keep a query from going through one twice, otherwise
+// the 3 cells of a row are one run of entries.
+void ColliderManager::findSpatialHashPairs() {
   PROFILE;
-  ASSERT( indices.size() == rotations.size(), "" );
-  for ( u32 i = 0; i < indices.size(); ++i ) {  
-    ComponentIndex componentInd = indices[ i ];
-    Transform transform = componentMap.components[ componentInd ].local;
-    Vec2 point = rotations[ i ].first;
-    float rotation = rotations[ i ].second;
-    transform.orientation += rotation;
-    transform.position = rotateVec2( transform.position - point, rotation ) + point;
-    componentMap.components[ componentInd ].local = transform;
-    // TODO mark transform component as updated
+  u32 bucketCount = gridBucketStarts.size() - 1;
+  u32 mask = bucketCount - 1;
+  gridBucketStamps.assign( bucketCount, 0 );
+  float cellsPerUnit = 1.0f / gridCellSize;
+  s32 runLength = gridWrapped ? 1 : 3;
+  u32 query = 0;
+  u32 pairsTested = 0;
+  for ( u32 entryInd = 0; entryInd < gridEntries.size(); ++entryInd ) {
+    const BoundsEntry& entry = gridEntries[ entryInd ];
+    Vec2 center = ( entry.bounds.min + entry.bounds.max ) * 0.5f - gridOrigin;
+    s32 cellX = ( s32 )( center.x * cellsPerUnit ), cellY = ( s32 )( center.y * cellsPerUnit );
+    ++query;
+    for ( s32 offsetY = -1; offsetY <= 1; ++offsetY ) {
+      for ( s32 offsetX = -1; offsetX <= 1; offsetX += runLength ) {
+        u32 bucket = getCellBucket( cellX + offsetX, cellY + offsetY, gridRowStride, mask );
+        if ( gridWrapped ) {
+          if ( gridBucketStamps[ bucket ] == query ) {
+            continue;
+          }
+          gridBucketStamps[ bucket ] = query;
+        }
+        u32 end = gridBucketStarts[ bucket + runLength ];
+        for ( u32 otherInd = gridBucketStarts[ bucket ]; otherInd < end; ++otherInd ) {
+          const BoundsEntry& other = gridEntries[ otherInd ];
+          // the other one finds the pair too
+          if ( other.collider <= entry.collider ) {
+            continue;
+          }
+          ++pairsTested;
+          if ( overlaps( entry.bounds, other.bounds ) ) {
+            candidatePairs.push_back( { entry.collider, other.collider } );
+          }
+        }
+      }
+    }
+  }
+  // the oversized ones go through every cell whose colliders can reach their bounds
+  float margin = 0.5f * gridCellSize;
+  for ( u32 bigInd = 0; bigInd < gridOversized.size(); ++bigInd ) {
+    const BoundsEntry& big = gridOversized[ bigInd ];
+    float minX = floorf( ( big.bounds.min.x - margin - gridOrigin.x ) * cellsPerUnit );
+    float maxX = floorf( ( big.bounds.max.x + margin - gridOrigin.x ) * cellsPerUnit );
+    float minY = floorf( ( big.bounds.min.y - margin - gridOrigin.y ) * cellsPerUnit );
+    float maxY = floorf( ( big.bounds.max.y + margin - gridOrigin.y ) * cellsPerUnit );
+    ++query;
+    // with more cells than buckets they all get looked at anyway
+    bool everyBucket = ( maxX - minX + 1.0f ) * ( maxY - minY + 1.0f ) >= bucketCount;
+    for ( s32 cellY = ( s32 )minY; !everyBucket && cellY <= ( s32 )maxY; ++cellY ) {
+      for ( s32 cellX = ( s32 )minX; cellX <= ( s32 )maxX; ++cellX ) {
+        u32 bucket = getCellBucket( cellX, cellY, gridRowStride, mask );
+        if ( gridBucketStamps[ bucket ] == query ) {
+          continue;
+        }
+        gridBucketStamps[ bucket ] = query;
+        for ( u32 otherInd = gridBucketStarts[ bucket ]; otherInd < gridBucketStarts[ bucket + 1 ]; ++otherInd ) {
+          const BoundsEntry& other = gridEntries[ otherInd ];
+          ++pairsTested;
+          if ( overlaps( big.bounds, other.bounds ) ) {
+            candidatePairs.push_back( big.collider < other.collider ? ColliderPair{ big.collider, other.collider }
+                                                                    : ColliderPair{ other.collider, big.collider } );
+          }
+        }
+      }
+    }
+    for ( u32 otherInd = 0; everyBucket && otherInd < gridEntries.size(); ++otherInd ) {
+      const BoundsEntry& other = gridEntries[ otherInd ];
+      ++pairsTested;
+      if ( overlaps( big.bounds, other.bounds ) ) {
+        candidatePairs.push_back( big.collider < other.collider ? ColliderPair{ big.collider, other.collider }
+                                                                : ColliderPair{ other.collider, big.collider } );
+      }
+    }
+    for ( u32 otherInd = bigInd + 1; otherInd < gridOversized.size(); ++otherInd ) {
+      const BoundsEntry& other = gridOversized[ otherInd ];
+      ++pairsTested;
+      if ( overlaps( big.bounds, other.bounds ) ) {
+        candidatePairs.push_back( big.collider < other.collider ? ColliderPair{ big.collider, other.collider }
+                                                                : ColliderPair{ other.collider, big.collider } );
+      }
+    }
   }
+  broadphaseStats.pairsTested = pairsTested;
 }
 
-void TransformManager::translate( const std::vector< ComponentIndex >& indices, const std::vector< Vec2 >& translations ) {
+// empties the tree and puts back every collider that was in it
+void ColliderManager::buildAABBTree() {
   PROFILE;
-  ASSERT( indices.size() == translations.size(), "" );
-  for ( u32 i = 0; i < indices.size(); ++i ) {
-    componentMap.components[ indices[ i ] ].local.position += translations[ i ];
-    // TODO mark transform component as updated
+  aabbTree.assign( 1, {} );
+  aabbTreeRoot = 0;
+  freeTreeNodes.clear();
+  const std::vector< u32 >& leaves = componentMap.column< TREE_LEAF >();
+  for ( ComponentIndex colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    if ( leaves[ colliderInd ] != 0 ) {
+      componentMap.change< TREE_LEAF >( colliderInd ) = 0;
+      insertIntoAABBTree( colliderInd );
+    }
   }
 }
 
-void TransformManager::scale( const std::vector< ComponentIndex >& indices, const std::vector< Vec2 >& scales ) {
-  PROFILE;
-  ASSERT( indices.size() == scales.size(), "" );
-  for ( u32 i = 0; i < indices.size(); ++i ) {
-    componentMap.components[ indices[ i ] ].local.scale = scales[ i ];
-    // TODO mark transform component as updated
+u32 ColliderManager::allocateTreeNode() {
+  if ( freeTreeNodes.empty() ) {
+    aabbTree.push_back( {} );
+    return aabbTree.size() - 1;
   }
+  u32 nodeInd = freeTreeNodes.back();
+  freeTreeNodes.pop_back();
+  aabbTree[ nodeInd ] = {};
+  return nodeInd;
 }
 
-void TransformManager::update( const std::vector< ComponentIndex >& indices, const std::vector< Transform >& transforms ) {
-  PROFILE;
-  ASSERT( indices.size() == transforms.size(), "" );
-  for ( u32 i = 0; i < indices.size(); ++i ) {
-    componentMap.components[ indices[ i ] ].local = transforms[ i ];
-    // TODO mark transform component as updated
+// Goes down to the node that would cost the least area as the leaf's
+// sibling, counting what its ancestors grow, and puts a new branch with both
+// in its place.
+void ColliderManager::insertTreeLeaf( u32 leafInd ) {
+  if ( aabbTreeRoot == 0 ) {
+    aabbTreeRoot = leafInd;
+    aabbTree[ leafInd ].parent = 0;
+    return;
+  }
+  Rect leafBounds = aabbTree[ leafInd ].bounds;
+  u32 siblingInd = aabbTreeRoot;
+  while ( aabbTree[ siblingInd ].left != 0 ) {
+    const TreeNode& node = aabbTree[ siblingInd ];
+    float combinedPerimeter = getPerimeter( getUnion( node.bounds, leafBounds ) );
+    // a new branch here, or what the children would add
+    float cost = 2.0f * combinedPerimeter;
+    float inheritedCost = 2.0f * ( combinedPerimeter - getPerimeter( node.bounds ) );
+    float childCosts[ 2 ];
+    u32 children[ 2 ] = { node.left, node.right };
+    for ( u32 childInd = 0; childInd < 2; ++childInd ) {
+      const TreeNode& child = aabbTree[ children[ childInd ] ];
+      childCosts[ childInd ] = getPerimeter( getUnion( child.bounds, leafBounds ) ) + inheritedCost;
+      if ( child.left != 0 ) {
+        childCosts[ childInd ] -= getPerimeter( child.bounds );
+      }
+    }
+    if ( cost < childCosts[ 0 ] && cost < childCosts[ 1 ] ) {
+      break;
+    }
+    siblingInd = childCosts[ 0 ] < childCosts[ 1 ] ? children[ 0 ] : children[ 1 ];
+  }
+  u32 oldParentInd = aabbTree[ siblingInd ].parent;
+  u32 parentInd = allocateTreeNode();
+  TreeNode& parent = aabbTree[ parentInd ];
+  parent.bounds = getUnion( aabbTree[ siblingInd ].bounds, leafBounds );
+  parent.parent = oldParentInd;
+  parent.left = siblingInd;
+  parent.right = leafInd;
+  parent.height = aabbTree[ siblingInd ].height + 1;
+  aabbTree[ siblingInd ].parent = parentInd;
+  aabbTree[ leafInd ].parent = parentInd;
+  if ( oldParentInd == 0 ) {
+    aabbTreeRoot = parentInd;
+  } else if ( aabbTree[ oldParentInd ].left == siblingInd ) {
+    aabbTree[ oldParentInd ].left = parentInd;
+  } else {
+    aabbTree[ oldParentInd ].right = parentInd;
+  }
+  // the ancestors grow and rebalance
+  for ( u32 nodeInd = parentInd; nodeInd != 0; nodeInd = aabbTree[ nodeInd ].parent ) {
+    nodeInd = balanceTreeNode( nodeInd );
+    TreeNode& node = aabbTree[ nodeInd ];
+    node.height = 1 + std::max( aabbTree[ node.left ].height, aabbTree[ node.right ].height );
+    node.bounds = getUnion( aabbTree[ node.left ].bounds, aabbTree[ node.right ].bounds );
   }
 }
 
-// TODO verify that component indices have not been invalidated
-void TransformManager::get( const std::vector< ComponentIndex >& indices, std::vector< Transform >* result ) {
-  result->reserve( indices.size() );
-  for ( u32 i = 0; i < indices.size(); ++i ) {
-    result->push_back( componentMap.components[ indices[ i ] ].local );
+// the leaf's sibling takes its parent's place, the leaf node is left as it is
+void ColliderManager::removeTreeLeaf( u32 leafInd ) {
+  if ( leafInd == aabbTreeRoot ) {
+    aabbTreeRoot = 0;
+    return;
+  }
+  u32 parentInd = aabbTree[ leafInd ].parent;
+  u32 grandParentInd = aabbTree[ parentInd ].parent;
+  u32 siblingInd = aabbTree[ parentInd ].left == leafInd ? aabbTree[ parentInd ].right : aabbTree[ parentInd ].left;
+  aabbTree[ siblingInd ].parent = grandParentInd;
+  freeTreeNodes.push_back( parentInd );
+  if ( grandParentInd == 0 ) {
+    aabbTreeRoot = siblingInd;
+    return;
+  }
+  if ( aabbTree[ grandParentInd ].left == parentInd ) {
+    aabbTree[ grandParentInd ].left = siblingInd;
+  } else {
+    aabbTree[ grandParentInd ].right = siblingInd;
+  }
+  for ( u32 nodeInd = grandParentInd; nodeInd != 0; nodeInd = aabbTree[ nodeInd ].parent ) {
+    nodeInd = balanceTreeNode( nodeInd );
+    TreeNode& node = aabbTree[ nodeInd ];
+    node.height = 1 + std::max( aabbTree[ node.left ].height, aabbTree[ node.right ].height );
+    node.bounds = getUnion( aabbTree[ node.left ].bounds, aabbTree[ node.right ].bounds );
   }
 }
 
-void TransformManager::lookup( const std::vector< EntityHandle >& entities, LookupResult* result ) {
-  return componentMap.lookup( entities, result );
+// If one child of the branch is more than a level taller than the other, the
+// taller one is rotated up in its place and gives it its own taller child.
+// Returns the node now where the branch was.
+u32 ColliderManager::balanceTreeNode( u32 nodeInd ) {
+  TreeNode& node = aabbTree[ nodeInd ];
+  if ( node.left == 0 || node.height < 2 ) {
+    return nodeInd;
+  }
+  s32 balance = ( s32 )aabbTree[ node.right ].height - ( s32 )aabbTree[ node.left ].height;
+  if ( balance >= -1 && balance <= 1 ) {
+    return nodeInd;
+  }
+  // the taller child goes up and the shorter stays
+  bool rightUp = balance > 1;
+  u32 upInd = rightUp ? node.right : node.left;
+  u32 stayInd = rightUp ? node.left : node.right;
+  TreeNode& up = aabbTree[ upInd ];
+  up.parent = node.parent;
+  node.parent = upInd;
+  if ( up.parent == 0 ) {
+    aabbTreeRoot = upInd;
+  } else if ( aabbTree[ up.parent ].left == nodeInd ) {
+    aabbTree[ up.parent ].left = upInd;
+  } else {
+    aabbTree[ up.parent ].right = upInd;
+  }
+  // the taller grandchild stays with the one going up, the other goes down
+  u32 tallInd = up.left, shortInd = up.right;
+  if ( aabbTree[ shortInd ].height > aabbTree[ tallInd ].height ) {
+    std::swap( tallInd, shortInd );
+  }
+  up.left = nodeInd;
+  up.right = tallInd;
+  node.left = stayInd;
+  node.right = shortInd;
+  aabbTree[ shortInd ].parent = nodeInd;
+  node.bounds = getUnion( aabbTree[ stayInd ].bounds, aabbTree[ shortInd ].bounds );
+  node.height = 1 + std::max( aabbTree[ stayInd ].height, aabbTree[ shortInd ].height );
+  up.bounds = getUnion( node.bounds, aabbTree[ tallInd ].bounds );
+  up.height = 1 + std::max( node.height, aabbTree[ tallInd ].height );
+  return upInd;
 }
 
-std::vector< EntityHandle >& TransformManager::getLastUpdated() {
-  // TODO actually compute which transforms have been updated since last frame
-  // component index 0 is not valid
-  static std::vector< EntityHandle > result;
-  result.clear();
-  result.reserve( componentMap.components.size() - 1 );
-  for ( u32 entInd = 1; entInd < componentMap.components.size(); ++entInd ) {
-    result.push_back( componentMap.components[ entInd ].entity );
+void ColliderManager::insertIntoAABBTree( ComponentIndex colliderInd ) {
+  Rect bounds = componentMap.column< WORLD_BOUNDS >()[ colliderInd ];
+  u32 leafInd = allocateTreeNode();
+  TreeNode& leaf = aabbTree[ leafInd ];
+  leaf.bounds = fattenBounds( bounds, {}, 1.0f );
+  leaf.collider = colliderInd;
+  leaf.lastCenter = ( bounds.min + bounds.max ) * 0.5f;
+  componentMap.change< TREE_LEAF >( colliderInd ) = leafInd;
+  insertTreeLeaf( leafInd );
+}
+
+void ColliderManager::removeFromAABBTree( ComponentIndex colliderInd ) {
+  const std::vector< u32 >& leaves = componentMap.column< TREE_LEAF >();
+  if ( leaves[ colliderInd ] != 0 ) {
+    removeTreeLeaf( leaves[ colliderInd ] );
+    freeTreeNodes.push_back( leaves[ colliderInd ] );
+    componentMap.change< TREE_LEAF >( colliderInd ) = 0;
   }
-  return result;
 }
 
-ComponentMap< ColliderManager::ColliderComp > ColliderManager::componentMap;
-std::vector< Shape > ColliderManager::transformedShapes;
-std::vector< std::vector< Collision > > ColliderManager::collisions;
-std::vector< ColliderManager::QuadNode > ColliderManager::quadTree;
+// Only the colliders that got out of their leaf's bounds, or that have much
+// more room than they need, go somewhere else in the tree. The ones that
+// moved are given room ahead of them for the next frames.
+void ColliderManager::updateAABBTree( const std::vector< ComponentIndex >& refreshed ) {
+  PROFILE;
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  const std::vector< u32 >& leaves = componentMap.column< TREE_LEAF >();
+  for ( u32 refreshedInd = 0; refreshedInd < refreshed.size(); ++refreshedInd ) {
+    ComponentIndex colliderInd = refreshed[ refreshedInd ];
+    if ( leaves[ colliderInd ] == 0 ) {
+      insertIntoAABBTree( colliderInd );
+      continue;
+    }
+    u32 leafInd = leaves[ colliderInd ];
+    Rect bounds = worldBounds[ colliderInd ];
+    Vec2 center = ( bounds.min + bounds.max ) * 0.5f;
+    Vec2 displacement = center - aabbTree[ leafInd ].lastCenter;
+    aabbTree[ leafInd ].lastCenter = center;
+    // the same collider can be refreshed twice, the second time it hasn't moved
+    bool moved = displacement.x != 0.0f || displacement.y != 0.0f;
+    if ( contains( aabbTree[ leafInd ].bounds, bounds ) &&
+         ( !moved || contains( fattenBounds( bounds, displacement, AABB_TREE_SLACK ), aabbTree[ leafInd ].bounds ) ) ) {
+      continue;
+    }
+    removeTreeLeaf( leafInd );
+    aabbTree[ leafInd ].bounds = fattenBounds( bounds, displacement, 1.0f );
+    insertTreeLeaf( leafInd );
+  }
+  u32 nodeCount = aabbTree.size() - 1 - freeTreeNodes.size();
+  broadphaseStats.colliderCount = ( nodeCount + 1 ) / 2;
+}
+
+// The tree against itself: each branch's children against each other and
+// each on its own, going down whichever of two overlapping nodes is bigger,
+// so each pair of leaves comes up once. Pairs of nodes are only pushed if
+// they overlap, and a leaf on its own not at all.
+void ColliderManager::findAABBTreePairs() {
+  PROFILE;
+  if ( aabbTreeRoot == 0 || aabbTree[ aabbTreeRoot ].left == 0 ) {
+    return;
+  }
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  static std::vector< std::pair< u32, u32 > > nodePairs;
+  nodePairs.assign( 1, std::make_pair( aabbTreeRoot, aabbTreeRoot ) );
+  u32 pairsTested = 0;
+  while ( !nodePairs.empty() ) {
+    u32 nodeIndA = nodePairs.back().first, nodeIndB = nodePairs.back().second;
+    nodePairs.pop_back();
+    const TreeNode& nodeA = aabbTree[ nodeIndA ];
+    const TreeNode& nodeB = aabbTree[ nodeIndB ];
+    if ( nodeIndA == nodeIndB ) {
+      if ( aabbTree[ nodeA.left ].left != 0 ) {
+        nodePairs.push_back( std::make_pair( nodeA.left, nodeA.left ) );
+      }
+      if ( aabbTree[ nodeA.right ].left != 0 ) {
+        nodePairs.push_back( std::make_pair( nodeA.right, nodeA.right ) );
+      }
+      if ( overlaps( aabbTree[ nodeA.left ].bounds, aabbTree[ nodeA.right ].bounds ) ) {
+        nodePairs.push_back( std::make_pair( nodeA.left, nodeA.right ) );
+      }
+    } else if ( nodeA.left == 0 && nodeB.left == 0 ) {
+      ++pairsTested;
+      ComponentIndex collA = nodeA.collider, collB = nodeB.collider;
+      if ( overlaps( worldBounds[ collA ], worldBounds[ collB ] ) ) {
+        candidatePairs.push_back( collA < collB ? ColliderPair{ collA, collB } : ColliderPair{ collB, collA } );
+      }
+    } else if ( nodeB.left == 0 || ( nodeA.left != 0 && getPerimeter( nodeA.bounds ) > getPerimeter( nodeB.bounds ) ) ) {
+      if ( overlaps( aabbTree[ nodeA.left ].bounds, nodeB.bounds ) ) {
+        nodePairs.push_back( std::make_pair( nodeA.left, nodeIndB ) );
+      }
+      if ( overlaps( aabbTree[ nodeA.right ].bounds, nodeB.bounds ) ) {
+        nodePairs.push_back( std::make_pair( nodeA.right, nodeIndB ) );
+      }
+    } else {
+      if ( overlaps( nodeA.bounds, aabbTree[ nodeB.left ].bounds ) ) {
+        nodePairs.push_back( std::make_pair( nodeIndA, nodeB.left ) );
+      }
+      if ( overlaps( nodeA.bounds, aabbTree[ nodeB.right ].bounds ) ) {
+        nodePairs.push_back( std::make_pair( nodeIndA, nodeB.right ) );
+      }
+    }
+  }
+  broadphaseStats.pairsTested = pairsTested;
+}
 
-void ColliderManager::buildQuadTree(Rect boundary) {
+void ColliderManager::buildLinearQuadTree() {
   PROFILE;
-  quadTree.clear();
-  quadTree.push_back( {} );
-  QuadNode rootNode = {};
-  rootNode.boundary.aaRect = boundary;
-  quadTree.push_back( rootNode );
-  for ( u32 colliderInd = 1; colliderInd < componentMap.components.size(); ++colliderInd ) {
-    insertIntoQuadTree( colliderInd );
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  static std::vector< u64 > items, scratch;
+  static std::vector< BoundsEntry > unsorted;
+  items.clear();
+  unsorted.clear();
+  linearQuadTree.resize( 1 );
+  Rect extent = SIMD::bounds( worldBounds.data() + 1, componentMap.size() - 1 );
+  float size = std::max( std::max( extent.max.x - extent.min.x, extent.max.y - extent.min.y ), QUAD_BOUNDARY_MIN_MARGIN );
+  float cellsPerUnit = ( 1 << LINEAR_QUAD_DEPTH ) / size;
+  u32 maxCell = ( 1 << LINEAR_QUAD_DEPTH ) - 1;
+  for ( ComponentIndex colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    Rect bounds = worldBounds[ colliderInd ];
+    if ( bounds.min.x > bounds.max.x ) {
+      continue;
+    }
+    Vec2 center = ( bounds.min + bounds.max ) * 0.5f - extent.min;
+    u32 cellX = std::min( ( u32 )( center.x * cellsPerUnit ), maxCell );
+    u32 cellY = std::min( ( u32 )( center.y * cellsPerUnit ), maxCell );
+    // the deepest level whose cells are at least as big as the collider
+    float colliderSize = std::max( bounds.max.x - bounds.min.x, bounds.max.y - bounds.min.y );
+    s32 level = LINEAR_QUAD_DEPTH;
+    if ( colliderSize > 0.0f ) {
+      s32 exponent;
+      frexpf( size / colliderSize, &exponent );
+      level = std::max( 0, std::min( exponent - 1, level ) );
+    }
+    // the code of the cell at its level is that of the first cell in it at the deepest
+    u32 code = spreadBits( cellX ) | spreadBits( cellY ) << 1;
+    code &= ~( ( 1u << 2 * ( LINEAR_QUAD_DEPTH - level ) ) - 1 );
+    items.push_back( ( u64 )( code << 4 | level ) << 32 | unsorted.size() );
+    unsorted.push_back( { bounds, colliderInd } );
+  }
+  broadphaseStats.colliderCount = items.size();
+  radixSortUpperHalves( &items, &scratch );
+  linearQuadKeys.resize( items.size() );
+  linearQuadEntries.resize( items.size() );
+  for ( u32 itemInd = 0; itemInd < items.size(); ++itemInd ) {
+    linearQuadKeys[ itemInd ] = items[ itemInd ] >> 32;
+    linearQuadEntries[ itemInd ] = unsorted[ ( u32 )items[ itemInd ] ];
+  }
+  if ( items.empty() ) {
+    return;
   }
-  // debug render space partitions 
-  for ( u32 nodeInd = 1; nodeInd < quadTree.size(); ++nodeInd ) {
-    QuadNode quadNode = quadTree[ nodeInd ];
-    if ( !quadNode.isLeaf ) {
+  // the nodes are split in the order they were added, so each level after the other
+  Rect boundary = { extent.min, extent.min + Vec2{ size, size } };
+  linearQuadTree.push_back( { boundary, EMPTY_BOUNDS, 0, 0, ( u32 )items.size(), 0, 0, 0 } );
+  for ( u32 nodeInd = 1; nodeInd < linearQuadTree.size(); ++nodeInd ) {
+    LinearQuadNode node = linearQuadTree[ nodeInd ];
+    u32 ownKey = node.code << 4 | node.level;
+    u32 ownEnd = node.begin;
+    while ( ownEnd < node.end && linearQuadKeys[ ownEnd ] == ownKey ) {
+      ++ownEnd;
+    }
+    linearQuadTree[ nodeInd ].ownEnd = ownEnd;
+    if ( node.end - node.begin <= QUAD_NODE_CAPACITY || node.level == LINEAR_QUAD_DEPTH ) {
       continue;
     }
-    Debug::drawRect( quadNode.boundary.aaRect, { 1, 1, 1, 0.3f } );
-    for ( int i = 0; i <= quadNode.elements.lastInd; ++i ) {
-      ComponentIndex ci = quadNode.elements._[ i ];
-      Debug::drawShape( transformedShapes[ ci ], Debug::BLUE );
+    linearQuadTree[ nodeInd ].firstChild = linearQuadTree.size();
+    u32 childShift = 2 * ( LINEAR_QUAD_DEPTH - node.level - 1 );
+    Vec2 childSize = ( node.boundary.max - node.boundary.min ) * 0.5f;
+    u32 begin = ownEnd;
+    for ( u32 childInd = 0; childInd < 4; ++childInd ) {
+      u32 childCode = node.code | childInd << childShift;
+      u32 end = node.end;
+      if ( childInd < 3 ) {
+        u32 nextKey = ( childCode + ( 1u << childShift ) ) << 4;
+        end = std::lower_bound( linearQuadKeys.begin() + begin, linearQuadKeys.begin() + node.end, nextKey ) -
+              linearQuadKeys.begin();
+      }
+      Vec2 min = node.boundary.min + Vec2{ ( float )( childInd & 1 ), ( float )( childInd >> 1 ) } * childSize;
+      linearQuadTree.push_back( { { min, min + childSize }, EMPTY_BOUNDS, begin, begin, end, 0, childCode, node.level + 1 } );
+      begin = end;
+    }
+  }
+  // the children come after their parent, so going backwards their bounds are there first
+  for ( u32 nodeInd = linearQuadTree.size() - 1; nodeInd > 0; --nodeInd ) {
+    LinearQuadNode& node = linearQuadTree[ nodeInd ];
+    u32 end = node.firstChild == 0 ? node.end : node.ownEnd;
+    node.bounds = EMPTY_BOUNDS;
+    for ( u32 entryInd = node.begin; entryInd < end; ++entryInd ) {
+      node.bounds = getUnion( node.bounds, linearQuadEntries[ entryInd ].bounds );
+    }
+    for ( u32 childInd = node.firstChild; node.firstChild != 0 && childInd < node.firstChild + 4; ++childInd ) {
+      node.bounds = getUnion( node.bounds, linearQuadTree[ childInd ].bounds );
     }
   }
 }
 
-// FIXME if QuadBucket::CAPACITY + 1 colliders are at the center of the node
-//       we will subdivide it forever
-void ColliderManager::subdivideQuadNode(u32 nodeInd) {
+// like findQuadTreePairs(), going through the colliders in their sorted order
+// and down the nodes whose colliders' bounds they overlap
+void ColliderManager::findLinearQuadTreePairs() {
   PROFILE;
-  // backup elements
-  QuadBucket elements = std::move( quadTree[ nodeInd ].elements );
-  quadTree[ nodeInd ].isLeaf = false;
-  Vec2 min = quadTree[ nodeInd ].boundary.aaRect.min;
-  Vec2 max = quadTree[ nodeInd ].boundary.aaRect.max;
-  Vec2 center = min + ( max - min ) / 2.0f;
-  u32 lastInd = quadTree.size();
-  // top-right
-  QuadNode child = {};
-  child.boundary.aaRect = { center, max };
-  quadTree.push_back( child );
-  quadTree[ nodeInd ].childIndices[ 0 ] = lastInd++;
-  // bottom-right
-  child.boundary.aaRect = { { center.x, min.y }, { max.x, center.y } };
-  quadTree.push_back( child );
-  quadTree[ nodeInd ].childIndices[ 1 ] = lastInd++;
-  // bottom-left
-  child.boundary.aaRect = { min, center };
-  quadTree.push_back( child );
-  quadTree[ nodeInd ].childIndices[ 2 ] = lastInd++;
-  // top-left
-  child.boundary.aaRect = { { min.x, center.y }, { center.x, max.y } };
-  quadTree.push_back( child );
-  quadTree[ nodeInd ].childIndices[ 3 ] = lastInd;
-  // put elements inside children
-  for ( int elemInd = 0; elemInd <= elements.lastInd; ++elemInd ) {
-    ComponentIndex colliderInd = elements._[ elemInd ];
-    Shape collider = transformedShapes[ colliderInd ];
-    for ( int childI = 0; childI < 4; ++childI ) {
-      QuadNode& child = quadTree[ quadTree[ nodeInd ].childIndices[ childI ] ];
-      if ( collide( collider, child.boundary ) ) {
-        child.elements._[ ++child.elements.lastInd ] = colliderInd;
-      }
-    }
-  }
-}
-
-void ColliderManager::insertIntoQuadTree(ComponentIndex colliderInd) {
-  PROFILE;
-  ASSERT( colliderInd < componentMap.components.size(),
-          "Component index %d out of bounds", colliderInd );
-  std::deque< u32 > nextNodeInds = std::deque< u32 >();
-  // index 0 is null
-  Shape collider = transformedShapes[ colliderInd ];
-  if ( collide( collider, quadTree[ 1 ].boundary ) ) {
-    nextNodeInds.push_front( 1 );
+  if ( linearQuadTree.size() < 2 ) {
+    return;
   }
-#ifndef NDEBUG
-  bool inserted = false;
-#endif
-  while ( !nextNodeInds.empty() ) {
-    u32 nodeInd = nextNodeInds.front();
-    nextNodeInds.pop_front();
-    // try to add collider to this node
-    if ( quadTree[ nodeInd ].isLeaf ) {
-      // ... if there is still space
-      if ( quadTree[ nodeInd ].elements.lastInd < QuadBucket::CAPACITY - 1 ) {
-        quadTree[ nodeInd ].elements._[ ++quadTree[ nodeInd ].elements.lastInd ] = colliderInd;
-#ifndef NDEBUG
-        inserted = true;
-#endif
-      } else { 
-        // if there is no space this cannot be a leaf any more
-        subdivideQuadNode( nodeInd );
-      }
-    }
-    if ( !quadTree[ nodeInd ].isLeaf ) {
-      // find which children the collider intersects with
-      // and add them to the deque
-      for ( int i = 0; i < 4; ++i ) {
-        u32 childInd = quadTree[ nodeInd ].childIndices[ i ];
-        QuadNode child = quadTree[ childInd ];
-        if ( collide( collider, child.boundary ) ) {
-          nextNodeInds.push_front( childInd );
+  static std::vector< u32 > nodeStack;
+  u32 pairsTested = 0;
+  for ( u32 entryInd = 0; entryInd < linearQuadEntries.size(); ++entryInd ) {
+    const BoundsEntry& entry = linearQuadEntries[ entryInd ];
+    nodeStack.assign( 1, 1 );
+    while ( !nodeStack.empty() ) {
+      const LinearQuadNode& node = linearQuadTree[ nodeStack.back() ];
+      nodeStack.pop_back();
+      u32 end = node.firstChild == 0 ? node.end : node.ownEnd;
+      for ( u32 otherInd = node.begin; otherInd < end; ++otherInd ) {
+        const BoundsEntry& other = linearQuadEntries[ otherInd ];
+        if ( other.collider <= entry.collider ) {
+          continue;
+        }
+        ++pairsTested;
+        if ( overlaps( entry.bounds, other.bounds ) ) {
+          candidatePairs.push_back( { entry.collider, other.collider } );
+        }
+      }
+      if ( node.firstChild == 0 ) {
+        continue;
+      }
+      for ( u32 childInd = node.firstChild; childInd < node.firstChild + 4; ++childInd ) {
+        const LinearQuadNode& child = linearQuadTree[ childInd ];
+        if ( child.end > child.begin && overlaps( entry.bounds, child.bounds ) ) {
+          nodeStack.push_back( childInd );
         }
       }
     }
   }
-  ASSERT( inserted, "Collider index %d not inserted into QuadTree", colliderInd ); 
+  broadphaseStats.pairsTested = pairsTested;
+}
+
+void ColliderManager::removeFromBroadphase( ComponentIndex colliderInd ) {
+  if ( broadphase == QUADTREE ) {
+    removeFromQuadTree( colliderInd );
+  } else if ( broadphase == SWEEP_AND_PRUNE ) {
+    removeFromSweepList( colliderInd );
+  } else if ( broadphase == AABB_TREE ) {
+    removeFromAABBTree( colliderInd );
+  }
+  // the spatial hash and the linear quadtree are built again next update
+}
+
+// the broadphase isn't saved, the loaded colliders tell which of them were in it
+void ColliderManager::onLoaded() {
+  quadPairsKept = false;
+  quadStale.clear();
+  if ( broadphase == QUADTREE ) {
+    buildQuadTree( quadTree[ 1 ].boundary );
+  } else if ( broadphase == SWEEP_AND_PRUNE ) {
+    buildSweepList();
+  } else if ( broadphase == AABB_TREE ) {
+    buildAABBTree();
+  }
 }
 
 void ColliderManager::initialize() {
+  componentMap.initialize( ComponentType::COLLIDER, { &ColliderManager::remove, &ColliderManager::removeBatch,
+                                                      &ColliderManager::flushDeferred, &ColliderManager::onLoaded } );
+  componentMap.moved = &ColliderManager::relinkBroadphase;
+  EntityManager::initializeDefragmentation( &defragmentation, ComponentType::COLLIDER, &ColliderManager::getSortKeys );
+  broadphase = QUADTREE;
+  broadphaseStats = {};
+  // sized to the colliders on the first update
+  quadCellSize = 0.0f;
+  quadPairsKept = false;
+  quadStale.clear();
+  buildQuadTree( {} );
+  sweepAxis = 0;
+  buildSweepList();
+  buildAABBTree();
 }
 
 void ColliderManager::shutdown() {
 }
 
-void ColliderManager::addCircle( EntityHandle entity, Circle circleCollider ) {
+Shape ColliderManager::makeCircle( Circle circleCollider ) {
   ASSERT( circleCollider.radius > 0.0f, "A circle collider of radius %f is useless", circleCollider.radius );
-  ColliderComp comp {};
-  comp.entity = entity;
-  comp._.circle = circleCollider;
-  comp._.type = ShapeType::CIRCLE;
-  componentMap.set( entity, comp, &ColliderManager::remove );
+  Shape shape {};
+  shape.circle = circleCollider;
+  shape.type = ShapeType::CIRCLE;
+  return shape;
 }
 
-void ColliderManager::addAxisAlignedRect( EntityHandle entity, Rect aaRectCollider ) {
+Shape ColliderManager::makeAxisAlignedRect( Rect aaRectCollider ) {
   ASSERT( aaRectCollider.min.x < aaRectCollider.max.x &&
           aaRectCollider.min.y < aaRectCollider.max.y,
           "Malformed axis aligned rect collider" );
-  ColliderComp comp {};
-  comp.entity = entity;
-  comp._.aaRect = aaRectCollider;
-  comp._.type = ShapeType::AARECT;
-  componentMap.set( entity, comp, &ColliderManager::remove );
+  Shape shape {};
+  shape.aaRect = aaRectCollider;
+  shape.type = ShapeType::AARECT;
+  return shape;
+}
+
+void ColliderManager::addCircle( EntityHandle entity, Circle circleCollider ) {
+  componentMap.set( entity, makeCircle( circleCollider ), {}, {}, {}, EMPTY_BOUNDS, 0, 0, 0, 0 );
+  added.push_back( entity );
+}
+
+void ColliderManager::addAxisAlignedRect( EntityHandle entity, Rect aaRectCollider ) {
+  componentMap.set( entity, makeAxisAlignedRect( aaRectCollider ), {}, {}, {}, EMPTY_BOUNDS, 0, 0, 0, 0 );
+  added.push_back( entity );
 }
 
 void ColliderManager::remove( EntityHandle entity ) {
+  removeFromBroadphase( componentMap.map.get( entity.index ) );
   componentMap.remove( entity );
 }
 
+void ColliderManager::removeBatch( const std::vector< EntityHandle >& entities ) {
+  for ( u32 entInd = 0; entInd < entities.size(); ++entInd ) {
+    removeFromBroadphase( componentMap.map.get( entities[ entInd ].index ) );
+  }
+  componentMap.removeBatch( entities );
+}
+
+void ColliderManager::addCircleDeferred( EntityHandle entity, Circle circleCollider ) {
+  componentMap.setDeferred( entity, makeCircle( circleCollider ), {}, {}, {}, EMPTY_BOUNDS, 0, 0, 0, 0 );
+  added.push_back( entity );
+}
+
+void ColliderManager::addAxisAlignedRectDeferred( EntityHandle entity, Rect aaRectCollider ) {
+  componentMap.setDeferred( entity, makeAxisAlignedRect( aaRectCollider ), {}, {}, {}, EMPTY_BOUNDS, 0, 0, 0, 0 );
+  added.push_back( entity );
+}
+
+void ColliderManager::removeDeferred( EntityHandle entity ) {
+  componentMap.removeDeferred( entity );
+}
+
+void ColliderManager::flushDeferred() {
+  std::vector< EntityHandle >& removes = componentMap.deferredRemoves;
+  for ( u32 entInd = 0; entInd < removes.size(); ++entInd ) {
+    if ( EntityManager::isAlive( removes[ entInd ] ) && componentMap.map.get( removes[ entInd ].index ) > 0 ) {
+      removeFromBroadphase( componentMap.map.get( removes[ entInd ].index ) );
+    }
+  }
+  componentMap.flushDeferred();
+}
+
+void ColliderManager::setBroadphase( Broadphase newBroadphase ) {
+  if ( newBroadphase == broadphase ) {
+    return;
+  }
+  // the colliders that have bounds were in the other one
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  for ( ComponentIndex colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    bool placed = worldBounds[ colliderInd ].min.x <= worldBounds[ colliderInd ].max.x;
+    componentMap.change< QUAD_NODE >( colliderInd ) = ( placed && newBroadphase == QUADTREE ) ? 1 : 0;
+    componentMap.change< SWEEP_SLOT >( colliderInd ) = ( placed && newBroadphase == SWEEP_AND_PRUNE ) ? 1 : 0;
+    componentMap.change< TREE_LEAF >( colliderInd ) = ( placed && newBroadphase == AABB_TREE ) ? 1 : 0;
+  }
+  broadphase = newBroadphase;
+  quadPairsKept = false;
+  quadStale.clear();
+  buildQuadTree( quadTree[ 1 ].boundary );
+  buildSweepList();
+  buildAABBTree();
+}
+
+const ColliderManager::BroadphaseStats& ColliderManager::getBroadphaseStats() {
+  return broadphaseStats;
+}
+
+void ColliderManager::getCandidatePairs( std::vector< std::pair< EntityHandle, EntityHandle > >* result ) {
+  result->reserve( result->size() + candidatePairs.size() );
+  for ( u32 pairInd = 0; pairInd < candidatePairs.size(); ++pairInd ) {
+    ColliderPair pair = candidatePairs[ pairInd ];
+    result->push_back( { componentMap.entities[ pair.a ], componentMap.entities[ pair.b ] } );
+  }
+}
+
+void ColliderManager::setQuadCellSize( float cellSize ) {
+  ASSERT( cellSize >= 0.0f, "Invalid quadtree cell size %f", cellSize );
+  quadCellSize = cellSize;
+  buildQuadTree( quadTree[ 1 ].boundary );
+}
+
 void ColliderManager::updateAndCollide() {
   PROFILE;
-  if ( componentMap.components.size() == 0 ) {
+  // the null collider is always there
+  if ( componentMap.size() <= 1 ) {
     return;
   }
-  // update local transform cache
-  std::vector< EntityHandle > updatedEntities = TransformManager::getLastUpdated();
-  LookupResult colliderLookup;
-  componentMap.lookup( updatedEntities, &colliderLookup );
-  LookupResult transformLookup;
-  TransformManager::lookup( colliderLookup.entities, &transformLookup );
-  VALIDATE_ENTITIES_EQUAL( colliderLookup.entities, transformLookup.entities );
-  // FIXME get world transforms here
+  // update local transform cache of the colliders whose transform moved
+  TransformManager::updateWorldTransforms();
+  std::vector< EntityHandle >& updated = TransformManager::getLastUpdated();
+  updated.insert( updated.end(), added.begin(), added.end() );
+  added.clear();
+  static std::vector< EntityHandle > refreshed;
+  refreshed.clear();
+  ComponentMask mask = 1 << ComponentType::TRANSFORM | 1 << ComponentType::COLLIDER;
+  for ( u32 entInd = 0; entInd < updated.size(); ++entInd ) {
+    EntityHandle entity = updated[ entInd ];
+    if ( EntityManager::isAlive( entity ) && ( EntityManager::getComponentMask( entity ) & mask ) == mask ) {
+      refreshed.push_back( entity );
+    }
+  }
+  LookupResult transformLookup, colliderLookup;
+  TransformManager::lookup( refreshed, &transformLookup );
+  componentMap.lookup( refreshed, &colliderLookup );
   std::vector< Transform > updatedTransforms;
-  TransformManager::get( transformLookup.indices, &updatedTransforms );
+  TransformManager::getWorld( transformLookup.indices, &updatedTransforms );
+  const std::vector< Shape >& shapes = componentMap.column< SHAPE >();
+  const std::vector< Shape >& worldShapes = componentMap.column< WORLD_SHAPE >();
+  const std::vector< Rect >& worldBounds = componentMap.column< WORLD_BOUNDS >();
+  static std::vector< ComponentIndex > refreshedColliders;
+  refreshedColliders.clear();
   for ( u32 trInd = 0; trInd < updatedTransforms.size(); ++trInd ) {
     Transform transform = updatedTransforms[ trInd ];
-    ComponentIndex colliderCompInd = colliderLookup.indices[ trInd ];
-    componentMap.components[ colliderCompInd ].position = transform.position;
-    componentMap.components[ colliderCompInd ].scale = transform.scale;
-  }
-  transformedShapes.clear();
-  transformedShapes.reserve( componentMap.components.size() );
-  transformedShapes.push_back( {} );
-  for ( u32 colInd = 1; colInd < componentMap.components.size(); ++colInd ) {
-    ColliderComp colliderComp = componentMap.components[ colInd ];
-    if ( colliderComp._.type == ShapeType::CIRCLE ) {
-      float scaleX = colliderComp.scale.x, scaleY = colliderComp.scale.y;
-      float maxScale = ( scaleX > scaleY ) ? scaleX : scaleY;
-      Vec2 position = colliderComp.position + colliderComp._.circle.center * maxScale;
-      float radius = colliderComp._.circle.radius * maxScale;
-      transformedShapes.push_back( { { position, radius }, ShapeType::CIRCLE } );
-    } else if ( colliderComp._.type == ShapeType::AARECT ) {
-      Vec2 min = colliderComp._.aaRect.min * colliderComp.scale + colliderComp.position;
-      Vec2 max = colliderComp._.aaRect.max * colliderComp.scale + colliderComp.position;
-      Shape transformed = { {}, ShapeType::AARECT };
-      transformed.aaRect = { min, max };
-      transformedShapes.push_back( transformed );
-    }
-  }
-
-  // space partitioned collision detection
-  // keep the quadtree updated
-  // TODO calculate the boundary dynamically 
-  Rect boundary = { { -420, -240 }, { 420, 240 } };
-  buildQuadTree( boundary );
-  
-  // detect collisions
-  collisions.clear();
-  collisions.resize( componentMap.components.size(), {} );
-  for ( u32 nodeInd = 1; nodeInd < quadTree.size(); ++nodeInd ) {
-    QuadNode quadNode = quadTree[ nodeInd ];
-    if ( !quadNode.isLeaf ) {
-      continue;
+    ComponentIndex colInd = componentMap.validate( colliderLookup.indices[ trInd ] );
+    Vec2 position = transform.position, scale = transform.scale;
+    componentMap.change< POSITION >( colInd ) = position;
+    componentMap.change< SCALE >( colInd ) = scale;
+    Shape shape = shapes[ colInd ];
+    Shape& worldShape = componentMap.change< WORLD_SHAPE >( colInd );
+    if ( shape.type == ShapeType::CIRCLE ) {
+      float maxScale = ( scale.x > scale.y ) ? scale.x : scale.y;
+      Vec2 center = position + shape.circle.center * maxScale;
+      float radius = shape.circle.radius * maxScale;
+      worldShape = { { center, radius }, ShapeType::CIRCLE };
+    } else if ( shape.type == ShapeType::AARECT ) {
+      Vec2 min = shape.aaRect.min * scale + position;
+      Vec2 max = shape.aaRect.max * scale + position;
+      worldShape = { {}, ShapeType::AARECT };
+      worldShape.aaRect = { min, max };
     }
-    for ( int i = 0; i < quadNode.elements.lastInd; ++i ) {
-      ComponentIndex collI = quadNode.elements._[ i ];
-      Shape shapeI = transformedShapes[ collI ];
-      for ( int j = i + 1; j <= quadNode.elements.lastInd; ++j ) {
-        ComponentIndex collJ = quadNode.elements._[ j ];
-        Shape shapeJ = transformedShapes[ collJ ];
-        Collision collision;
-        if ( collide( shapeI, shapeJ, collision ) ) {
-          collisions[ collI ].push_back( collision );
-          collisions[ collJ ].push_back( { collision.b, collision.a, collision.normalB, collision.normalA } );
-          Debug::drawShape( shapeI, Debug::GREEN );
-          Debug::drawShape( shapeJ, Debug::GREEN );
+    componentMap.change< WORLD_BOUNDS >( colInd ) = getBounds( worldShape );
+    refreshedColliders.push_back( colInd );
+  }
+  // find the pairs whose bounds overlap
+  TimePoint start = Clock::now();
+  broadphaseStats.pairsTested = 0;
+  candidatePairs.clear();
+  if ( broadphase == QUADTREE ) {
+    updateQuadTree( refreshedColliders );
+    findQuadTreePairs( refreshedColliders );
+  } else if ( broadphase == SWEEP_AND_PRUNE ) {
+    updateSweepList( refreshedColliders );
+    findSweepPairs();
+  } else if ( broadphase == AABB_TREE ) {
+    updateAABBTree( refreshedColliders );
+    findAABBTreePairs();
+  } else if ( broadphase == LINEAR_QUADTREE ) {
+    buildLinearQuadTree();
+    findLinearQuadTreePairs();
+  } else {
+    buildSpatialHash();
+    findSpatialHashPairs();
+  }
+  broadphaseStats.nanos = elapsedNanos( start );
+  broadphaseStats.pairsFound = candidatePairs.size();
+
+  // debug render space partitions or tree leaves, the root of an unbounded
+  // world has none, nor the one of a tree not fitted to any bounds yet
+  if ( broadphase == QUADTREE ) {
+    static std::vector< u32 > nodeStack;
+    getQuadRoots( { { -INFINITY, -INFINITY }, { INFINITY, INFINITY } }, &nodeStack );
+    while ( !nodeStack.empty() ) {
+      u32 nodeInd = nodeStack.back();
+      const QuadNode& quadNode = quadTree[ nodeInd ];
+      nodeStack.pop_back();
+      if ( quadNode.firstChild != 0 ) {
+        for ( u32 childInd = quadNode.firstChild; childInd < quadNode.firstChild + 4; ++childInd ) {
+          nodeStack.push_back( childInd );
         }
+      } else if ( nodeInd != 1 || ( quadCellSize == 0.0f && quadNode.boundary.min.x < quadNode.boundary.max.x ) ) {
+        Debug::drawRect( quadNode.boundary, { 1, 1, 1, 0.3f } );
       }
     }
+  } else if ( broadphase == LINEAR_QUADTREE ) {
+    for ( u32 nodeInd = 1; nodeInd < linearQuadTree.size(); ++nodeInd ) {
+      if ( linearQuadTree[ nodeInd ].firstChild == 0 ) {
+        Debug::drawRect( linearQuadTree[ nodeInd ].boundary, { 1, 1, 1, 0.3f } );
+      }
+    }
+  } else if ( broadphase == AABB_TREE && aabbTreeRoot != 0 ) {
+    static std::vector< u32 > nodeStack;
+    nodeStack.assign( 1, aabbTreeRoot );
+    while ( !nodeStack.empty() ) {
+      const TreeNode& treeNode = aabbTree[ nodeStack.back() ];
+      nodeStack.pop_back();
+      if ( treeNode.left != 0 ) {
+        nodeStack.push_back( treeNode.left );
+        nodeStack.push_back( treeNode.right );
+      } else {
+        Debug::drawRect( treeNode.bounds, { 1, 1, 1, 0.3f } );
+      }
+    }
+  }
+  for ( ComponentIndex colliderInd = 1; colliderInd < componentMap.size(); ++colliderInd ) {
+    if ( worldBounds[ colliderInd ].min.x <= worldBounds[ colliderInd ].max.x ) {
+      Debug::drawShape( worldShapes[ colliderInd ], Debug::BLUE );
+    }
+  }
+
+  // detect collisions
+  collisions.clear();
+  collisions.resize( componentMap.size(), {} );
+  for ( u32 pairInd = 0; pairInd < candidatePairs.size(); ++pairInd ) {
+    ColliderPair pair = candidatePairs[ pairInd ];
+    Collision collision;
+    if ( collide( worldShapes[ pair.a ], worldShapes[ pair.b ], collision ) ) {
+      collisions[ pair.a ].push_back( collision );
+      collisions[ pair.b ].push_back( { collision.b, collision.a, collision.normalB, collision.normalA } );
+      Debug::drawShape( worldShapes[ pair.a ], Debug::GREEN );
+      Debug::drawShape( worldShapes[ pair.b ], Debug::GREEN );
+    }
   }
 }
 
@@ -313,18 +2148,45 @@ void ColliderManager::lookup( const std::vector< EntityHandle >& entities, Looku
   return componentMap.lookup( entities, result );
 }
 
+ComponentMemory ColliderManager::getMemoryUsage() {
+  return componentMap.getMemoryUsage();
+}
+
+// by the position in the transform cache
+u32 ColliderManager::getSortKeys( ComponentIndex first, u32 count, SortEntry* result ) {
+  u32 end = std::min( first + count, componentMap.size() );
+  const std::vector< Vec2 >& positions = componentMap.column< POSITION >();
+  for ( u32 compInd = first; compInd < end; ++compInd ) {
+    result[ compInd - first ] = { mortonCode( positions[ compInd ], SORT_CELL_SIZE ), componentMap.entities[ compInd ] };
+  }
+  return ( end > first ) ? end - first : 0;
+}
+
+bool ColliderManager::defragment( u32 budget ) {
+  return EntityManager::defragment( defragmentation, budget );
+}
+
 std::vector< std::vector< Collision > >& ColliderManager::getCollisions( const std::vector< ComponentIndex >& indices ) {
   PROFILE;
   static std::vector< std::vector< Collision > > requestedCollisions;
   requestedCollisions.clear();
   requestedCollisions.reserve( indices.size() );
   for ( u32 entI = 0; entI < indices.size(); ++entI ) {
-    ComponentIndex compInd = indices[ entI ];
+    ComponentIndex compInd = componentMap.validate( indices[ entI ] );
     requestedCollisions.push_back( collisions[ compInd ] );
   }
   return requestedCollisions;
 }
 
+std::vector< std::vector< Collision > >& ColliderManager::getCollisions( ComponentIndex first, u32 count ) {
+  PROFILE;
+  ASSERT( first + count <= collisions.size(), "" );
+  static std::vector< std::vector< Collision > > requestedCollisions;
+  requestedCollisions.clear();
+  requestedCollisions.assign( collisions.begin() + first, collisions.begin() + first + count );
+  return requestedCollisions;
+}
+
 bool ColliderManager::collide( Shape shapeA, Shape shapeB ) {
   PROFILE;
   switch ( shapeA.type ) {
@@ -473,90 +2335,139 @@ void ColliderManager::fitCircleToSprite( EntityHandle entity ) {
 }
 
 ComponentMap< SolidBodyManager::SolidBodyComp > SolidBodyManager::componentMap;
+ViewIndex SolidBodyManager::collidingView;
+bool SolidBodyManager::grouped;
+GroupIndex SolidBodyManager::collidingGroup;
 
 void SolidBodyManager::initialize() {
+  componentMap.initialize( ComponentType::SOLID_BODY, { &SolidBodyManager::remove, &SolidBodyManager::removeBatch, &SolidBodyManager::flushDeferred, nullptr } );
+  collidingView = EntityManager::createView( 1 << ComponentType::TRANSFORM | 1 << ComponentType::COLLIDER |
+                                             1 << ComponentType::SOLID_BODY );
 }
 
 void SolidBodyManager::shutdown() {
 }
 
 void SolidBodyManager::set( EntityHandle entity, SolidBody solidBody ) {
-  componentMap.set( entity, { solidBody.speed, entity }, &SolidBodyManager::remove );
+  componentMap.set( entity, { solidBody.speed, entity } );
 }
 
 void SolidBodyManager::remove( EntityHandle entity ) {
   componentMap.remove( entity );
 }
 
+void SolidBodyManager::removeBatch( const std::vector< EntityHandle >& entities ) {
+  componentMap.removeBatch( entities );
+}
+
+void SolidBodyManager::setDeferred( EntityHandle entity, SolidBody solidBody ) {
+  componentMap.setDeferred( entity, { solidBody.speed, entity } );
+}
+
+void SolidBodyManager::removeDeferred( EntityHandle entity ) {
+  componentMap.removeDeferred( entity );
+}
+
+void SolidBodyManager::flushDeferred() {
+  componentMap.flushDeferred();
+}
+
 void SolidBodyManager::setSpeed( const std::vector< ComponentIndex >& indices, std::vector< Vec2 >& speeds ) {
   PROFILE;
   ASSERT( indices.size() == speeds.size(), "" );
   for ( u32 i = 0; i < indices.size(); ++i ) {
-    componentMap.components[ indices[ i ] ].speed = speeds[ i ];
+    componentMap.at( indices[ i ] ).speed = speeds[ i ];
   }
 }
 
 void SolidBodyManager::get( const std::vector< ComponentIndex >& indices, std::vector< SolidBody >* result ) {
   result->reserve( indices.size() );
   for ( u32 i = 0; i < indices.size(); ++i ) {
-    SolidBody solidBody = { componentMap.components[ indices[ i ] ].speed };
+    SolidBody solidBody = { componentMap.at( indices[ i ] ).speed };
     result->push_back( solidBody );
   }
 }
 
+void SolidBodyManager::groupComponents() {
+  if ( !grouped ) {
+    collidingGroup = EntityManager::createOwningGroup( 1 << ComponentType::TRANSFORM | 1 << ComponentType::COLLIDER |
+                                                       1 << ComponentType::SOLID_BODY );
+    grouped = true;
+  }
+}
+
+Vec2 SolidBodyManager::bounce( Vec2 speed, const std::vector< Collision >& collisions ) {
+  Vec2 normal = {};
+  for ( u32 i = 0; i < collisions.size(); ++i ) {
+    if ( dot( speed, collisions[ i ].normalB ) <= 0.0f ) {
+      normal += collisions[ i ].normalB;
+    }
+  }
+  if ( normal.x != 0 || normal.y != 0 ) {
+    // reflect direction
+    normal = normalized( normal );
+    float vDotN = dot( speed, normal );
+    return speed - 2.0f * vDotN * normal;
+  }
+  return speed;
+}
+
 void SolidBodyManager::update( double deltaT ) {
   PROFILE;
-  std::vector< EntityHandle > entities;
-  entities.reserve( componentMap.components.size() );
-  // detect collisions and correct positions
-  for ( u32 compI = 1; compI < componentMap.components.size(); ++compI ) {
-    SolidBodyComp solidBodyComp = componentMap.components[ compI ];
-    entities.push_back( solidBodyComp.entity );
-  }
-  LookupResult colliderLookup;
-  ColliderManager::lookup( entities, &colliderLookup );
-  VALIDATE_ENTITIES_EQUAL( entities, colliderLookup.entities );
-  std::vector< std::vector< Collision > > collisions = ColliderManager::getCollisions( colliderLookup.indices );
-  // move solid bodies
   std::vector< Vec2 > translations;
-  translations.reserve( componentMap.components.size() );
-  for ( u32 compI = 1; compI < componentMap.components.size(); ++compI ) {
-    std::vector< Collision > collisionsI = collisions[ compI - 1 ];
-    Vec2 normal = {};
-    SolidBodyComp solidBodyComp = componentMap.components[ compI ];
-    for ( u32 i = 0; i < collisionsI.size(); ++i ) {
-      if ( dot( solidBodyComp.speed, collisionsI[ i ].normalB ) <= 0.0f ) {
-        normal += collisionsI[ i ].normalB;
-      }
-    }
-    if ( normal.x != 0 || normal.y != 0 ) {
-      // reflect direction
-      normal = normalized( normal );
-      float vDotN = dot( solidBodyComp.speed, normal );
-      componentMap.components[ compI ].speed = solidBodyComp.speed - 2.0f * vDotN * normal;
+  if ( grouped ) {
+    // the three components of every entity in the group are at the same
+    // index of their arrays, from 1 to count
+    u32 count = EntityManager::getGroupSize( collidingGroup );
+    // detect collisions and correct positions
+    const std::vector< std::vector< Collision > >& collisions = ColliderManager::getCollisions( 1, count );
+    // move solid bodies
+    translations.reserve( count );
+    for ( u32 compI = 1; compI <= count; ++compI ) {
+      Vec2 speed = componentMap.components[ compI ].speed;
+      componentMap.change( compI ).speed = bounce( speed, collisions[ compI - 1 ] );
+      translations.push_back( speed * deltaT );
     }
-    translations.push_back( solidBodyComp.speed * deltaT );
+    TransformManager::translate( 1, translations );
+    return;
+  }
+  const ComponentView& view = EntityManager::getView( collidingView );
+  const std::vector< ComponentIndex >& bodyInds = view.indices[ ComponentType::SOLID_BODY ];
+  // detect collisions and correct positions
+  const std::vector< std::vector< Collision > >& collisions = ColliderManager::getCollisions( view.indices[ ComponentType::COLLIDER ] );
+  // move solid bodies
+  translations.reserve( bodyInds.size() );
+  for ( u32 row = 0; row < bodyInds.size(); ++row ) {
+    SolidBodyComp& body = componentMap.at( bodyInds[ row ] );
+    Vec2 speed = body.speed;
+    body.speed = bounce( speed, collisions[ row ] );
+    translations.push_back( speed * deltaT );
   }
-  LookupResult transformLookup;
-  TransformManager::lookup( entities, &transformLookup );
-  VALIDATE_ENTITIES_EQUAL( entities, transformLookup.entities );
-  TransformManager::translate( transformLookup.indices, translations );
+  TransformManager::translate( view.indices[ ComponentType::TRANSFORM ], translations );
 }
 
 void SolidBodyManager::lookup( const std::vector< EntityHandle >& entities, LookupResult* result ) {
   return componentMap.lookup( entities, result );
 }
 
+ComponentMemory SolidBodyManager::getMemoryUsage() {
+  return componentMap.getMemoryUsage();
+}
+
 ComponentMap< SpriteManager::SpriteComp > SpriteManager::componentMap;
+std::vector< EntityHandle > SpriteManager::added;
 RenderInfo SpriteManager::renderInfo;
 SpriteManager::Pos* SpriteManager::posBufferData;
 SpriteManager::UV* SpriteManager::texCoordsBufferData;
+Defragmentation SpriteManager::defragmentation;
  
 SpriteManager::SpriteComp::operator Sprite() const {
   return { this->sprite.textureId, this->sprite.texCoords, this->sprite.size };
 }
 
 void SpriteManager::initialize() {
+  componentMap.initialize( ComponentType::SPRITE, { &SpriteManager::remove, &SpriteManager::removeBatch, &SpriteManager::flushDeferred, nullptr } );
+  EntityManager::initializeDefragmentation( &defragmentation, ComponentType::SPRITE, &SpriteManager::getSortKeys );
   // configure buffers
   glGenVertexArrays( 1, &renderInfo.vaoId );
   glBindVertexArray( renderInfo.vaoId );
@@ -585,7 +2496,7 @@ void SpriteManager::shutdown() {
   glDeleteBuffers( 2, renderInfo.vboIds );
 }
 
-void SpriteManager::set( EntityHandle entity, AssetIndex textureId, Rect texCoords ) {
+SpriteManager::SpriteComp SpriteManager::makeSprite( EntityHandle entity, AssetIndex textureId, Rect texCoords ) {
   ASSERT( AssetManager::isTextureAlive( textureId ), "Invalid texture id %d", textureId ); 
   SpriteComp spriteComp = {};
   spriteComp.entity = entity;
@@ -595,17 +2506,54 @@ void SpriteManager::set( EntityHandle entity, AssetIndex textureId, Rect texCoor
   float width = texture.width * ( texCoords.max.u - texCoords.min.u ) / PIXELS_PER_UNIT;
   float height = texture.height * ( texCoords.max.v - texCoords.min.v ) / PIXELS_PER_UNIT;
   spriteComp.sprite.size = { width, height };
-  componentMap.set( entity, spriteComp, &SpriteManager::remove );
+  spriteComp.rotation = { 1.0f, 0.0f };
+  spriteComp.previousRotation = spriteComp.rotation;
+  return spriteComp;
+}
+
+void SpriteManager::set( EntityHandle entity, AssetIndex textureId, Rect texCoords ) {
+  componentMap.set( entity, makeSprite( entity, textureId, texCoords ) );
+  added.push_back( entity );
 }
 
 void SpriteManager::remove( EntityHandle entity ) {
   componentMap.remove( entity );
 }
 
+void SpriteManager::removeBatch( const std::vector< EntityHandle >& entities ) {
+  componentMap.removeBatch( entities );
+}
+
+void SpriteManager::setDeferred( EntityHandle entity, AssetIndex textureId, Rect texCoords ) {
+  componentMap.setDeferred( entity, makeSprite( entity, textureId, texCoords ) );
+  added.push_back( entity );
+}
+
+void SpriteManager::removeDeferred( EntityHandle entity ) {
+  componentMap.removeDeferred( entity );
+}
+
+void SpriteManager::flushDeferred() {
+  componentMap.flushDeferred();
+}
+
 void SpriteManager::get( const std::vector< ComponentIndex >& indices, std::vector< Sprite >* result ) {
   result->reserve( indices.size() );
   for ( u32 i = 0; i < indices.size(); ++i ) {
-    result->push_back( static_cast< Sprite >( componentMap.components[ indices[ i ] ] ) );
+    result->push_back( static_cast< Sprite >( componentMap.at( indices[ i ] ) ) );
+  }
+}
+
+// between the last two simulation steps
+Vec2 SpriteManager::getRenderedPosition( const SpriteComp& spriteComp, float interpolation ) {
+  return lerp( spriteComp.previousTransform.position, spriteComp.transform.position, interpolation );
+}
+
+void SpriteManager::getRenderedPositions( const std::vector< ComponentIndex >& indices, float interpolation,
+                                          std::vector< Vec2 >* result ) {
+  result->reserve( indices.size() );
+  for ( u32 i = 0; i < indices.size(); ++i ) {
+    result->push_back( getRenderedPosition( componentMap.at( indices[ i ] ), interpolation ) );
   }
 }
 
@@ -618,24 +2566,61 @@ void SpriteManager::setOrthoProjection( float aspectRatio, float height ) {
   glUniform1f( renderInfo.projUnifLoc[ 3 ], halfHeight );
 }
 
-void SpriteManager::updateAndRender() {
+void SpriteManager::update() {
   PROFILE;
   if ( componentMap.components.size() == 0 ) {
     return;
   }
-  // update local transform cache
-  std::vector< EntityHandle > updatedEntities = TransformManager::getLastUpdated();
-  LookupResult spriteLookup;
-  componentMap.lookup( updatedEntities, &spriteLookup );
-  LookupResult transformLookup;
-  TransformManager::lookup( spriteLookup.entities, &transformLookup );
-  VALIDATE_ENTITIES_EQUAL( spriteLookup.entities, transformLookup.entities );
-  // TODO get world transforms here
+  // update local transform cache of the sprites whose transform moved. The
+  // last updated ones include the previous step's, so a sprite that stopped
+  // moving gets its previous transform caught up and stops interpolating,
+  // each is refreshed once so the previous transform is the last step's.
+  TransformManager::updateWorldTransforms();
+  std::vector< EntityHandle >& updated = TransformManager::getLastUpdated();
+  u32 addedFrom = updated.size();
+  updated.insert( updated.end(), added.begin(), added.end() );
+  added.clear();
+  static std::vector< EntityHandle > refreshed;
+  refreshed.clear();
+  u32 appearedFrom = 0;
+  ComponentMask mask = 1 << ComponentType::TRANSFORM | 1 << ComponentType::SPRITE;
+  for ( u32 entInd = 0; entInd < updated.size(); ++entInd ) {
+    if ( entInd == addedFrom ) {
+      appearedFrom = refreshed.size();
+    }
+    EntityHandle entity = updated[ entInd ];
+    if ( EntityManager::isAlive( entity ) && ( EntityManager::getComponentMask( entity ) & mask ) == mask ) {
+      refreshed.push_back( entity );
+    }
+  }
+  if ( addedFrom == updated.size() ) {
+    appearedFrom = refreshed.size();
+  }
+  LookupResult transformLookup, spriteLookup;
+  TransformManager::lookup( refreshed, &transformLookup );
+  componentMap.lookup( refreshed, &spriteLookup );
   std::vector< Transform > updatedTransforms;
-  TransformManager::get( transformLookup.indices, &updatedTransforms );
+  std::vector< Vec2 > updatedRotations;
+  TransformManager::getWorld( transformLookup.indices, &updatedTransforms );
+  TransformManager::getRotations( transformLookup.indices, &updatedRotations );
   for ( u32 trInd = 0; trInd < updatedTransforms.size(); ++trInd ) {
-    ComponentIndex spriteInd = spriteLookup.indices[ trInd ];
-    componentMap.components[ spriteInd ].transform = updatedTransforms[ trInd ];
+    SpriteComp& spriteComp = componentMap.at( spriteLookup.indices[ trInd ] );
+    spriteComp.previousTransform = spriteComp.transform;
+    spriteComp.previousRotation = spriteComp.rotation;
+    spriteComp.transform = updatedTransforms[ trInd ];
+    spriteComp.rotation = updatedRotations[ trInd ];
+    // new sprites have nothing to interpolate from
+    if ( trInd >= appearedFrom ) {
+      spriteComp.previousTransform = spriteComp.transform;
+      spriteComp.previousRotation = spriteComp.rotation;
+    }
+  }
+}
+
+void SpriteManager::render( float interpolation ) {
+  PROFILE;
+  if ( componentMap.components.size() == 0 ) {
+    return;
   }
   // build vertex buffer and render for sprites with same texture
   glUseProgram( renderInfo.shaderProgramId );
@@ -656,11 +2641,12 @@ void SpriteManager::updateAndRender() {
     { 0.5f,	 0.5f }
   };
   for ( u32 spriteInd = 0; spriteInd < spritesToRenderCount; ++spriteInd ) {
-    SpriteComp spriteComp = componentMap.components[ spriteInd ];
+    const SpriteComp& spriteComp = componentMap.components[ spriteInd ];
+    Vec2 position = getRenderedPosition( spriteComp, interpolation );
+    Vec2 size = spriteComp.sprite.size * lerp( spriteComp.previousTransform.scale, spriteComp.transform.scale, interpolation );
+    Vec2 rotation = nlerp( spriteComp.previousRotation, spriteComp.rotation, interpolation );
     for ( u32 vertInd = 0; vertInd < vertsPerSprite; ++vertInd ) {
-      Vec2 vert = baseGeometry[ vertInd ] * spriteComp.sprite.size * spriteComp.transform.scale;
-      vert = rotateVec2( vert, spriteComp.transform.orientation );
-      vert += spriteComp.transform.position;
+      Vec2 vert = rotateVec2( baseGeometry[ vertInd ] * size, rotation ) + position;
       posBufferData[ spriteInd * vertsPerSprite + vertInd ].pos = vert;
     }
   } 
@@ -714,3 +2700,22 @@ void SpriteManager::updateAndRender() {
 void SpriteManager::lookup( const std::vector< EntityHandle >& entities, LookupResult* result ) {
   return componentMap.lookup( entities, result );
 }
+
+ComponentMemory SpriteManager::getMemoryUsage() {
+  return componentMap.getMemoryUsage();
+}
+
+// sprites sharing a texture are rendered together, so the texture goes first
+u32 SpriteManager::getSortKeys( ComponentIndex first, u32 count, SortEntry* result ) {
+  u32 end = std::min( first + count, ( u32 )componentMap.components.size() );
+  for ( u32 compInd = first; compInd < end; ++compInd ) {
+    const SpriteComp& spriteComp = componentMap.components[ compInd ];
+    u64 key = ( u64 )spriteComp.sprite.textureId << 32 | mortonCode( spriteComp.transform.position, SORT_CELL_SIZE );
+    result[ compInd - first ] = { key, spriteComp.entity };
+  }
+  return ( end > first ) ? end - first : 0;
+}
+
+bool SpriteManager::defragment( u32 budget ) {
+  return EntityManager::defragment( defragmentation, budget );
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+// side of the cells whose Morton codes components are sorted by
+const float SORT_CELL_SIZE = 4.0f;
+
 struct Transform {
   Vec2 position;
   Vec2 scale;
@@ -7,28 +10,96 @@ struct Transform {
 };
 
 class TransformManager {
-  struct TransformComp {
-    EntityHandle entity;
-    Transform local;
-    Transform world;
-    ComponentIndex parent;
-    ComponentIndex firstChild;
-    ComponentIndex nextSibling;
-    ComponentIndex prevSibling;
-  };
-  static ComponentMap< TransformComp > componentMap;
+  // the local transform is split so each operation only touches what it changes,
+  // rotation is the cosine and sine of the world orientation, the links are raw
+  // component indices, dirty is set when the local transform changes
+  enum Field { POSITION, SCALE, ORIENTATION, WORLD, ROTATION, PARENT, FIRST_CHILD, NEXT_SIBLING, PREV_SIBLING, DIRTY };
+  static SoAComponentMap< Vec2, Vec2, float, Transform, Vec2,
+                          ComponentIndex, ComponentIndex, ComponentIndex, ComponentIndex, u8 > componentMap;
+  static Defragmentation defragmentation;
+  // true while every parent is stored before its children
+  static bool ordered;
+  // no component before this one is dirty
+  static ComponentIndex dirtyFrom;
+  static u32 parentedCount;
+  static void markDirty( ComponentIndex compInd );
+  static const std::vector< ComponentIndex >& markChanged( const std::vector< ComponentIndex >& indices );
+  static ComponentIndex markChanged( EntityHandle entity );
+  static void relink( ComponentIndex compIndA, ComponentIndex compIndB );
+  static void detach( ComponentIndex compInd );
+  static void unlink( ComponentIndex compInd );
+  static void sortHierarchy();
+  // the components whose world orientation changed in the last propagation
+  static std::vector< ComponentIndex > rotated;
+  static void updateWorld( ComponentIndex compInd );
+  static void updateRotations();
+  static void propagateUnordered();
+  static u32 getSortKeys( ComponentIndex first, u32 count, SortEntry* result );
+  // entities whose transform changed in the last frame, and so far in this one
+  static std::vector< EntityHandle > previousUpdated;
+  static std::vector< EntityHandle > updated;
+  static std::vector< u32 > updatedMarks; // by entity index, the handle if it is in updated
+  static void markUpdated( EntityHandle entity );
+  static void onLoaded();
+  // scratch of the entity handle operations, the indices in component order
+  // for big batches
+  static std::vector< ComponentIndex > resolvedIndices;
+  static std::vector< std::pair< ComponentIndex, u32 > > resolvedOrder;
+  static void resolve( const std::vector< EntityHandle >& entities );
+  template< typename T >
+  static const std::vector< T >& resolve( const std::vector< EntityHandle >& entities, const std::vector< T >& values );
 public:
   static void initialize();
   static void shutdown();
   static void set( EntityHandle entity, Transform transform );
   static void remove( EntityHandle entity );
+  static void removeBatch( const std::vector< EntityHandle >& entities );
+  static void setDeferred( EntityHandle entity, Transform transform );
+  static void removeDeferred( EntityHandle entity );
+  static void flushDeferred();
+  // the batch operations run on the SIMD kernels
   static void rotate( const std::vector< ComponentIndex >& indices, const std::vector< float >& rotations );
   static void rotateAround( const std::vector< ComponentIndex >& indices, const std::vector< std::pair< Vec2, float > >& rotations );
   static void translate( const std::vector< ComponentIndex >& indices, const std::vector< Vec2 >& translations );
+  // translate the contiguous components starting at index first
+  static void translate( ComponentIndex first, const std::vector< Vec2 >& translations );
   static void scale( const std::vector< ComponentIndex >& indices, const std::vector< Vec2 >& scales );
   static void update( const std::vector< ComponentIndex >& indices, const std::vector< Transform >& transforms );
+  // The same by entity, each must have a transform. Big batches are looked up
+  // and applied in component order, the single entity ones go straight to
+  // the component.
+  static void rotate( const std::vector< EntityHandle >& entities, const std::vector< float >& rotations );
+  static void rotateAround( const std::vector< EntityHandle >& entities, const std::vector< std::pair< Vec2, float > >& rotations );
+  static void translate( const std::vector< EntityHandle >& entities, const std::vector< Vec2 >& translations );
+  static void scale( const std::vector< EntityHandle >& entities, const std::vector< Vec2 >& scales );
+  static void update( const std::vector< EntityHandle >& entities, const std::vector< Transform >& transforms );
+  static void rotate( EntityHandle entity, float rotation );
+  static void rotateAround( EntityHandle entity, Vec2 point, float rotation );
+  static void translate( EntityHandle entity, Vec2 translation );
+  static void scale( EntityHandle entity, Vec2 scale );
+  static void update( EntityHandle entity, Transform transform );
+  // the local transforms
   static void get( const std::vector< ComponentIndex >& indices, std::vector< Transform >* result );
+  // the world transforms as of the last updateWorldTransforms()
+  static void getWorld( const std::vector< ComponentIndex >& indices, std::vector< Transform >* result );
+  // the cosines and sines of the world orientations, updated with them
+  static void getRotations( const std::vector< ComponentIndex >& indices, std::vector< Vec2 >* result );
+  // The child keeps its local transform, which becomes relative to the
+  // parent. A null parent makes it a root again.
+  static void setParent( EntityHandle child, EntityHandle parent );
+  // Recomputes the world transforms of the subtrees whose local transform
+  // changed, and marks them updated. When the storage isn't sorted anymore it
+  // is sorted breadth-first first, after that it is a single sweep.
+  static void updateWorldTransforms();
   static void lookup( const std::vector< EntityHandle >& entities, LookupResult* result );
+  static ComponentMemory getMemoryUsage();
+  // reorder the components by position with about budget elements of work,
+  // does nothing while there are parented transforms, they are kept sorted by depth
+  static bool defragment( u32 budget );
+  // Entities whose transform was set or changed since the start of the last
+  // frame, which ends in flushDeferred(), so it is called once a frame
+  // anywhere it sees every change. Each is listed once, but may have been
+  // destroyed or lost the transform since.
   static std::vector< EntityHandle >& getLastUpdated();
 };
 
@@ -39,45 +110,207 @@ struct Collision {
 
 // TODO allow multiple colliders per entity (with linked list?)
 class ColliderManager {
-  struct ColliderComp {
-    Shape _;
-    // transform cache
-    Vec2 position;
-    Vec2 scale;
-    //
-    EntityHandle entity;
-  };
-  static ComponentMap< ColliderComp > componentMap;
-  static std::vector< Shape > transformedShapes;
+  // position and scale are the transform cache, world shape the shape they
+  // give and world bounds its bounding box, node and slot where it is in the
+  // quadtree, sweep slot where it is in the sweep and prune list and tree
+  // leaf its node in the AABB tree
+  enum Field { SHAPE, POSITION, SCALE, WORLD_SHAPE, WORLD_BOUNDS, QUAD_NODE, QUAD_SLOT, SWEEP_SLOT, TREE_LEAF };
+  static SoAComponentMap< Shape, Vec2, Vec2, Shape, Rect, u32, u32, u32, u32 > componentMap;
+  // entities that got a collider since the last update, their transform
+  // cache may have to be filled even if the transform didn't change
+  static std::vector< EntityHandle > added;
   static std::vector< std::vector< Collision > > collisions;
-
-  struct QuadBucket {
-    static const u8 CAPACITY = 16;
-    ComponentIndex _[ CAPACITY ];
-    // TODO standarize indices starting at 1
-    s8 lastInd = -1;
+  // colliders whose bounds overlap, found by the broadphase for collide()
+  struct ColliderPair {
+    ComponentIndex a, b;
+  };
+  static std::vector< ColliderPair > candidatePairs;
+  // the bounds kept next to the collider by the broadphases rebuilt every frame
+  struct BoundsEntry {
+    Rect bounds;
+    ComponentIndex collider;
   };
+
+  // Loose quadtree kept from frame to frame. A collider goes down to the
+  // child that has its center while it fits in the child's loose boundary,
+  // which is twice as big, and stays in its node until it doesn't fit in
+  // that node's anymore. Leaves split when they have more than the capacity,
+  // unless they are at the maximum depth, and subtrees merge back into a
+  // leaf when they have half as many.
+  static const u32 QUAD_NODE_CAPACITY = 16;
+  static const u32 QUAD_TREE_MAX_DEPTH = 8;
   struct QuadNode {
-    union {
-      QuadBucket elements = {};
-      u32 childIndices[ 4 ];
-    };
-    Shape boundary = { {}, ShapeType::AARECT };
-    bool isLeaf = true;
+    Rect boundary;
+    Rect looseBoundary;
+    u32 parent;
+    u32 firstChild; // 0 in leaves, the 4 children are consecutive
+    u32 count; // colliders in the subtree
+    u32 depth;
+    std::vector< ComponentIndex > elements;
   };
+  // 0 is null, 1 is the root, which takes whatever doesn't fit below
   static std::vector< QuadNode > quadTree;
-  static void buildQuadTree(Rect boundary);
-  static void subdivideQuadNode(u32 nodeInd);
-  static void insertIntoQuadTree(ComponentIndex colliderInd);
+  // first nodes of the blocks of 4 children that were merged back
+  static std::vector< u32 > freeQuadNodes;
+  // With a cell size the world is unbounded: the root has no children and
+  // only keeps the colliders too big for a cell, every cell of the grid that
+  // has colliders gets its own tree, found by the cell's coordinates.
+  static float quadCellSize;
+  static std::unordered_map< u64, u32 > quadCells;
+  static std::vector< u32 > freeQuadCells;
+  static void buildQuadTree( Rect boundary );
+  static void fitQuadTree();
+  static void subdivideQuadNode( u32 nodeInd );
+  static void mergeQuadNode( u32 nodeInd );
+  static void initQuadNode( u32 nodeInd, Rect boundary, u32 parent, u32 depth );
+  static u32 getQuadChild( u32 nodeInd, Vec2 point );
+  static bool fitsQuadNode( Rect bounds, u32 nodeInd );
+  static u32 addQuadCell( u64 key, Rect boundary );
+  static void removeQuadCell( u32 nodeInd );
+  static void getQuadRoots( Rect bounds, std::vector< u32 >* result );
+  static void insertIntoQuadTree( ComponentIndex colliderInd );
+  static void removeFromQuadTree( ComponentIndex colliderInd );
+  static void updateQuadTree( const std::vector< ComponentIndex >& refreshed );
+  static void findQuadTreePairs( const std::vector< ComponentIndex >& refreshed );
+  // The pairs found by the last update. Bounds that didn't change still
+  // overlap the same ones, so only the refreshed colliders, and the ones
+  // moved to another index since, are looked up again, unless the pairs
+  // aren't kept, after a load or a change of broadphase.
+  static std::vector< ColliderPair > quadPairs;
+  static bool quadPairsKept;
+  static std::vector< ComponentIndex > quadStale; // moved to another index
+  static std::vector< u8 > quadRequeried; // by collider, while finding the pairs
+
+  // Sweep and prune: the colliders' bounds sorted by their minimum along the
+  // axis they spread the most, only the ones whose intervals on it overlap
+  // get their bounds compared. The order barely changes from a frame to the
+  // next, so insertion sort keeps it sorted in close to linear time.
+  struct SweepEntry {
+    float min, max; // on the sweep axis
+    Rect bounds;
+    ComponentIndex collider; // 0 once removed, until the next update
+  };
+  // 0 is a sentinel that goes before anything
+  static std::vector< SweepEntry > sweepList;
+  static u32 sweepAxis; // 0 for x, 1 for y
+  static u32 sweepAppended; // since the last sort
+  static u32 sweepRemoved;
+  static void buildSweepList();
+  static void removeFromSweepList( ComponentIndex colliderInd );
+  static void sortSweepList();
+  static void updateSweepList( const std::vector< ComponentIndex >& refreshed );
+  static void findSweepPairs();
+
+  // Uniform grid for colliders of about the same size, rebuilt every frame.
+  // The cells are twice as wide as the median collider, each collider goes
+  // in the one that has its center, and the cells are wrapped row by row
+  // around a table filled by counting sort, so neighbours are 3 by 3 cells
+  // away and mostly next to each other in the table. The few colliders too
+  // big for a cell look through all the cells their bounds reach instead.
+  static Vec2 gridOrigin;
+  static float gridCellSize;
+  static u32 gridRowStride;
+  static bool gridWrapped;
+  static std::vector< BoundsEntry > gridEntries; // by bucket
+  static std::vector< u32 > gridBucketStarts; // one more than the buckets
+  static std::vector< u32 > gridBucketStamps; // the last query that went through each
+  static std::vector< BoundsEntry > gridOversized;
+  static void buildSpatialHash();
+  static void findSpatialHashPairs();
+
+  // Dynamic AABB tree, every collider is a single leaf however big it is. The
+  // leaves' bounds are fattened by a margin and by where the collider is
+  // heading, and it only goes back in the tree once it gets out of them. A
+  // leaf goes in next to the node that makes the tree's area grow the least,
+  // and rotations keep the tree balanced on the way back up.
+  struct TreeNode {
+    Rect bounds; // fattened in leaves
+    u32 parent;
+    u32 left, right; // 0 in leaves
+    u32 height; // 0 in leaves
+    ComponentIndex collider; // 0 in branches
+    Vec2 lastCenter; // of the collider's bounds at the last update
+  };
+  // 0 is null
+  static std::vector< TreeNode > aabbTree;
+  static u32 aabbTreeRoot;
+  static std::vector< u32 > freeTreeNodes;
+  static void buildAABBTree();
+  static u32 allocateTreeNode();
+  static void insertTreeLeaf( u32 leafInd );
+  static void removeTreeLeaf( u32 leafInd );
+  static u32 balanceTreeNode( u32 nodeInd );
+  static void insertIntoAABBTree( ComponentIndex colliderInd );
+  static void removeFromAABBTree( ComponentIndex colliderInd );
+  static void updateAABBTree( const std::vector< ComponentIndex >& refreshed );
+  static void findAABBTreePairs();
+
+  // Linear quadtree, rebuilt every frame over the square around the
+  // colliders. Each collider gets the level of the smallest cell it fits in
+  // and the Morton code of its center's cell at that level, then they are
+  // radix sorted by code with the level below it. A node's own colliders
+  // come first and its descendants' right after, so each subtree is a range
+  // of the sorted colliders, split by the next bits of the code until it has
+  // no more than QUAD_NODE_CAPACITY. The big colliders stay high up, which
+  // keeps the bounds of the nodes below tight.
+  static const u32 LINEAR_QUAD_DEPTH = 14;
+  struct LinearQuadNode {
+    Rect boundary;
+    Rect bounds; // of the colliders in its subtree
+    u32 begin, ownEnd, end; // its colliders, then its descendants' until end
+    u32 firstChild; // 0 in leaves, the 4 children are consecutive
+    u32 code; // of its first cell at the deepest level
+    u32 level;
+  };
+  static std::vector< u32 > linearQuadKeys; // code and level, sorted
+  static std::vector< BoundsEntry > linearQuadEntries; // in the order of the keys
+  // 0 is null, 1 is the root
+  static std::vector< LinearQuadNode > linearQuadTree;
+  static void buildLinearQuadTree();
+  static void findLinearQuadTreePairs();
+
+  static void removeFromBroadphase( ComponentIndex colliderInd );
+  static void relinkBroadphase( ComponentIndex colliderIndA, ComponentIndex colliderIndB );
+  static void onLoaded();
+  static Defragmentation defragmentation;
+  static u32 getSortKeys( ComponentIndex first, u32 count, SortEntry* result );
+  static Shape makeCircle( Circle circleCollider );
+  static Shape makeAxisAlignedRect( Rect aaRectCollider );
 public:
+  enum Broadphase { QUADTREE, SWEEP_AND_PRUNE, SPATIAL_HASH, AABB_TREE, LINEAR_QUADTREE, NUM_BROADPHASES };
+  static const char* BROADPHASE_NAMES[ NUM_BROADPHASES ];
+  // what the last updateAndCollide() spent finding the pairs to collide
+  struct BroadphaseStats {
+    u32 colliderCount;
+    u32 pairsTested; // bounds compared
+    u32 pairsFound; // bounds overlapping, passed to collide()
+    u64 nanos;
+  };
   static void initialize();
   static void shutdown();
+  // the quadtree unless set, the colliders already in one move to the other
+  static void setBroadphase( Broadphase newBroadphase );
+  static const BroadphaseStats& getBroadphaseStats();
+  // the colliders whose bounds overlapped in the last updateAndCollide(), by
+  // the entities they belong to, each pair once in no particular order
+  static void getCandidatePairs( std::vector< std::pair< EntityHandle, EntityHandle > >* result );
   static void addCircle( EntityHandle entity, Circle circleCollider );
   static void addAxisAlignedRect( EntityHandle entity, Rect aaRectCollider );
   static void remove( EntityHandle entity );
+  static void removeBatch( const std::vector< EntityHandle >& entities );
+  static void addCircleDeferred( EntityHandle entity, Circle circleCollider );
+  static void addAxisAlignedRectDeferred( EntityHandle entity, Rect aaRectCollider );
+  static void removeDeferred( EntityHandle entity );
+  static void flushDeferred();
   static void fitCircleToSprite( EntityHandle entity );
+  // 0 for a quadtree that follows the extents of the colliders, else the
+  // size of the cells of an unbounded world
+  static void setQuadCellSize( float cellSize );
   static void updateAndCollide();
   static void lookup( const std::vector< EntityHandle >& entities, LookupResult* result );
+  static ComponentMemory getMemoryUsage();
+  // reorder the components by position with about budget elements of work
+  static bool defragment( u32 budget );
   static bool collide( Shape shapeA, Shape shapeB );
   static bool collide( Shape shapeA, Shape shapeB, Collision& collision );
   static bool circleCircleCollide( Circle circleA, Circle circleB );
@@ -87,6 +320,10 @@ public:
   static bool aaRectAARectCollide( Rect aaRectA, Rect aaRectB );
   static bool aaRectAARectCollide( Rect aaRectA, Rect aaRectB, Vec2& normalA, Vec2& normalB );
   static std::vector< std::vector< Collision > >& getCollisions( const std::vector< ComponentIndex >& indices );
+  static std::vector< std::vector< Collision > >& getCollisions( ComponentIndex first, u32 count );
+private:
+  static Broadphase broadphase;
+  static BroadphaseStats broadphaseStats;
 };
 
 struct SolidBody {
@@ -99,15 +336,26 @@ class SolidBodyManager {
     EntityHandle entity;
   };
   static ComponentMap< SolidBodyComp > componentMap;
+  static ViewIndex collidingView; // solid bodies with a transform and a collider
+  static bool grouped;
+  static GroupIndex collidingGroup; // same entities as collidingView, once grouped
+  static Vec2 bounce( Vec2 speed, const std::vector< Collision >& collisions );
 public:
   static void initialize();
   static void shutdown();
   static void set( EntityHandle entity, SolidBody solidBody );
   static void remove( EntityHandle entity );
+  static void removeBatch( const std::vector< EntityHandle >& entities );
+  static void setDeferred( EntityHandle entity, SolidBody solidBody );
+  static void removeDeferred( EntityHandle entity );
+  static void flushDeferred();
   static void setSpeed( const std::vector< ComponentIndex >& indices, std::vector< Vec2 >& speeds );
   static void get( const std::vector< ComponentIndex >& indices, std::vector< SolidBody >* result );
   static void update( double detlaT );
+  // opt into keeping transforms, colliders and solid bodies in an owning group
+  static void groupComponents();
   static void lookup( const std::vector< EntityHandle >& entities, LookupResult* result );
+  static ComponentMemory getMemoryUsage();
 };
 
 struct Sprite {
@@ -120,11 +368,16 @@ class SpriteManager {
   struct SpriteComp {
     EntityHandle entity;
     Sprite sprite;
-    // transform cache
+    // transform cache, of the last two simulation steps
     Transform transform;
+    Vec2 rotation;
+    Transform previousTransform;
+    Vec2 previousRotation;
     explicit operator Sprite() const;
   };
   static ComponentMap< SpriteComp > componentMap;
+  // entities that got a sprite since the last update, as in ColliderManager
+  static std::vector< EntityHandle > added;
   // rendering data
   struct Pos {
     Vec2 pos;
@@ -136,15 +389,33 @@ class SpriteManager {
   // TODO merge into single vertex attrib pointer
   static Pos* posBufferData;
   static UV* texCoordsBufferData;
+  static Defragmentation defragmentation;
+  static u32 getSortKeys( ComponentIndex first, u32 count, SortEntry* result );
+  static SpriteComp makeSprite( EntityHandle entity, AssetIndex textureId, Rect texCoords );
+  static Vec2 getRenderedPosition( const SpriteComp& spriteComp, float interpolation );
 public:
   static void initialize();
   static void shutdown();
   static void set( EntityHandle entity, AssetIndex textureId, Rect texCoords );
   static void remove( EntityHandle entity );
+  static void removeBatch( const std::vector< EntityHandle >& entities );
+  static void setDeferred( EntityHandle entity, AssetIndex textureId, Rect texCoords );
+  static void removeDeferred( EntityHandle entity );
+  static void flushDeferred();
   static void get( const std::vector< ComponentIndex >& indices, std::vector< Sprite >* result );
-  static void updateAndRender();
+  // refresh the transform cache, every simulation step
+  static void update();
+  // every frame, interpolation is how far it is from the last step to the next
+  static void render( float interpolation );
+  // where render() puts their centers
+  static void getRenderedPositions( const std::vector< ComponentIndex >& indices, float interpolation,
+                                    std::vector< Vec2 >* result );
   static void setOrthoProjection( float aspectRatio, float height );
   static void lookup( const std::vector< EntityHandle >& entities, LookupResult* result );
+  static ComponentMemory getMemoryUsage();
+  // reorder the components by texture, then position, with about budget
+  // elements of work
+  static bool defragment( u32 budget );
 };
 
 typedef u32 AnimationHandle;
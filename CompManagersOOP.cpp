@@ -1,5 +1,8 @@
 #include "EngineCommon.hpp"
 
+#include <algorithm>
+#include <functional>
+
 void Transform::rotate( float rotation ) {
   PROFILE;
   orientation += rotation;
@@ -259,6 +262,9 @@ bool Collider::aaRectAARectCollide( Rect aaRectA, Rect aaRectB, Vec2& normalA, V
   return false;
 }
 
+std::vector< Collider::ColliderPair > Collider::candidatePairs;
+Collider::PairStats Collider::pairStats = {};
+
 void Collider::addCollision( Collision collision ) {
   collisions.push_back( collision );
 }
@@ -283,23 +289,45 @@ void Collider::updateAndCollide() {
   Rect boundary = { { -420, -240 }, { 420, 240 } };
   QuadTree quadTree( boundary, colliders );
   std::vector< std::vector< Collider* > > quadTreeGroups = quadTree.getGroupedElements();
-  // detect collisions
+  // gather the pairs of every leaf, then drop the ones repeated by colliders
+  // straddling several leaves so each pair is collided once
+  candidatePairs.clear();
   for ( u32 groupInd = 0; groupInd < quadTreeGroups.size(); ++groupInd ) {
-    std::vector< Collider* > colliderGroup = quadTreeGroups[ groupInd ];
+    std::vector< Collider* >& colliderGroup = quadTreeGroups[ groupInd ];
     for ( u8 i = 0; i < colliderGroup.size() - 1; ++i ) {
       Collider* collI = colliderGroup[ i ];
       for ( u8 j = i + 1; j < colliderGroup.size(); ++j ) {
         Collider* collJ = colliderGroup[ j ];
-        Collision collision;
-        if ( collI->collide( *collJ, collision ) ) {
-          collI->addCollision( collision );
-          collJ->addCollision( { collision.b, collision.a, collision.normalB, collision.normalA } );
-          Debug::drawShape( collI->getTransformedShape(), Debug::GREEN );
-          Debug::drawShape( collJ->getTransformedShape(), Debug::GREEN );
-        }
+        candidatePairs.push_back( std::less< Collider* >()( collI, collJ ) ? ColliderPair{ collI, collJ } : ColliderPair{ collJ, collI } );
       }
     }
   }
+  pairStats.pairsGrouped = candidatePairs.size();
+  // unrelated pointers only have a total order through std::less
+  std::less< Collider* > less;
+  std::sort( candidatePairs.begin(), candidatePairs.end(), [ &less ]( const ColliderPair& left, const ColliderPair& right ) {
+    return less( left.a, right.a ) || ( left.a == right.a && less( left.b, right.b ) );
+  } );
+  candidatePairs.erase( std::unique( candidatePairs.begin(), candidatePairs.end(), []( const ColliderPair& left, const ColliderPair& right ) {
+    return left.a == right.a && left.b == right.b;
+  } ), candidatePairs.end() );
+  pairStats.pairsUnique = candidatePairs.size();
+  // detect collisions
+  for ( u32 pairInd = 0; pairInd < candidatePairs.size(); ++pairInd ) {
+    Collider* collI = candidatePairs[ pairInd ].a;
+    Collider* collJ = candidatePairs[ pairInd ].b;
+    Collision collision;
+    if ( collI->collide( *collJ, collision ) ) {
+      collI->addCollision( collision );
+      collJ->addCollision( { collision.b, collision.a, collision.normalB, collision.normalA } );
+      Debug::drawShape( collI->getTransformedShape(), Debug::GREEN );
+      Debug::drawShape( collJ->getTransformedShape(), Debug::GREEN );
+    }
+  }
+}
+
+const Collider::PairStats& Collider::getPairStats() {
+  return pairStats;
 }
 
 std::list< QuadTree::QuadNode > QuadTree::QuadNode::allNodes;
@@ -40,7 +40,16 @@ class Collider : public Component {
   Shape* transformedShape;
   std::vector< Collision > collisions;
   void addCollision( Collision collision );
+  // pairs sharing a quadtree leaf, a collider straddling leaves is in each of them
+  struct ColliderPair {
+    Collider *a, *b;
+  };
+  static std::vector< ColliderPair > candidatePairs;
 public:
+  struct PairStats {
+    u32 pairsGrouped; // pairs sharing a leaf, repeated once per shared leaf
+    u32 pairsUnique; // passed to collide()
+  };
   Collider() {}
   Collider( Circle shape );
   Collider( Rect shape );
@@ -54,12 +63,16 @@ public:
   std::vector< Collision > getCollisions();
 
   static void updateAndCollide();
+  // of the last updateAndCollide()
+  static const PairStats& getPairStats();
   static bool circleCircleCollide( Circle circleA, Circle circleB );
   static bool circleCircleCollide( Circle circleA, Circle circleB, Vec2& normalA, Vec2& normalB );
   static bool aaRectCircleCollide( Rect aaRect, Circle circle );
   static bool aaRectCircleCollide( Rect aaRect, Circle circle, Vec2& normalA, Vec2& normalB );
   static bool aaRectAARectCollide( Rect aaRectA, Rect aaRectB );
   static bool aaRectAARectCollide( Rect aaRectA, Rect aaRectB, Vec2& normalA, Vec2& normalB );
+private:
+  static PairStats pairStats;
 };
 
 struct Collision {
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "EngineCommon.hpp"
+
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+// Compares the paged sparse index used by ComponentMap against the flat
+// MAX_ENTITIES array it replaced, and times the layouts of the component
+// arrays: owning groups and components sorted by position.
+class ComponentMapTest {
+  static constexpr const u32 NUM_SIZES = 3;
+  static constexpr const u32 ENTITY_COUNTS[ NUM_SIZES ] = { 1500, 100000, 1000000 };
+  static constexpr const u32 NUM_BODIES = 20000;
+  static constexpr const u32 NUM_UPDATES = 100;
+  static void benchmarkIndices( u32 entityCount );
+  static u64 benchmarkSolidBodyUpdate( const char* name );
+  static constexpr const u32 NUM_COLLIDERS = 20000;
+  static constexpr const u32 NUM_COLLISION_UPDATES = 20;
+  static constexpr const u32 DEFRAGMENT_BUDGET = 256;
+  static u64 benchmarkCollisions( const char* name );
+public:
+  static void run();
+  // leaves transforms, colliders and solid bodies grouped
+  static void runGroups();
+  // must run before runGroups(), grouped components are never reordered
+  static void runDefragmentation();
+};
+
+constexpr const u32 ComponentMapTest::ENTITY_COUNTS[];
+
+void ComponentMapTest::benchmarkIndices( u32 entityCount ) {
+  // entity indices start at 1, shuffled so lookups touch random slots
+  std::vector< u32 > indices( entityCount );
+  for ( u32 i = 0; i < entityCount; ++i ) {
+    indices[ i ] = i + 1;
+  }
+  std::vector< u32 > shuffled = indices;
+  std::random_shuffle( shuffled.begin(), shuffled.end() );
+  u64 checksum = 0;
+  // flat array
+  ComponentIndex* flat = new ComponentIndex[ MAX_ENTITIES ]();
+  TimePoint start = Clock::now();
+  for ( u32 i = 0; i < entityCount; ++i ) {
+    flat[ indices[ i ] ] = i + 1;
+  }
+  u64 flatSetNanos = elapsedNanos( start );
+  start = Clock::now();
+  for ( u32 i = 0; i < entityCount; ++i ) {
+    checksum += flat[ shuffled[ i ] ];
+  }
+  u64 flatLookupNanos = elapsedNanos( start );
+  start = Clock::now();
+  for ( u32 i = 0; i < entityCount; ++i ) {
+    flat[ shuffled[ i ] ] = 0;
+  }
+  u64 flatRemoveNanos = elapsedNanos( start );
+  u64 flatBytes = MAX_ENTITIES * sizeof( ComponentIndex );
+  delete[] flat;
+  // paged sparse index
+  PagedIndex* paged = new PagedIndex();
+  start = Clock::now();
+  for ( u32 i = 0; i < entityCount; ++i ) {
+    paged->set( indices[ i ], i + 1 );
+  }
+  u64 pagedSetNanos = elapsedNanos( start );
+  u64 pagedBytes = paged->getResidentBytes();
+  start = Clock::now();
+  for ( u32 i = 0; i < entityCount; ++i ) {
+    checksum -= paged->get( shuffled[ i ] );
+  }
+  u64 pagedLookupNanos = elapsedNanos( start );
+  start = Clock::now();
+  for ( u32 i = 0; i < entityCount; ++i ) {
+    paged->set( shuffled[ i ], 0 );
+  }
+  u64 pagedRemoveNanos = elapsedNanos( start );
+  ASSERT( checksum == 0 && paged->getResidentBytes() <= pagedBytes, "Paged index diverged from flat array" );
+  start = Clock::now();
+  paged->trim();
+  u64 pagedTrimNanos = elapsedNanos( start );
+  ASSERT( paged->residentPages == 0, "%d pages left after trimming an empty index", paged->residentPages );
+  delete paged;
+  // printed so the lookups can't be optimized away, 0 if both agree
+  Debug::write( "%d entities (lookup checksum %lu):\n", entityCount, checksum );
+  Debug::write( "\tflat:  set %.2f ns, lookup %.2f ns, remove %.2f ns, %lu bytes\n",
+                flatSetNanos / ( double )entityCount, flatLookupNanos / ( double )entityCount,
+                flatRemoveNanos / ( double )entityCount, flatBytes );
+  Debug::write( "\tpaged: set %.2f ns, lookup %.2f ns, remove %.2f ns, %lu bytes, emptied pages trimmed in %.3f ms\n",
+                pagedSetNanos / ( double )entityCount, pagedLookupNanos / ( double )entityCount,
+                pagedRemoveNanos / ( double )entityCount, pagedBytes, pagedTrimNanos / 1.0e6 );
+}
+
+void ComponentMapTest::run() {
+  Debug::write( "Running ComponentMap sparse index benchmark...\n" );
+  for ( u32 sizeInd = 0; sizeInd < NUM_SIZES; ++sizeInd ) {
+    benchmarkIndices( ENTITY_COUNTS[ sizeInd ] );
+  }
+  Debug::write( "Resident component memory (index / components):\n" );
+  ComponentMemory memory = TransformManager::getMemoryUsage();
+  Debug::write( "\tTransform:\t%lu / %lu bytes\n", memory.indexBytes, memory.componentBytes );
+  memory = ColliderManager::getMemoryUsage();
+  Debug::write( "\tCollider:\t%lu / %lu bytes\n", memory.indexBytes, memory.componentBytes );
+  memory = SolidBodyManager::getMemoryUsage();
+  Debug::write( "\tSolidBody:\t%lu / %lu bytes\n", memory.indexBytes, memory.componentBytes );
+  memory = SpriteManager::getMemoryUsage();
+  Debug::write( "\tSprite:\t\t%lu / %lu bytes\n", memory.indexBytes, memory.componentBytes );
+}
+
+u64 ComponentMapTest::benchmarkSolidBodyUpdate( const char* name ) {
+  // collisions must be up to date with the current collider indices
+  ColliderManager::updateAndCollide();
+  TimePoint start = Clock::now();
+  {
+    PROFILE_BLOCK( name );
+    for ( u32 i = 0; i < NUM_UPDATES; ++i ) {
+      SolidBodyManager::update( 1.0 / 30.0 );
+    }
+  }
+  return elapsedNanos( start );
+}
+
+void ComponentMapTest::runGroups() {
+  Debug::write( "Running owning group benchmark...\n" );
+  std::vector< EntityHandle > entities;
+  EntityManager::createBatch( NUM_BODIES, &entities );
+  // add every type of component in a different order so that, without the
+  // group, the three arrays are unrelated to each other
+  for ( u32 i = 0; i < NUM_BODIES; ++i ) {
+    Vec2 position = { ( std::rand() % 800 ) - 400.0f, ( std::rand() % 460 ) - 230.0f };
+    TransformManager::set( entities[ i ], { position, VEC2_ONE, 0.0f } );
+  }
+  for ( u32 i = NUM_BODIES; i > 0; --i ) {
+    ColliderManager::addCircle( entities[ i - 1 ], { {}, 1.0f } );
+  }
+  std::vector< EntityHandle > shuffled = entities;
+  std::random_shuffle( shuffled.begin(), shuffled.end() );
+  for ( u32 i = 0; i < NUM_BODIES; ++i ) {
+    SolidBodyManager::set( shuffled[ i ], { { 1.0f, 1.0f } } );
+  }
+  // start from clean counters so the profiler log only holds these blocks
+  Profiler::updateOutputsAndReset();
+  u64 ungroupedNanos = benchmarkSolidBodyUpdate( "Ungrouped SolidBody update" );
+  SolidBodyManager::groupComponents();
+  u64 groupedNanos = benchmarkSolidBodyUpdate( "Grouped SolidBody update" );
+  // write the L1 and L2 misses of both blocks to the profiler log
+  Profiler::updateOutputsAndReset();
+  double updatedBodies = NUM_BODIES * ( double )NUM_UPDATES;
+  Debug::write( "%d solid bodies: ungrouped %.2f ns/body, grouped %.2f ns/body\n", NUM_BODIES,
+                ungroupedNanos / updatedBodies, groupedNanos / updatedBodies );
+  EntityManager::destroyBatch( entities );
+}
+
+u64 ComponentMapTest::benchmarkCollisions( const char* name ) {
+  TimePoint start = Clock::now();
+  {
+    PROFILE_BLOCK( name );
+    for ( u32 i = 0; i < NUM_COLLISION_UPDATES; ++i ) {
+      ColliderManager::updateAndCollide();
+    }
+  }
+  return elapsedNanos( start );
+}
+
+void ComponentMapTest::runDefragmentation() {
+  Debug::write( "Running spatial defragmentation benchmark...\n" );
+  std::vector< EntityHandle > entities;
+  EntityManager::createBatch( NUM_COLLIDERS, &entities );
+  // components in random order relative to their positions, as after churn
+  std::vector< EntityHandle > shuffled = entities;
+  std::random_shuffle( shuffled.begin(), shuffled.end() );
+  for ( u32 i = 0; i < NUM_COLLIDERS; ++i ) {
+    Vec2 position = { ( std::rand() % 800 ) - 400.0f, ( std::rand() % 460 ) - 230.0f };
+    TransformManager::set( shuffled[ i ], { position, VEC2_ONE, 0.0f } );
+    ColliderManager::addCircle( shuffled[ i ], { {}, 1.0f } );
+  }
+  // fill the colliders' transform caches
+  ColliderManager::updateAndCollide();
+  Profiler::updateOutputsAndReset();
+  u64 unsortedNanos = benchmarkCollisions( "Unsorted collision detection" );
+  u32 frames = 0;
+  bool transformsDone = false, collidersDone = false;
+  while ( !transformsDone || !collidersDone ) {
+    transformsDone = transformsDone || TransformManager::defragment( DEFRAGMENT_BUDGET );
+    collidersDone = collidersDone || ColliderManager::defragment( DEFRAGMENT_BUDGET );
+    ++frames;
+  }
+  u64 sortedNanos = benchmarkCollisions( "Sorted collision detection" );
+  Profiler::updateOutputsAndReset();
+  // the transforms must now be in Morton order
+  LookupResult lookupResult;
+  TransformManager::lookup( entities, &lookupResult );
+  std::sort( lookupResult.indices.begin(), lookupResult.indices.end(), []( ComponentIndex a, ComponentIndex b ) {
+      return ( a & COMPONENT_INDEX_MASK ) < ( b & COMPONENT_INDEX_MASK );
+    } );
+  std::vector< Transform > transforms;
+  TransformManager::get( lookupResult.indices, &transforms );
+  u32 outOfOrder = 0;
+  for ( u32 i = 1; i < transforms.size(); ++i ) {
+    if ( mortonCode( transforms[ i ].position, SORT_CELL_SIZE ) < mortonCode( transforms[ i - 1 ].position, SORT_CELL_SIZE ) ) {
+      ++outOfOrder;
+    }
+  }
+  ASSERT( outOfOrder == 0, "%d transforms out of order after defragmenting", outOfOrder );
+  Debug::write( "%d colliders sorted in %d frames of %d: collisions unsorted %.2f ms, sorted %.2f ms\n",
+                NUM_COLLIDERS, frames, DEFRAGMENT_BUDGET, unsortedNanos / 1.0e6 / NUM_COLLISION_UPDATES,
+                sortedNanos / 1.0e6 / NUM_COLLISION_UPDATES );
+  EntityManager::destroyBatch( entities );
+}
@@ -199,6 +199,11 @@ void Debug::drawShape( Shape* shape, Color color ) {
 #endif
 
 void Debug::renderAndClear() {
+  render();
+  clear();
+}
+
+void Debug::render() {
 #ifndef NDEBUG
   // configure buffers and render circles
   glUseProgram( circleRenderInfo.shaderProgramId );
@@ -206,13 +211,18 @@ void Debug::renderAndClear() {
   glBindBuffer( GL_ARRAY_BUFFER, circleRenderInfo.vboIds[ 0 ] );
   glBufferData( GL_ARRAY_BUFFER, sizeof( DebugCircle ) * circleBufferData.size(), circleBufferData.data(), GL_STATIC_DRAW );
   glDrawArrays( GL_POINTS, 0, circleBufferData.size() );
-  circleBufferData.clear();
   // render rectangles
   glUseProgram( rectRenderInfo.shaderProgramId );
   glBindVertexArray( rectRenderInfo.vaoId );
   glBindBuffer( GL_ARRAY_BUFFER, rectRenderInfo.vboIds[ 0 ] );
   glBufferData( GL_ARRAY_BUFFER, sizeof( DebugRect ) * rectBufferData.size(), rectBufferData.data(), GL_STATIC_DRAW );
   glDrawArrays( GL_POINTS, 0, rectBufferData.size() );
+#endif
+}
+
+void Debug::clear() {
+#ifndef NDEBUG
+  circleBufferData.clear();
   rectBufferData.clear();  
 #endif
 }
@@ -53,6 +53,9 @@ public:
   static void drawShape( Shape* shape, Color color );
 #endif
   static void renderAndClear();
+  // for shapes that stay up over several frames
+  static void render();
+  static void clear();
   static void setOrthoProjection( float aspectRatio, float height );
 };
 
@@ -85,6 +88,10 @@ public:
 typedef std::chrono::time_point< std::chrono::high_resolution_clock > TimePoint;
 typedef std::chrono::high_resolution_clock Clock;
 
+inline u64 elapsedNanos( TimePoint start ) {
+  return std::chrono::duration_cast< std::chrono::nanoseconds >( Clock::now() - start ).count();
+}
+
 struct AutoProfile {
   AutoProfile( const char* name );
   ~AutoProfile();
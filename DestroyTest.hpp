@@ -4,16 +4,41 @@
 
 #include <vector>
 #include <cstdlib>
+#include <thread>
 
 class DestroyTest {
+  static constexpr const u32 NUM_WAVE_SIZES = 3;
+  static constexpr const u32 WAVE_SIZES[ NUM_WAVE_SIZES ] = { 10000, 100000, 1000000 };
+  static constexpr const u32 REPORT_INTERVAL = 10000;
+  static constexpr const u32 NUM_THREAD_COUNTS = 5;
+  static constexpr const u32 THREAD_COUNTS[ NUM_THREAD_COUNTS ] = { 1, 2, 4, 8, 16 };
+  static constexpr const u32 ENTITIES_PER_THREAD = 200000;
+  static constexpr const u32 CHURN_BATCH = 500;
+  static constexpr const u32 NUM_SPAWNING_THREADS = 4;
+  static constexpr const u32 NUM_PROJECTILE_FRAMES = 200;
   static std::vector< EntityHandle > liveEntities;
+  static u32 updateCount;
   static void addEntityToTest();
+  static void addComponentsToWave( const std::vector< EntityHandle >& wave );
+  static void churnConcurrently();
+  static void spawnProjectiles( std::vector< EntityHandle >* projectiles );
 public:
   static void initialize();
   static void update();
+  // spawn and tear down waves of entities one at a time and in batches
+  static void benchmarkWaves();
+  // create and destroy entities from 1 to 16 threads at the same time
+  static void benchmarkContention();
+  // jobs spawn projectiles every frame that the main thread gives components
+  // and destroys, their slots must be reused instead of new ones claimed
+  static void runProjectiles();
 };
 
+constexpr const u32 DestroyTest::WAVE_SIZES[];
+constexpr const u32 DestroyTest::THREAD_COUNTS[];
+
 std::vector< EntityHandle > DestroyTest::liveEntities;
+u32 DestroyTest::updateCount;
 
 void DestroyTest::addEntityToTest() {
     EntityHandle entity = EntityManager::create();
@@ -33,6 +58,133 @@ void DestroyTest::update() {
         
   int ind = rand() % liveEntities.size();
   EntityHandle entity = liveEntities[ ind ];
-  EntityManager::destroy( entity );
+  {
+    PROFILE_BLOCK( "Destroy Entity" );
+    EntityManager::destroy( entity );
+  }
   liveEntities.erase( liveEntities.begin() + ind );
+  // memory use should stay flat no matter how long the churn goes on
+  if ( ++updateCount % REPORT_INTERVAL == 0 ) {
+    EntityManager::trimIndices();
+    ComponentMemory memory = TransformManager::getMemoryUsage();
+    Debug::write( "%d updates: transform index %lu bytes, components %lu bytes\n",
+                  updateCount, memory.indexBytes, memory.componentBytes );
+  }
+}
+
+void DestroyTest::addComponentsToWave( const std::vector< EntityHandle >& wave ) {
+  for ( u32 i = 0; i < wave.size(); ++i ) {
+    TransformManager::set( wave[ i ], { { ( float )i, 0.0f }, VEC2_ONE, 0.0f } );
+    if ( i % 2 == 0 ) {
+      SolidBodyManager::set( wave[ i ], { VEC2_ONE } );
+    }
+  }
+}
+
+void DestroyTest::benchmarkWaves() {
+  Debug::write( "Running Entity wave creation and destruction benchmark...\n" );
+  std::vector< EntityHandle > wave;
+  for ( u32 sizeInd = 0; sizeInd < NUM_WAVE_SIZES; ++sizeInd ) {
+    u32 waveSize = WAVE_SIZES[ sizeInd ];
+    // one entity per call
+    wave.clear();
+    wave.reserve( waveSize );
+    TimePoint start = Clock::now();
+    for ( u32 i = 0; i < waveSize; ++i ) {
+      wave.push_back( EntityManager::create() );
+    }
+    double createSecs = elapsedNanos( start ) / 1.0e9;
+    addComponentsToWave( wave );
+    start = Clock::now();
+    for ( u32 i = 0; i < waveSize; ++i ) {
+      EntityManager::destroy( wave[ i ] );
+    }
+    double destroySecs = elapsedNanos( start ) / 1.0e9;
+    Debug::write( "%d entities one by one:\tcreate %.2f M/s, destroy %.2f M/s\n", waveSize,
+                  waveSize / createSecs / 1.0e6, waveSize / destroySecs / 1.0e6 );
+    // batched
+    wave.clear();
+    start = Clock::now();
+    EntityManager::createBatch( waveSize, &wave );
+    createSecs = elapsedNanos( start ) / 1.0e9;
+    addComponentsToWave( wave );
+    start = Clock::now();
+    EntityManager::destroyBatch( wave );
+    destroySecs = elapsedNanos( start ) / 1.0e9;
+    Debug::write( "%d entities batched:\tcreate %.2f M/s, destroy %.2f M/s\n", waveSize,
+                  waveSize / createSecs / 1.0e6, waveSize / destroySecs / 1.0e6 );
+  }
+}
+
+// what a gameplay job spawning short lived projectiles would do
+void DestroyTest::churnConcurrently() {
+  EntityHandle batch[ CHURN_BATCH ];
+  for ( u32 created = 0; created < ENTITIES_PER_THREAD; created += CHURN_BATCH ) {
+    for ( u32 i = 0; i < CHURN_BATCH; ++i ) {
+      batch[ i ] = EntityManager::createConcurrent();
+    }
+    for ( u32 i = 0; i < CHURN_BATCH; ++i ) {
+      ASSERT( EntityManager::isAlive( batch[ i ] ), "Entity %d created concurrently is dead", batch[ i ] );
+      EntityManager::destroyConcurrent( batch[ i ] );
+    }
+  }
+  EntityManager::releaseThreadReservation();
+}
+
+void DestroyTest::benchmarkContention() {
+  Debug::write( "Running concurrent Entity creation and destruction benchmark...\n" );
+  std::vector< std::thread > threads;
+  for ( u32 countInd = 0; countInd < NUM_THREAD_COUNTS; ++countInd ) {
+    u32 threadCount = THREAD_COUNTS[ countInd ];
+    threads.clear();
+    TimePoint start = Clock::now();
+    for ( u32 i = 0; i < threadCount; ++i ) {
+      threads.push_back( std::thread( &DestroyTest::churnConcurrently ) );
+    }
+    for ( u32 i = 0; i < threadCount; ++i ) {
+      threads[ i ].join();
+    }
+    double secs = elapsedNanos( start ) / 1.0e9;
+    double entities = threadCount * ( double )ENTITIES_PER_THREAD;
+    Debug::write( "%d threads:\tcreate + destroy %.2f M/s in total, %.2f M/s per thread\n", threadCount,
+                  entities / secs / 1.0e6, entities / secs / 1.0e6 / threadCount );
+  }
+}
+
+void DestroyTest::spawnProjectiles( std::vector< EntityHandle >* projectiles ) {
+  for ( u32 i = 0; i < CHURN_BATCH; ++i ) {
+    projectiles->push_back( EntityManager::createConcurrent() );
+  }
+}
+
+void DestroyTest::runProjectiles() {
+  Debug::write( "Running concurrent projectile spawning test...\n" );
+  std::vector< EntityHandle > projectiles[ NUM_SPAWNING_THREADS ];
+  std::vector< std::thread > threads;
+  // which slots the projectiles took
+  std::vector< bool > used( MAX_ENTITIES, false );
+  u32 slotCount = 0;
+  for ( u32 frame = 0; frame < NUM_PROJECTILE_FRAMES; ++frame ) {
+    threads.clear();
+    for ( u32 i = 0; i < NUM_SPAWNING_THREADS; ++i ) {
+      projectiles[ i ].clear();
+      threads.push_back( std::thread( &DestroyTest::spawnProjectiles, &projectiles[ i ] ) );
+    }
+    for ( u32 i = 0; i < NUM_SPAWNING_THREADS; ++i ) {
+      threads[ i ].join();
+    }
+    // they live for a frame, with components, so they die the usual way
+    for ( u32 i = 0; i < NUM_SPAWNING_THREADS; ++i ) {
+      for ( EntityHandle projectile : projectiles[ i ] ) {
+        TransformManager::set( projectile, { {}, VEC2_ONE, 0.0f } );
+        EntityManager::destroyDeferred( projectile );
+        slotCount += !used[ projectile.index ];
+        used[ projectile.index ] = true;
+      }
+    }
+    EntityManager::flushDeferred();
+  }
+  u32 spawned = NUM_PROJECTILE_FRAMES * NUM_SPAWNING_THREADS * CHURN_BATCH;
+  ASSERT( slotCount < spawned / 10, "%d projectiles spawned in %d slots", spawned, slotCount );
+  Debug::write( "%d projectiles spawned over %d frames in %d slots\n", spawned, NUM_PROJECTILE_FRAMES, slotCount );
 }
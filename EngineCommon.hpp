@@ -125,7 +125,22 @@ struct RenderInfo {
 #ifdef DOD
 struct EntityHandle; 
 
+// every component type gets a bit in the entities' component masks
+enum ComponentType { TRANSFORM, COLLIDER, SOLID_BODY, SPRITE, NUM_COMPONENT_TYPES };
+
+typedef u32 ComponentMask;
+
 typedef void ( *RmvCompCallback )( EntityHandle entity );
+typedef void ( *RmvCompsCallback )( const std::vector< EntityHandle >& entities );
+typedef void ( *FlushCompsCallback )();
+typedef void ( *LoadedCompsCallback )();
+
+struct CompCallbacks {
+  RmvCompCallback remove;
+  RmvCompsCallback removeBatch;
+  FlushCompsCallback flushDeferred;
+  LoadedCompsCallback loaded; // optional, the whole world has just been replaced
+};
 
 typedef u32 ComponentIndex;
 #endif
@@ -133,7 +148,10 @@ typedef u32 ComponentIndex;
 //////////////////////////////////////////////////////////////////////////////
 
 #ifdef DOD
+#include "SIMD.hpp"
+#include "Scheduler.hpp"
 #include "EntityManager.hpp"
+#include "SoAComponentMap.hpp"
 #include "CompManagers.hpp"
 #elif defined OOP
 #include "CompManagersOOP.hpp"
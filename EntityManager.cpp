@@ -1,47 +1,1312 @@
 #include "EngineCommon.hpp"
 
-std::vector< EntityManager::Generation > EntityManager::generations;
+#include <algorithm>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+std::atomic< u32 >* EntityManager::generations;
+ComponentMask* EntityManager::componentMasks;
+std::atomic< u8 >* EntityManager::entityChanges;
+std::atomic< u32 > EntityManager::entityCount( 0 );
 std::deque< u32 > EntityManager::freeIndices;
-std::unordered_multimap< u32, RmvCompCallback > EntityManager::removeComponentCallbacks;
+std::atomic< u32 >* EntityManager::freeNext;
+std::atomic< u64 > EntityManager::freeStackHead( 0 );
+std::atomic< u32 > EntityManager::freeStackSize( 0 );
+thread_local EntityManager::ThreadReservation EntityManager::reservation;
+CompCallbacks EntityManager::componentCallbacks[ NUM_COMPONENT_TYPES ];
+ComponentStorage EntityManager::componentStorages[ NUM_COMPONENT_TYPES ];
+std::vector< EntityHandle > EntityManager::deferredDestroys;
+ComponentView EntityManager::views[ MAX_VIEWS ];
+u32 EntityManager::viewCount;
+u32 EntityManager::viewsByType[ NUM_COMPONENT_TYPES ];
+OwningGroup EntityManager::groups[ MAX_GROUPS ];
+u32 EntityManager::groupCount;
+u32 EntityManager::groupsByType[ NUM_COMPONENT_TYPES ];
+EntityManager::HistoryFrame* EntityManager::historyFrames;
+u32 EntityManager::historyLength;
+u8* EntityManager::historyBytes;
+u32 EntityManager::historyCapacity;
+u32 EntityManager::historyWriteOffset;
+u8* EntityManager::historyWorld;
+std::vector< u32 > EntityManager::capturedBytes;
+std::vector< std::vector< u8 > > EntityManager::capturedSections;
+std::vector< EntityManager::HistoryRange > EntityManager::changedRanges;
+u32 EntityManager::oldestFrame;
+u32 EntityManager::nextFrame;
+const u32 EntityManager::RESERVATION_SIZE;
 
 EntityHandle::operator u32() const {
   return this->generation << HANDLE_INDEX_BITS | this->index;
 }
 
 void EntityManager::initialize() {
+  // calloc gets zeroed pages from the OS lazily, the arrays only take up
+  // physical memory as entities are created
+  generations = static_cast< std::atomic< u32 >* >( std::calloc( MAX_ENTITIES, sizeof( std::atomic< u32 > ) ) );
+  componentMasks = static_cast< ComponentMask* >( std::calloc( MAX_ENTITIES, sizeof( ComponentMask ) ) );
+  entityChanges = static_cast< std::atomic< u8 >* >( std::calloc( MAX_ENTITIES / ENTITY_CHUNK_LENGTH, sizeof( std::atomic< u8 > ) ) );
+  // each entry is written before it is linked into the stack
+  freeNext = new std::atomic< u32 >[ MAX_ENTITIES ];
 }
 
 void EntityManager::shutdown() {
+  std::free( generations );
+  std::free( componentMasks );
+  std::free( entityChanges );
+  delete[] freeNext;
+  delete[] historyFrames;
+  delete[] historyBytes;
+  delete[] historyWorld;
+}
+
+void EntityManager::registerComponentType( ComponentType type, CompCallbacks callbacks, ComponentStorage storage ) {
+  ASSERT( componentCallbacks[ type ].remove == nullptr, "Component type %d registered twice", type );
+  componentCallbacks[ type ] = callbacks;
+  componentStorages[ type ] = storage;
+}
+
+u32 EntityManager::claimSlots( u32 count ) {
+  u32 first = entityCount.fetch_add( count, std::memory_order_relaxed );
+  // we count from 1. Release builds halt too, the arrays end there.
+  if ( first + count >= MAX_ENTITIES ) {
+    Debug::haltWithMessage( "first + count < MAX_ENTITIES", __FILE__, __FUNC__, __LINE__,
+                            "Tried to create more than %d entities", MAX_ENTITIES );
+  }
+  return first;
+}
+
+void EntityManager::advanceGeneration( u32 index ) {
+  u32 generation = generations[ index ].load( std::memory_order_relaxed );
+  generations[ index ].store( ( generation + 1 ) & ( ( 1 << HANDLE_GENERATION_BITS ) - 1 ), std::memory_order_relaxed );
+  entityChanges[ index / ENTITY_CHUNK_LENGTH ].store( 1, std::memory_order_relaxed );
 }
 
 EntityHandle EntityManager::create() {
   u32 index;
-  if ( freeIndices.size() < MIN_FREE_INDICES ) {
-    generations.push_back( { 0 } );
-    // we count from 1
-    index = generations.size();
-    ASSERT( index < MAX_ENTITIES, "Tried to create more than %d entities", MAX_ENTITIES );
-  } else {
+  if ( freeIndices.size() >= MIN_FREE_INDICES ) {
+    index = freeIndices.front();
+    freeIndices.pop_front();
+  } else if ( freeStackSize.load( std::memory_order_relaxed ) < MIN_FREE_INDICES || popFreeIndices( 1, &index ) == 0 ) {
+    index = claimSlots( 1 );
+  }
+  return { index + 1, generations[ index ].load( std::memory_order_relaxed ) }; // we count from 1
+}
+
+void EntityManager::createBatch( u32 count, std::vector< EntityHandle >* result ) {
+  result->reserve( result->size() + count );
+  // reuse freed indices for as long as create() would...
+  u32 reused = 0;
+  while ( reused < count && freeIndices.size() >= MIN_FREE_INDICES ) {
     // we count from 1
-    index = freeIndices.front() + 1;
+    u32 index = freeIndices.front() + 1;
     freeIndices.pop_front();
+    result->push_back( { index, generations[ index - 1 ].load( std::memory_order_relaxed ) } );
+    ++reused;
+  }
+  // ...then the ones shared with createConcurrent()...
+  if ( reused < count && freeStackSize.load( std::memory_order_relaxed ) >= MIN_FREE_INDICES ) {
+    static std::vector< u32 > popped;
+    popped.resize( count - reused );
+    u32 poppedCount = popFreeIndices( count - reused, popped.data() );
+    for ( u32 i = 0; i < poppedCount; ++i ) {
+      result->push_back( { popped[ i ] + 1, generations[ popped[ i ] ].load( std::memory_order_relaxed ) } ); // we count from 1
+    }
+    reused += poppedCount;
+  }
+  // ...and claim the rest of the indices in bulk
+  u32 newCount = count - reused;
+  u32 firstIndex = claimSlots( newCount ) + 1; // we count from 1
+  for ( u32 i = 0; i < newCount; ++i ) {
+    result->push_back( { firstIndex + i, 0 } );
+  }
+}
+
+void EntityManager::pushFreeIndices( const u32* indices, u32 count ) {
+  // link the indices to each other before publishing them
+  for ( u32 i = 0; i + 1 < count; ++i ) {
+    freeNext[ indices[ i ] ].store( indices[ i + 1 ] + 1, std::memory_order_relaxed );
+  }
+  u32 last = indices[ count - 1 ];
+  u64 head = freeStackHead.load( std::memory_order_relaxed );
+  u64 newHead;
+  do {
+    freeNext[ last ].store( ( u32 )head, std::memory_order_relaxed );
+    newHead = ( ( head >> 32 ) + 1 ) << 32 | ( indices[ 0 ] + 1 );
+  } while ( !freeStackHead.compare_exchange_weak( head, newHead, std::memory_order_release, std::memory_order_relaxed ) );
+  freeStackSize.fetch_add( count, std::memory_order_relaxed );
+}
+
+u32 EntityManager::popFreeIndices( u32 count, u32* result ) {
+  u64 head = freeStackHead.load( std::memory_order_acquire );
+  for ( ;; ) {
+    // walk down count entries, if anyone changes the stack meanwhile the tag
+    // will not match and we start over
+    u32 next = ( u32 )head;
+    u32 popped = 0;
+    while ( next != 0 && popped < count ) {
+      result[ popped++ ] = next - 1;
+      next = freeNext[ next - 1 ].load( std::memory_order_relaxed );
+    }
+    if ( popped == 0 ) {
+      return 0;
+    }
+    u64 newHead = ( ( head >> 32 ) + 1 ) << 32 | next;
+    if ( freeStackHead.compare_exchange_weak( head, newHead, std::memory_order_acquire, std::memory_order_acquire ) ) {
+      freeStackSize.fetch_sub( popped, std::memory_order_relaxed );
+      return popped;
+    }
+  }
+}
+
+EntityHandle EntityManager::createConcurrent() {
+  if ( reservation.reservedCount == 0 ) {
+    // like create(), only reuse indices once enough of them have been freed
+    if ( freeStackSize.load( std::memory_order_relaxed ) >= MIN_FREE_INDICES ) {
+      reservation.reservedCount = popFreeIndices( RESERVATION_SIZE, reservation.reserved );
+    }
+    if ( reservation.reservedCount == 0 ) {
+      u32 first = claimSlots( RESERVATION_SIZE );
+      // hand them out in increasing order
+      for ( u32 i = 0; i < RESERVATION_SIZE; ++i ) {
+        reservation.reserved[ i ] = first + RESERVATION_SIZE - 1 - i;
+      }
+      reservation.reservedCount = RESERVATION_SIZE;
+    }
+  }
+  u32 index = reservation.reserved[ --reservation.reservedCount ];
+  return { index + 1, generations[ index ].load( std::memory_order_relaxed ) }; // we count from 1
+}
+
+void EntityManager::destroyConcurrent( EntityHandle entity ) {
+  VALIDATE_ENTITY( entity );
+  u32 index = entity.index - 1; // we count from 1
+  ASSERT( componentMasks[ index ] == 0, "Entity %d has components, it can't be destroyed concurrently", entity );
+  advanceGeneration( index );
+  reservation.freed[ reservation.freedCount++ ] = index;
+  if ( reservation.freedCount == RESERVATION_SIZE ) {
+    pushFreeIndices( reservation.freed, reservation.freedCount );
+    reservation.freedCount = 0;
+  }
+}
+
+void EntityManager::releaseThreadReservation() {
+  if ( reservation.reservedCount > 0 ) {
+    pushFreeIndices( reservation.reserved, reservation.reservedCount );
+    reservation.reservedCount = 0;
+  }
+  if ( reservation.freedCount > 0 ) {
+    pushFreeIndices( reservation.freed, reservation.freedCount );
+    reservation.freedCount = 0;
   }
-  return { index, generations[ index - 1 ].generation };
 }
 
 bool EntityManager::isAlive( EntityHandle entity ) {
-  return entity.index > 0 && generations[ entity.index - 1 ].generation == entity.generation;
+  return entity.index > 0 && generations[ entity.index - 1 ].load( std::memory_order_relaxed ) == entity.generation;
+}
+
+ComponentMask EntityManager::getComponentMask( EntityHandle entity ) {
+  VALIDATE_ENTITY( entity );
+  return componentMasks[ entity.index - 1 ];
 }
 
 void EntityManager::destroy( EntityHandle entity ) {
   VALIDATE_ENTITY( entity );
+  u32 index = entity.index - 1; // we count from 1
   // remove all of this entity's components
-  auto range = removeComponentCallbacks.equal_range( entity );
-  for ( auto iter = range.first; iter != range.second; ++iter ) {
-    ( iter->second )( entity );
+  ComponentMask mask = componentMasks[ index ];
+  for ( u32 type = 0; mask != 0; ++type, mask >>= 1 ) {
+    if ( mask & 1 ) {
+      ( componentCallbacks[ type ].remove )( entity );
+    }
   }
+  ASSERT( componentMasks[ index ] == 0, "Entity %d still has components", entity );
   // remove the entity
-  u32 index = entity.index - 1; // we count from 1
-  ++generations[ index ].generation;
+  advanceGeneration( index );
   freeIndices.push_back( index );
 }
+
+void EntityManager::destroyBatch( const std::vector< EntityHandle >& entities ) {
+  PROFILE;
+  VALIDATE_ENTITIES( entities );
+  // group the entities by component type, so every ComponentMap compacts its
+  // array only once
+  static std::vector< EntityHandle > removals[ NUM_COMPONENT_TYPES ];
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    removals[ type ].clear();
+  }
+  for ( u32 entInd = 0; entInd < entities.size(); ++entInd ) {
+    EntityHandle entity = entities[ entInd ];
+    ComponentMask mask = componentMasks[ entity.index - 1 ];
+    for ( u32 type = 0; mask != 0; ++type, mask >>= 1 ) {
+      if ( mask & 1 ) {
+        removals[ type ].push_back( entity );
+      }
+    }
+  }
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( !removals[ type ].empty() ) {
+      ( componentCallbacks[ type ].removeBatch )( removals[ type ] );
+    }
+  }
+  // remove the entities
+  for ( u32 entInd = 0; entInd < entities.size(); ++entInd ) {
+    u32 index = entities[ entInd ].index - 1; // we count from 1
+    ASSERT( componentMasks[ index ] == 0, "Entity %d still has components", entities[ entInd ] );
+    advanceGeneration( index );
+    freeIndices.push_back( index );
+  }
+}
+
+void EntityManager::destroyDeferred( EntityHandle entity ) {
+  VALIDATE_ENTITY( entity );
+  deferredDestroys.push_back( entity );
+}
+
+void EntityManager::flushDeferred() {
+  PROFILE;
+  if ( !deferredDestroys.empty() ) {
+    // sorting by index makes the destruction a linear sweep over the
+    // generations and the component maps, and puts duplicates together
+    std::sort( deferredDestroys.begin(), deferredDestroys.end(), []( EntityHandle a, EntityHandle b ) {
+        return a.index < b.index;
+      } );
+    u32 destroyCount = 0;
+    for ( u32 entInd = 0; entInd < deferredDestroys.size(); ++entInd ) {
+      EntityHandle entity = deferredDestroys[ entInd ];
+      bool duplicate = destroyCount > 0 && deferredDestroys[ destroyCount - 1 ] == entity;
+      if ( !duplicate && isAlive( entity ) ) {
+        deferredDestroys[ destroyCount++ ] = entity;
+      }
+    }
+    deferredDestroys.resize( destroyCount );
+    destroyBatch( deferredDestroys );
+    deferredDestroys.clear();
+  }
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( componentCallbacks[ type ].flushDeferred != nullptr ) {
+      ( componentCallbacks[ type ].flushDeferred )();
+    }
+  }
+  // Share the indices freed here past the ones create() waits for, the
+  // oldest first, so createConcurrent() reuses them instead of claiming new
+  // slots forever.
+  u32 shared[ RESERVATION_SIZE ];
+  while ( freeIndices.size() > MIN_FREE_INDICES ) {
+    u32 sharedCount = std::min< u32 >( RESERVATION_SIZE, freeIndices.size() - MIN_FREE_INDICES );
+    std::copy( freeIndices.begin(), freeIndices.begin() + sharedCount, shared );
+    freeIndices.erase( freeIndices.begin(), freeIndices.begin() + sharedCount );
+    pushFreeIndices( shared, sharedCount );
+  }
+}
+
+ViewIndex EntityManager::createView( ComponentMask mask ) {
+  ASSERT( viewCount < MAX_VIEWS, "Tried to create more than %d views", MAX_VIEWS );
+  ViewIndex viewInd = viewCount++;
+  ComponentView& view = views[ viewInd ];
+  view.mask = mask;
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( mask & ( 1 << type ) ) {
+      ASSERT( componentStorages[ type ].map != nullptr, "Component type %d has not been registered", type );
+      viewsByType[ type ] |= 1 << viewInd;
+    }
+  }
+  fillView( view );
+  return viewInd;
+}
+
+void EntityManager::fillView( ComponentView& view ) {
+  for ( u32 index = 0; index < entityCount.load( std::memory_order_relaxed ); ++index ) {
+    if ( ( componentMasks[ index ] & view.mask ) == view.mask ) {
+      addViewRow( view, { index + 1, generations[ index ].load( std::memory_order_relaxed ) } ); // we count from 1
+    }
+  }
+}
+
+const ComponentView& EntityManager::getView( ViewIndex view ) {
+  ASSERT( view < viewCount, "Invalid view %d", view );
+  return views[ view ];
+}
+
+void EntityManager::addViewRow( ComponentView& view, EntityHandle entity ) {
+  view.entities.push_back( entity );
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( view.mask & ( 1 << type ) ) {
+      const ComponentStorage& storage = componentStorages[ type ];
+      view.indices[ type ].push_back( storage.stamp( storage.map, storage.indices->get( entity.index ) ) );
+    }
+  }
+  view.rows.set( entity.index, view.entities.size() );
+}
+
+GroupIndex EntityManager::createOwningGroup( ComponentMask mask ) {
+  ASSERT( groupCount < MAX_GROUPS, "Tried to create more than %d groups", MAX_GROUPS );
+  GroupIndex groupInd = groupCount++;
+  OwningGroup& group = groups[ groupInd ];
+  group = { mask, 0 };
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( mask & ( 1 << type ) ) {
+      ASSERT( componentStorages[ type ].map != nullptr, "Component type %d has not been registered", type );
+      ASSERT( groupsByType[ type ] == 0, "Component type %d is already owned by a group", type );
+      groupsByType[ type ] = groupInd + 1;
+    }
+  }
+  // pack the entities that already have the components
+  for ( u32 index = 0; index < entityCount.load( std::memory_order_relaxed ); ++index ) {
+    if ( ( componentMasks[ index ] & mask ) == mask ) {
+      addToGroup( group, { index + 1, generations[ index ].load( std::memory_order_relaxed ) } ); // we count from 1
+    }
+  }
+  return groupInd;
+}
+
+u32 EntityManager::getGroupSize( GroupIndex group ) {
+  ASSERT( group < groupCount, "Invalid group %d", group );
+  return groups[ group ].size;
+}
+
+u32 EntityManager::getOwnedCount( ComponentType type ) {
+  u32 groupInd = groupsByType[ type ];
+  return groupInd > 0 ? groups[ groupInd - 1 ].size : 0;
+}
+
+// swap the entity's components with the ones right after the end of the group
+void EntityManager::addToGroup( OwningGroup& group, EntityHandle entity ) {
+  ++group.size;
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( group.mask & ( 1 << type ) ) {
+      ComponentStorage storage = componentStorages[ type ];
+      storage.swap( storage.map, storage.indices->get( entity.index ), group.size );
+    }
+  }
+}
+
+// swap the entity's components with the last ones in the group
+void EntityManager::removeFromGroup( OwningGroup& group, EntityHandle entity ) {
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( group.mask & ( 1 << type ) ) {
+      ComponentStorage storage = componentStorages[ type ];
+      storage.swap( storage.map, storage.indices->get( entity.index ), group.size );
+    }
+  }
+  --group.size;
+}
+
+void EntityManager::onComponentAdded( EntityHandle entity, ComponentType type ) {
+  ComponentMask mask = componentMasks[ entity.index - 1 ];
+  // move it into the group first, views must get the final indices
+  if ( groupsByType[ type ] > 0 ) {
+    OwningGroup& group = groups[ groupsByType[ type ] - 1 ];
+    if ( ( mask & group.mask ) == group.mask ) {
+      addToGroup( group, entity );
+    }
+  }
+  for ( u32 viewInds = viewsByType[ type ], viewInd = 0; viewInds != 0; viewInds >>= 1, ++viewInd ) {
+    if ( ( viewInds & 1 ) && ( mask & views[ viewInd ].mask ) == views[ viewInd ].mask ) {
+      addViewRow( views[ viewInd ], entity );
+    }
+  }
+}
+
+void EntityManager::onComponentRemoved( EntityHandle entity, ComponentType type ) {
+  if ( groupsByType[ type ] > 0 ) {
+    OwningGroup& group = groups[ groupsByType[ type ] - 1 ];
+    if ( componentStorages[ type ].indices->get( entity.index ) <= group.size ) {
+      removeFromGroup( group, entity );
+    }
+  }
+  for ( u32 viewInds = viewsByType[ type ], viewInd = 0; viewInds != 0; viewInds >>= 1, ++viewInd ) {
+    if ( !( viewInds & 1 ) ) {
+      continue;
+    }
+    ComponentView& view = views[ viewInd ];
+    u32 row = view.rows.get( entity.index );
+    if ( row == 0 ) {
+      continue;
+    }
+    // swap-remove the row, like ComponentMap does with components
+    u32 rowInd = row - 1, lastRowInd = view.entities.size() - 1;
+    EntityHandle lastEntity = view.entities[ lastRowInd ];
+    view.entities[ rowInd ] = lastEntity;
+    view.entities.pop_back();
+    for ( u32 viewType = 0; viewType < NUM_COMPONENT_TYPES; ++viewType ) {
+      if ( view.mask & ( 1 << viewType ) ) {
+        view.indices[ viewType ][ rowInd ] = view.indices[ viewType ][ lastRowInd ];
+        view.indices[ viewType ].pop_back();
+      }
+    }
+    if ( rowInd != lastRowInd ) {
+      view.rows.set( lastEntity.index, row );
+    }
+    view.rows.set( entity.index, 0 );
+  }
+}
+
+void EntityManager::onComponentMoved( EntityHandle entity, ComponentType type, ComponentIndex compInd ) {
+  for ( u32 viewInds = viewsByType[ type ], viewInd = 0; viewInds != 0; viewInds >>= 1, ++viewInd ) {
+    if ( viewInds & 1 ) {
+      u32 row = views[ viewInd ].rows.get( entity.index );
+      if ( row > 0 ) {
+        views[ viewInd ].indices[ type ][ row - 1 ] = compInd;
+      }
+    }
+  }
+}
+
+PagedIndex::~PagedIndex() {
+  clear();
+}
+
+void PagedIndex::set( u32 index, ComponentIndex compInd ) {
+  ASSERT( index < MAX_ENTITIES, "Entity index %d out of bounds", index );
+  u32 pageInd = index >> PAGE_BITS;
+  if ( pageInd >= pages.size() ) {
+    if ( compInd == 0 ) {
+      return;
+    }
+    pages.resize( pageInd + 1, nullptr );
+    pageCounts.resize( pageInd + 1, 0 );
+    changedPages.resize( pageInd + 1, 0 );
+  }
+  ComponentIndex* page = pages[ pageInd ];
+  if ( page == nullptr ) {
+    if ( compInd == 0 ) {
+      return;
+    }
+    page = new ComponentIndex[ PAGE_SIZE ]();
+    pages[ pageInd ] = page;
+    ++residentPages;
+  }
+  ComponentIndex& slot = page[ index & ( PAGE_SIZE - 1 ) ];
+  if ( slot == 0 && compInd != 0 ) {
+    ++pageCounts[ pageInd ];
+  } else if ( slot != 0 && compInd == 0 ) {
+    --pageCounts[ pageInd ];
+  }
+  slot = compInd;
+  changedPages[ pageInd ] = 1;
+}
+
+void PagedIndex::clear() {
+  for ( u32 pageInd = 0; pageInd < pages.size(); ++pageInd ) {
+    delete[] pages[ pageInd ];
+  }
+  pages.clear();
+  pageCounts.clear();
+  changedPages.clear();
+  residentPages = 0;
+}
+
+void PagedIndex::trim() {
+  for ( u32 pageInd = 0; pageInd < pages.size(); ++pageInd ) {
+    if ( pages[ pageInd ] != nullptr && pageCounts[ pageInd ] == 0 ) {
+      delete[] pages[ pageInd ];
+      pages[ pageInd ] = nullptr;
+      changedPages[ pageInd ] = 1;
+      --residentPages;
+    }
+  }
+}
+
+u64 PagedIndex::getResidentBytes() const {
+  return residentPages * PAGE_SIZE * sizeof( ComponentIndex ) +
+    pages.capacity() * sizeof( ComponentIndex* ) + pageCounts.capacity() * sizeof( u16 );
+}
+
+void PagedIndex::getSections( std::vector< SnapshotSection >* sections ) const {
+  sections->push_back( valueSection( &residentPages, sizeof( u32 ) ) );
+  // two for every page, empty if it isn't resident, so that the sections
+  // after them stay the same ones as pages come and go
+  for ( u32 pageInd = 0; pageInd < pages.size(); ++pageInd ) {
+    if ( pages[ pageInd ] == nullptr ) {
+      sections->push_back( SnapshotSection() );
+      sections->push_back( SnapshotSection() );
+      continue;
+    }
+    // page number and count
+    u8 pageHeader[ sizeof( u32 ) + sizeof( u16 ) ];
+    std::memcpy( pageHeader, &pageInd, sizeof( u32 ) );
+    std::memcpy( pageHeader + sizeof( u32 ), &pageCounts[ pageInd ], sizeof( u16 ) );
+    sections->push_back( valueSection( pageHeader, sizeof( pageHeader ) ) );
+    const u32 pageBytes = PAGE_SIZE * sizeof( ComponentIndex );
+    sections->push_back( { reinterpret_cast< const u8* >( pages[ pageInd ] ), pageBytes, &changedPages[ pageInd ], 1,
+                           pageBytes, {} } );
+  }
+}
+
+void PagedIndex::clearChanges() {
+  std::fill( changedPages.begin(), changedPages.end(), 0 );
+}
+
+const u8* PagedIndex::check( const u8* data, const u8* end, u32 limit ) {
+  const u32 MAX_PAGES = MAX_ENTITIES >> PAGE_BITS;
+  u32 pageCount = 0;
+  data = readSnapshot( data, end, &pageCount, 1 );
+  if ( data == nullptr || pageCount > MAX_PAGES ) {
+    return nullptr;
+  }
+  // each page at most once, or load() would lose one
+  static std::vector< bool > seen;
+  seen.assign( MAX_PAGES, false );
+  static ComponentIndex page[ PAGE_SIZE ];
+  for ( u32 i = 0; i < pageCount; ++i ) {
+    u32 pageInd = 0;
+    u16 count = 0;
+    data = readSnapshot( data, end, &pageInd, 1 );
+    data = readSnapshot( data, end, &count, 1 );
+    data = readSnapshot( data, end, page, PAGE_SIZE );
+    if ( data == nullptr || pageInd >= MAX_PAGES || seen[ pageInd ] ) {
+      return nullptr;
+    }
+    seen[ pageInd ] = true;
+    // set() keeps the counts, they must be right
+    u32 nonZero = 0;
+    for ( u32 slot = 0; slot < PAGE_SIZE; ++slot ) {
+      if ( page[ slot ] >= limit ) {
+        return nullptr;
+      }
+      nonZero += page[ slot ] != 0;
+    }
+    if ( nonZero != count ) {
+      return nullptr;
+    }
+  }
+  return data;
+}
+
+const u8* PagedIndex::load( const u8* data, const u8* end ) {
+  clear();
+  u32 pageCount = 0;
+  data = readSnapshot( data, end, &pageCount, 1 );
+  for ( u32 i = 0; i < pageCount; ++i ) {
+    u32 pageInd = 0;
+    data = readSnapshot( data, end, &pageInd, 1 );
+    if ( pageInd >= pages.size() ) {
+      pages.resize( pageInd + 1, nullptr );
+      pageCounts.resize( pageInd + 1, 0 );
+      changedPages.resize( pageInd + 1, 0 );
+    }
+    changedPages[ pageInd ] = 1;
+    data = readSnapshot( data, end, &pageCounts[ pageInd ], 1 );
+    pages[ pageInd ] = new ComponentIndex[ PAGE_SIZE ];
+    data = readSnapshot( data, end, pages[ pageInd ], PAGE_SIZE );
+  }
+  residentPages = pageCount;
+  return data;
+}
+
+void EntityManager::initializeDefragmentation( Defragmentation* defrag, ComponentType type, SortKeysCallback getKeys ) {
+  ASSERT( componentStorages[ type ].map != nullptr, "Component type %d has not been registered", type );
+  defrag->type = type;
+  defrag->getKeys = getKeys;
+  defrag->phase = Defragmentation::IDLE;
+}
+
+bool EntityManager::defragment( Defragmentation& defrag, u32 budget ) {
+  PROFILE;
+  ASSERT( budget > 0, "Defragmentation can't progress without budget" );
+  switch ( defrag.phase ) {
+  case Defragmentation::IDLE:
+    defrag.entries.clear();
+    defrag.cursor = 0;
+    defrag.phase = Defragmentation::KEYS;
+    // fall through
+  case Defragmentation::KEYS: {
+    defrag.entries.resize( defrag.cursor + budget );
+    // we count from 1
+    u32 read = defrag.getKeys( defrag.cursor + 1, budget, &defrag.entries[ defrag.cursor ] );
+    defrag.cursor += read;
+    defrag.entries.resize( defrag.cursor );
+    if ( read == budget ) {
+      return false;
+    }
+    defrag.merged.resize( defrag.entries.size() );
+    defrag.width = 1;
+    defrag.cursor = defrag.left = defrag.leftEnd = defrag.right = defrag.rightEnd = 0;
+    defrag.phase = Defragmentation::SORT;
+    return false;
+  }
+  case Defragmentation::SORT: {
+    std::vector< SortEntry >& entries = defrag.entries;
+    u32 count = entries.size();
+    for ( ; budget > 0 && defrag.width < count; --budget ) {
+      if ( defrag.cursor == count ) {
+        // every pair of runs has been merged, go on with runs twice as long
+        entries.swap( defrag.merged );
+        defrag.width *= 2;
+        defrag.cursor = defrag.left = defrag.leftEnd = defrag.right = defrag.rightEnd = 0;
+        continue;
+      }
+      if ( defrag.left == defrag.leftEnd && defrag.right == defrag.rightEnd ) {
+        // start merging the next pair of runs
+        defrag.left = defrag.cursor;
+        defrag.leftEnd = defrag.right = std::min( defrag.cursor + defrag.width, count );
+        defrag.rightEnd = std::min( defrag.cursor + 2 * defrag.width, count );
+      }
+      bool takeLeft = defrag.right == defrag.rightEnd ||
+        ( defrag.left < defrag.leftEnd && entries[ defrag.left ].key <= entries[ defrag.right ].key );
+      defrag.merged[ defrag.cursor++ ] = takeLeft ? entries[ defrag.left++ ] : entries[ defrag.right++ ];
+    }
+    if ( defrag.width >= count ) {
+      defrag.cursor = 0;
+      defrag.nextTarget = 1;
+      defrag.phase = Defragmentation::APPLY;
+    }
+    return false;
+  }
+  case Defragmentation::APPLY: {
+    const ComponentStorage& storage = componentStorages[ defrag.type ];
+    u32 groupInd = groupsByType[ defrag.type ];
+    for ( ; budget > 0 && defrag.cursor < defrag.entries.size(); --budget ) {
+      EntityHandle entity = defrag.entries[ defrag.cursor++ ].entity;
+      ComponentIndex current = storage.indices->get( entity.index );
+      u32 groupSize = groupInd > 0 ? groups[ groupInd - 1 ].size : 0;
+      if ( !isAlive( entity ) || current <= groupSize ) {
+        // gone since its key was read, or owned by a group
+        continue;
+      }
+      ComponentIndex target = std::max( defrag.nextTarget, groupSize + 1 );
+      // anything before target is already in place
+      if ( target <= current ) {
+        storage.swap( storage.map, target, current );
+        defrag.nextTarget = target + 1;
+      }
+    }
+    if ( defrag.cursor < defrag.entries.size() ) {
+      return false;
+    }
+    defrag.phase = Defragmentation::IDLE;
+    return true;
+  }
+  }
+  return false;
+}
+
+void EntityManager::trimIndices() {
+  PROFILE;
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( componentStorages[ type ].map != nullptr ) {
+      componentStorages[ type ].indices->trim();
+    }
+  }
+  for ( u32 viewInd = 0; viewInd < viewCount; ++viewInd ) {
+    views[ viewInd ].rows.trim();
+  }
+}
+
+// Snapshot layout, all little endian u32 unless noted:
+//   SnapshotHeader
+//   generations[ entityCount ], componentMasks[ entityCount ], freeIndices[ freeIndexCount ]
+//   the groups[ groupCount ]
+//   for every registered type, in order, the sections written by its ComponentMap
+//   for every view, its mask, row count, entities, raw indices and rows index
+struct SnapshotHeader {
+  u32 magic;
+  u32 version;
+  u32 entityCount;
+  u32 freeIndexCount;
+  u32 typeMask; // registered component types
+  u32 groupCount;
+  u32 viewCount;
+};
+
+const u32 SNAPSHOT_MAGIC = 0x50414e53; // "SNAP"
+// bump whenever the layout of the snapshot or of any component changes
+const u32 SNAPSHOT_VERSION = 7;
+
+static const u8* getSectionData( const SnapshotSection& section ) {
+  return section.data != nullptr ? section.data : section.value;
+}
+
+static void writeSections( FILE* file, const std::vector< SnapshotSection >& sections ) {
+  for ( const SnapshotSection& section : sections ) {
+    fwrite( getSectionData( section ), 1, section.bytes, file );
+  }
+}
+
+static void saveView( const ComponentView& view, FILE* file ) {
+  u32 rowCount = view.entities.size();
+  writeSnapshot( file, &view.mask, 1 );
+  writeSnapshot( file, &rowCount, 1 );
+  writeSnapshot( file, view.entities.data(), rowCount );
+  static std::vector< ComponentIndex > rawIndices;
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( view.mask & ( 1 << type ) ) {
+      // stamps don't survive the load
+      rawIndices.resize( rowCount );
+      for ( u32 row = 0; row < rowCount; ++row ) {
+        rawIndices[ row ] = view.indices[ type ][ row ] & COMPONENT_INDEX_MASK;
+      }
+      writeSnapshot( file, rawIndices.data(), rowCount );
+    }
+  }
+  static std::vector< SnapshotSection > sections;
+  sections.clear();
+  view.rows.getSections( &sections );
+  writeSections( file, sections );
+}
+
+// what the sections of the entities point to
+static SnapshotHeader sectionHeader;
+static std::vector< u32 > sectionGenerations; // copied out of the atomics as they change
+static std::vector< u8 > sectionEntityChanges;
+static std::vector< u32 > sectionFree;
+
+void EntityManager::getWorldSections( std::vector< SnapshotSection >* sections, u32 savedViews ) {
+  ASSERT( deferredDestroys.empty(), "Deferred destructions pending" );
+  // indices freed concurrently, and the ones this thread holds, are saved as
+  // free indices like the rest, the load empties the stack and reservation
+  sectionFree.assign( freeIndices.begin(), freeIndices.end() );
+  for ( u32 next = ( u32 )freeStackHead.load(); next != 0; next = freeNext[ next - 1 ].load() ) {
+    sectionFree.push_back( next - 1 );
+  }
+  sectionFree.insert( sectionFree.end(), reservation.reserved, reservation.reserved + reservation.reservedCount );
+  sectionFree.insert( sectionFree.end(), reservation.freed, reservation.freed + reservation.freedCount );
+  u32 count = entityCount.load();
+  sectionHeader = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, count, ( u32 )sectionFree.size(), getTypeMask(), groupCount, savedViews };
+  sections->push_back( comparedSection( &sectionHeader, sizeof( SnapshotHeader ) ) );
+  u32 chunkCount = ( count + ENTITY_CHUNK_LENGTH - 1 ) / ENTITY_CHUNK_LENGTH;
+  sectionEntityChanges.resize( chunkCount );
+  u32 copied = std::min( count, ( u32 )sectionGenerations.size() );
+  sectionGenerations.resize( count );
+  for ( u32 chunk = 0; chunk < chunkCount; ++chunk ) {
+    sectionEntityChanges[ chunk ] = entityChanges[ chunk ].load( std::memory_order_relaxed );
+    u32 first = chunk * ENTITY_CHUNK_LENGTH;
+    u32 last = std::min( first + ENTITY_CHUNK_LENGTH, count );
+    if ( sectionEntityChanges[ chunk ] || last > copied ) {
+      for ( u32 index = first; index < last; ++index ) {
+        sectionGenerations[ index ] = generations[ index ].load( std::memory_order_relaxed );
+      }
+    }
+  }
+  sections->push_back( { reinterpret_cast< const u8* >( sectionGenerations.data() ), count * ( u32 )sizeof( u32 ),
+                         sectionEntityChanges.data(), chunkCount, ENTITY_CHUNK_LENGTH * ( u32 )sizeof( u32 ), {} } );
+  sections->push_back( { reinterpret_cast< const u8* >( componentMasks ), count * ( u32 )sizeof( ComponentMask ),
+                         sectionEntityChanges.data(), chunkCount, ENTITY_CHUNK_LENGTH * ( u32 )sizeof( ComponentMask ), {} } );
+  sections->push_back( comparedSection( sectionFree.data(), sectionFree.size() * sizeof( u32 ) ) );
+  sections->push_back( comparedSection( groups, groupCount * sizeof( OwningGroup ) ) );
+  ComponentMask typeMask = sectionHeader.typeMask;
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( typeMask & ( 1 << type ) ) {
+      componentStorages[ type ].getSections( componentStorages[ type ].map, sections );
+    }
+  }
+}
+
+void EntityManager::writeWorld( FILE* file ) {
+  static std::vector< SnapshotSection > sections;
+  sections.clear();
+  getWorldSections( &sections, viewCount );
+  writeSections( file, sections );
+  for ( u32 viewInd = 0; viewInd < viewCount; ++viewInd ) {
+    saveView( views[ viewInd ], file );
+  }
+}
+
+ComponentMask EntityManager::getTypeMask() {
+  ComponentMask typeMask = 0;
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( componentStorages[ type ].map != nullptr ) {
+      typeMask |= 1 << type;
+    }
+  }
+  return typeMask;
+}
+
+const u8* EntityManager::checkWorld( const u8* data, const u8* end ) {
+  SnapshotHeader header;
+  data = readSnapshot( data, end, &header, 1 );
+  // no more entities than claimSlots() allows
+  if ( data == nullptr || header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+       header.typeMask != getTypeMask() || header.entityCount >= MAX_ENTITIES ||
+       header.freeIndexCount > header.entityCount || header.groupCount > MAX_GROUPS ) {
+    return nullptr;
+  }
+  // entities, any generation will do
+  data = skipSnapshot< u32 >( data, end, header.entityCount );
+  const u8* masks = data;
+  data = skipSnapshot< ComponentMask >( data, end, header.entityCount );
+  const u8* free = data;
+  data = skipSnapshot< u32 >( data, end, header.freeIndexCount );
+  OwningGroup savedGroups[ MAX_GROUPS ];
+  data = readSnapshot( data, end, savedGroups, header.groupCount );
+  if ( data == nullptr ) {
+    return nullptr;
+  }
+  for ( u32 index = 0; index < header.entityCount; ++index ) {
+    ComponentMask mask;
+    std::memcpy( &mask, masks + index * sizeof( ComponentMask ), sizeof( ComponentMask ) );
+    if ( ( mask & ~header.typeMask ) != 0 ) {
+      return nullptr;
+    }
+  }
+  for ( u32 i = 0; i < header.freeIndexCount; ++i ) {
+    u32 index;
+    std::memcpy( &index, free + i * sizeof( u32 ), sizeof( u32 ) );
+    if ( index >= header.entityCount ) {
+      return nullptr;
+    }
+  }
+  // components
+  u32 componentCounts[ NUM_COMPONENT_TYPES ] = {};
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( header.typeMask & ( 1 << type ) ) {
+      data = componentStorages[ type ].check( data, end, header.entityCount, &componentCounts[ type ] );
+      if ( data == nullptr ) {
+        return nullptr;
+      }
+    }
+  }
+  for ( u32 groupInd = 0; groupInd < header.groupCount; ++groupInd ) {
+    const OwningGroup& group = savedGroups[ groupInd ];
+    if ( ( group.mask & ~header.typeMask ) != 0 ) {
+      return nullptr;
+    }
+    for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+      if ( ( group.mask & ( 1 << type ) ) && group.size >= componentCounts[ type ] ) {
+        return nullptr;
+      }
+    }
+  }
+  // views, each with rows of entities and of their raw indices
+  for ( u32 viewInd = 0; viewInd < header.viewCount; ++viewInd ) {
+    ComponentMask mask = 0;
+    u32 rowCount = 0;
+    data = readSnapshot( data, end, &mask, 1 );
+    data = readSnapshot( data, end, &rowCount, 1 );
+    if ( data == nullptr || ( mask & ~header.typeMask ) != 0 || rowCount > header.entityCount ) {
+      return nullptr;
+    }
+    const u8* entities = data;
+    data = skipSnapshot< EntityHandle >( data, end, rowCount );
+    if ( data == nullptr ) {
+      return nullptr;
+    }
+    for ( u32 row = 0; row < rowCount; ++row ) {
+      EntityHandle entity;
+      std::memcpy( &entity, entities + row * sizeof( EntityHandle ), sizeof( EntityHandle ) );
+      // we count from 1
+      if ( entity.index == 0 || entity.index > header.entityCount ) {
+        return nullptr;
+      }
+    }
+    for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+      if ( mask & ( 1 << type ) ) {
+        const u8* indices = data;
+        data = skipSnapshot< ComponentIndex >( data, end, rowCount );
+        if ( data == nullptr ) {
+          return nullptr;
+        }
+        for ( u32 row = 0; row < rowCount; ++row ) {
+          ComponentIndex compInd;
+          std::memcpy( &compInd, indices + row * sizeof( ComponentIndex ), sizeof( ComponentIndex ) );
+          if ( compInd == 0 || compInd >= componentCounts[ type ] ) {
+            return nullptr;
+          }
+        }
+      }
+    }
+    // row + 1 of each entity
+    data = PagedIndex::check( data, end, rowCount + 1 );
+    if ( data == nullptr ) {
+      return nullptr;
+    }
+  }
+  return data;
+}
+
+bool EntityManager::readWorld( const u8* data, const u8* end ) {
+  // nothing is touched until all of it is known to be readable
+  if ( checkWorld( data, end ) != end ) {
+    return false;
+  }
+  SnapshotHeader header;
+  data = readSnapshot( data, end, &header, 1 );
+  ComponentMask typeMask = header.typeMask;
+  // entities
+  static std::vector< u32 > savedGenerations;
+  savedGenerations.resize( header.entityCount );
+  data = readSnapshot( data, end, savedGenerations.data(), header.entityCount );
+  for ( u32 index = 0; index < header.entityCount; ++index ) {
+    generations[ index ].store( savedGenerations[ index ], std::memory_order_relaxed );
+  }
+  data = readSnapshot( data, end, componentMasks, header.entityCount );
+  u32 previousCount = entityCount.load();
+  if ( previousCount > header.entityCount ) {
+    // slots past the saved ones were never used in the saved world
+    for ( u32 index = header.entityCount; index < previousCount; ++index ) {
+      generations[ index ].store( 0, std::memory_order_relaxed );
+    }
+    std::memset( componentMasks + header.entityCount, 0, ( previousCount - header.entityCount ) * sizeof( ComponentMask ) );
+  }
+  entityCount.store( header.entityCount );
+  std::vector< u32 > free( header.freeIndexCount );
+  data = readSnapshot( data, end, free.data(), header.freeIndexCount );
+  freeIndices.assign( free.begin(), free.end() );
+  freeStackHead.store( 0 );
+  freeStackSize.store( 0 );
+  reservation.reservedCount = reservation.freedCount = 0;
+  deferredDestroys.clear();
+  OwningGroup savedGroups[ MAX_GROUPS ];
+  data = readSnapshot( data, end, savedGroups, header.groupCount );
+  // components
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( typeMask & ( 1 << type ) ) {
+      data = componentStorages[ type ].load( componentStorages[ type ].map, data, end );
+    }
+  }
+  // views are loaded as they were saved, as long as they are the same ones
+  for ( u32 viewInd = 0; viewInd < header.viewCount; ++viewInd ) {
+    ComponentMask mask = 0;
+    u32 rowCount = 0;
+    data = readSnapshot( data, end, &mask, 1 );
+    data = readSnapshot( data, end, &rowCount, 1 );
+    if ( viewInd >= viewCount || views[ viewInd ].mask != mask ) {
+      // skip it
+      data = skipSnapshot< EntityHandle >( data, end, rowCount );
+      for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+        if ( mask & ( 1 << type ) ) {
+          data = skipSnapshot< ComponentIndex >( data, end, rowCount );
+        }
+      }
+      data = PagedIndex::check( data, end, rowCount + 1 );
+      continue;
+    }
+    ComponentView& view = views[ viewInd ];
+    view.entities.resize( rowCount );
+    data = readSnapshot( data, end, view.entities.data(), rowCount );
+    for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+      if ( mask & ( 1 << type ) ) {
+        view.indices[ type ].resize( rowCount );
+        data = readSnapshot( data, end, view.indices[ type ].data(), rowCount );
+#ifndef NDEBUG
+        const ComponentStorage& storage = componentStorages[ type ];
+        for ( u32 row = 0; row < rowCount; ++row ) {
+          view.indices[ type ][ row ] = storage.stamp( storage.map, view.indices[ type ][ row ] );
+        }
+#endif
+      }
+    }
+    data = view.rows.load( data, end );
+  }
+  // views created since the snapshot was saved are rebuilt
+  for ( u32 viewInd = header.viewCount; viewInd < viewCount; ++viewInd ) {
+    ComponentView& view = views[ viewInd ];
+    view.entities.clear();
+    for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+      view.indices[ type ].clear();
+    }
+    view.rows.clear();
+    fillView( view );
+  }
+  // the components are already packed if the groups were the same when saved
+  for ( u32 groupInd = 0; groupInd < groupCount; ++groupInd ) {
+    OwningGroup& group = groups[ groupInd ];
+    if ( groupInd < header.groupCount && savedGroups[ groupInd ].mask == group.mask ) {
+      group.size = savedGroups[ groupInd ].size;
+      continue;
+    }
+    group.size = 0;
+    for ( u32 index = 0; index < header.entityCount; ++index ) {
+      if ( ( componentMasks[ index ] & group.mask ) == group.mask ) {
+        addToGroup( group, { index + 1, generations[ index ].load( std::memory_order_relaxed ) } ); // we count from 1
+      }
+    }
+  }
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( componentCallbacks[ type ].loaded != nullptr ) {
+      ( componentCallbacks[ type ].loaded )();
+    }
+  }
+  // every generation is copied out again, and the next frame captured is a keyframe
+  sectionGenerations.clear();
+  capturedBytes.clear();
+  return true;
+}
+
+bool EntityManager::saveSnapshot( const char* path ) {
+  PROFILE;
+  FILE* file = fopen( path, "wb" );
+  if ( file == nullptr ) {
+    Debug::write( "Can't open snapshot file %s for writing\n", path );
+    return false;
+  }
+  writeWorld( file );
+  bool written = !ferror( file );
+  fclose( file );
+  if ( !written ) {
+    Debug::write( "Error writing snapshot file %s\n", path );
+  }
+  return written;
+}
+
+bool EntityManager::loadSnapshot( const char* path ) {
+  PROFILE;
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) {
+    return false;
+  }
+  struct stat fileStat;
+  void* mapped = nullptr;
+  if ( fstat( fd, &fileStat ) == 0 && fileStat.st_size >= ( off_t )sizeof( SnapshotHeader ) ) {
+    // fault every page in at once instead of one by one while copying
+    mapped = mmap( nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0 );
+  }
+  close( fd );
+  if ( mapped == nullptr || mapped == MAP_FAILED ) {
+    Debug::write( "Can't map snapshot file %s\n", path );
+    return false;
+  }
+  const u8* data = static_cast< const u8* >( mapped );
+  bool loaded = readWorld( data, data + fileStat.st_size );
+  if ( !loaded ) {
+    Debug::write( "Snapshot file %s is damaged or from another version\n", path );
+  }
+  munmap( mapped, fileStat.st_size );
+  return loaded;
+}
+
+void EntityManager::initializeHistory( u32 frameCount, u32 byteCapacity ) {
+  ASSERT( historyBytes == nullptr, "History initialized twice" );
+  // the oldest keyframe kept is at most an interval before the frames wanted
+  historyLength = frameCount + KEYFRAME_INTERVAL;
+  historyFrames = new HistoryFrame[ historyLength ];
+  historyBytes = new u8[ byteCapacity ];
+  historyCapacity = byteCapacity;
+  historyWorld = new u8[ byteCapacity ];
+  // commit the pages now rather than in the first frames captured
+  std::memset( historyBytes, 0, byteCapacity );
+  std::memset( historyWorld, 0, byteCapacity );
+}
+
+u32 EntityManager::allocateHistory( u32 bytes ) {
+  ASSERT( bytes <= historyCapacity, "Frame of %d bytes in a history of %d", bytes, historyCapacity );
+  u32 offset = historyWriteOffset;
+  if ( offset + bytes > historyCapacity ) {
+    // the frames past the write offset are the oldest ones
+    while ( oldestFrame < nextFrame && historyFrames[ oldestFrame % historyLength ].offset >= offset ) {
+      ++oldestFrame;
+    }
+    offset = 0;
+  }
+  while ( oldestFrame < nextFrame ) {
+    const HistoryFrame& oldest = historyFrames[ oldestFrame % historyLength ];
+    bool overlaps = oldest.offset < offset + bytes && oldest.offset + oldest.bytes > offset;
+    if ( !overlaps && nextFrame - oldestFrame < historyLength ) {
+      break;
+    }
+    ++oldestFrame;
+  }
+  return offset;
+}
+
+void EntityManager::findChangedRanges( const std::vector< SnapshotSection >& sections ) {
+  changedRanges.clear();
+  auto addRange = []( u32 sectionInd, u32 offset, u32 bytes ) {
+    if ( !changedRanges.empty() && changedRanges.back().section == sectionInd &&
+         changedRanges.back().offset + changedRanges.back().bytes == offset ) {
+      changedRanges.back().bytes += bytes;
+    } else {
+      changedRanges.push_back( { sectionInd, offset, bytes } );
+    }
+  };
+  for ( u32 sectionInd = 0; sectionInd < sections.size(); ++sectionInd ) {
+    const SnapshotSection& section = sections[ sectionInd ];
+    // the bytes past the end of the section in the frame before are all new
+    u32 kept = std::min( section.bytes, capturedBytes[ sectionInd ] );
+    if ( section.changed != nullptr ) {
+      u32 chunkCount = std::min( section.changedCount, ( kept + section.chunkBytes - 1 ) / section.chunkBytes );
+      for ( u32 chunk = 0; chunk < chunkCount; ++chunk ) {
+        if ( section.changed[ chunk ] ) {
+          u32 offset = chunk * section.chunkBytes;
+          addRange( sectionInd, offset, std::min( offset + section.chunkBytes, kept ) - offset );
+        }
+      }
+    } else {
+      const u8* data = getSectionData( section );
+      const u8* captured = capturedSections[ sectionInd ].data();
+      for ( u32 offset = 0; offset < kept; offset += HISTORY_CHUNK_SIZE ) {
+        u32 bytes = std::min( HISTORY_CHUNK_SIZE, kept - offset );
+        if ( std::memcmp( data + offset, captured + offset, bytes ) != 0 ) {
+          addRange( sectionInd, offset, bytes );
+        }
+      }
+    }
+    if ( section.bytes > kept ) {
+      addRange( sectionInd, kept, section.bytes - kept );
+    }
+  }
+}
+
+// the section count, then the size of each, returns where they end
+static u8* writeSectionSizes( u8* data, const std::vector< SnapshotSection >& sections ) {
+  u32 sectionCount = sections.size();
+  std::memcpy( data, &sectionCount, sizeof( u32 ) );
+  data += sizeof( u32 );
+  for ( const SnapshotSection& section : sections ) {
+    std::memcpy( data, &section.bytes, sizeof( u32 ) );
+    data += sizeof( u32 );
+  }
+  return data;
+}
+
+u32 EntityManager::captureFrame() {
+  PROFILE;
+  ASSERT( historyBytes != nullptr, "History not initialized" );
+  static std::vector< SnapshotSection > sections;
+  sections.clear();
+  // views are rebuilt on restore instead, it is rarer than capturing
+  getWorldSections( &sections, 0 );
+  u32 worldBytes = 0;
+  for ( const SnapshotSection& section : sections ) {
+    worldBytes += section.bytes;
+  }
+  u32 keyframeBytes = ( 1 + sections.size() ) * sizeof( u32 ) + worldBytes;
+  if ( keyframeBytes > historyCapacity ) {
+    // a world that doesn't fit can't be restored, keep the frames there are
+    Debug::write( "World bigger than the history capacity %d, frame %d not captured\n", historyCapacity, nextFrame );
+    return NO_FRAME;
+  }
+  HistoryFrame& frame = historyFrames[ nextFrame % historyLength ];
+  // every frame from the keyframe on is needed to restore this one
+  u32 keyframe = nextFrame > 0 ? historyFrames[ ( nextFrame - 1 ) % historyLength ].keyframe : 0;
+  bool isKeyframe = nextFrame == 0 || keyframe < oldestFrame || nextFrame - keyframe >= KEYFRAME_INTERVAL ||
+    sections.size() != capturedBytes.size();
+  if ( !isKeyframe ) {
+    findChangedRanges( sections );
+    // section sizes, range count, the ranges, then their bytes
+    u32 bytes = ( 2 + sections.size() ) * sizeof( u32 ) + changedRanges.size() * sizeof( HistoryRange );
+    for ( const HistoryRange& range : changedRanges ) {
+      bytes += range.bytes;
+    }
+    u32 offset = allocateHistory( bytes );
+    // making room may have dropped the keyframe
+    isKeyframe = keyframe < oldestFrame;
+    if ( !isKeyframe ) {
+      u8* data = writeSectionSizes( historyBytes + offset, sections );
+      u32 rangeCount = changedRanges.size();
+      std::memcpy( data, &rangeCount, sizeof( u32 ) );
+      std::memcpy( data + sizeof( u32 ), changedRanges.data(), rangeCount * sizeof( HistoryRange ) );
+      data += sizeof( u32 ) + rangeCount * sizeof( HistoryRange );
+      for ( const HistoryRange& range : changedRanges ) {
+        std::memcpy( data, getSectionData( sections[ range.section ] ) + range.offset, range.bytes );
+        data += range.bytes;
+      }
+      frame = { offset, bytes, worldBytes, keyframe };
+    }
+  }
+  if ( isKeyframe ) {
+    // section sizes, then the sections, the world as readWorld() reads it
+    u32 offset = allocateHistory( keyframeBytes );
+    u8* data = writeSectionSizes( historyBytes + offset, sections );
+    for ( const SnapshotSection& section : sections ) {
+      std::memcpy( data, getSectionData( section ), section.bytes );
+      data += section.bytes;
+    }
+    frame = { offset, keyframeBytes, worldBytes, nextFrame };
+  }
+  // what the next frame is compared with
+  capturedBytes.resize( sections.size() );
+  capturedSections.resize( sections.size() );
+  for ( u32 sectionInd = 0; sectionInd < sections.size(); ++sectionInd ) {
+    const SnapshotSection& section = sections[ sectionInd ];
+    capturedBytes[ sectionInd ] = section.bytes;
+    if ( section.changed == nullptr && isKeyframe ) {
+      const u8* data = getSectionData( section );
+      capturedSections[ sectionInd ].assign( data, data + section.bytes );
+    } else if ( section.changed == nullptr ) {
+      capturedSections[ sectionInd ].resize( section.bytes );
+    }
+  }
+  if ( !isKeyframe ) {
+    for ( const HistoryRange& range : changedRanges ) {
+      const SnapshotSection& section = sections[ range.section ];
+      if ( section.changed == nullptr ) {
+        std::memcpy( capturedSections[ range.section ].data() + range.offset, getSectionData( section ) + range.offset,
+                     range.bytes );
+      }
+    }
+  }
+  for ( u32 chunk = 0; chunk < sectionEntityChanges.size(); ++chunk ) {
+    entityChanges[ chunk ].store( 0, std::memory_order_relaxed );
+  }
+  for ( u32 type = 0; type < NUM_COMPONENT_TYPES; ++type ) {
+    if ( componentStorages[ type ].map != nullptr ) {
+      componentStorages[ type ].clearChanges( componentStorages[ type ].map );
+    }
+  }
+  historyWriteOffset = frame.offset + frame.bytes;
+  return nextFrame++;
+}
+
+bool EntityManager::restore( u32 frameNumber ) {
+  PROFILE;
+  if ( frameNumber < oldestFrame || frameNumber >= nextFrame ) {
+    return false;
+  }
+  const HistoryFrame& frame = historyFrames[ frameNumber % historyLength ];
+  if ( frame.keyframe < oldestFrame ) {
+    return false;
+  }
+  // the keyframe, then the changes of every frame after it up to this one
+  static std::vector< std::vector< u8 > > restoredSections;
+  for ( u32 applied = frame.keyframe; applied <= frameNumber; ++applied ) {
+    const u8* data = historyBytes + historyFrames[ applied % historyLength ].offset;
+    u32 sectionCount;
+    std::memcpy( &sectionCount, data, sizeof( u32 ) );
+    const u8* sizes = data + sizeof( u32 );
+    data = sizes + sectionCount * sizeof( u32 );
+    restoredSections.resize( sectionCount );
+    for ( u32 sectionInd = 0; sectionInd < sectionCount; ++sectionInd ) {
+      u32 bytes;
+      std::memcpy( &bytes, sizes + sectionInd * sizeof( u32 ), sizeof( u32 ) );
+      if ( applied == frame.keyframe ) {
+        restoredSections[ sectionInd ].assign( data, data + bytes );
+        data += bytes;
+      } else {
+        restoredSections[ sectionInd ].resize( bytes );
+      }
+    }
+    if ( applied == frame.keyframe ) {
+      continue;
+    }
+    u32 rangeCount;
+    std::memcpy( &rangeCount, data, sizeof( u32 ) );
+    const u8* ranges = data + sizeof( u32 );
+    data = ranges + rangeCount * sizeof( HistoryRange );
+    for ( u32 rangeInd = 0; rangeInd < rangeCount; ++rangeInd ) {
+      HistoryRange range;
+      std::memcpy( &range, ranges + rangeInd * sizeof( HistoryRange ), sizeof( HistoryRange ) );
+      std::memcpy( restoredSections[ range.section ].data() + range.offset, data, range.bytes );
+      data += range.bytes;
+    }
+  }
+  u32 worldBytes = 0;
+  for ( const std::vector< u8 >& section : restoredSections ) {
+    if ( !section.empty() ) {
+      std::memcpy( historyWorld + worldBytes, section.data(), section.size() );
+      worldBytes += section.size();
+    }
+  }
+  ASSERT( worldBytes == frame.worldBytes, "Frame %d restored with %d bytes instead of %d", frameNumber, worldBytes,
+          frame.worldBytes );
+  if ( !readWorld( historyWorld, historyWorld + worldBytes ) ) {
+    Debug::write( "Frame %d can't be restored, its world doesn't read back\n", frameNumber );
+    return false;
+  }
+  // the frames after it won't happen now
+  nextFrame = frameNumber + 1;
+  historyWriteOffset = frame.offset + frame.bytes;
+  return true;
+}
+
+u32 EntityManager::getOldestFrame() {
+  // the frames whose keyframe was dropped can't be restored either
+  u32 frame = oldestFrame;
+  while ( frame < nextFrame && historyFrames[ frame % historyLength ].keyframe < oldestFrame ) {
+    ++frame;
+  }
+  return frame;
+}
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <deque>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
 
 // based on http://bitsquid.blogspot.com.co/2014/08/building-data-oriented-entity-system.html and http://gamesfromwithin.com/managing-data-relationships
 
@@ -16,25 +21,409 @@ struct EntityHandle {
   operator u32() const;
 }; 
 
+// A ComponentIndex is the position of a component in its ComponentMap. Debug
+// builds stamp its high bits with the generation of that slot, which changes
+// every time another component is put in it, so that an index kept across
+// changes to the array is caught on its next use instead of silently reading
+// the wrong component. Release builds leave them at 0 and use the raw index.
+const u32 COMPONENT_INDEX_BITS = HANDLE_INDEX_BITS;
+const u32 COMPONENT_INDEX_MASK = ( 1 << COMPONENT_INDEX_BITS ) - 1;
+
+// The history copies the world in chunks of about this many bytes
+const u32 HISTORY_CHUNK_SIZE = 256;
+
+// A run of the snapshot layout and where it is in memory. writeWorld() writes
+// them one after the other, captureFrame() only copies the chunks of each one
+// that changed since the frame before: changed has a flag for each chunk of
+// chunkBytes, or is nullptr if the run is compared with that frame instead.
+// Runs of a few bytes are kept in value, with data nullptr.
+struct SnapshotSection {
+  const u8* data;
+  u32 bytes;
+  const u8* changed;
+  u32 changedCount;
+  u32 chunkBytes;
+  u8 value[ 8 ];
+};
+
+// a run captureFrame() compares with the frame before
+inline SnapshotSection comparedSection( const void* data, u32 bytes ) {
+  return { static_cast< const u8* >( data ), bytes, nullptr, 0, 0, {} };
+}
+
+inline SnapshotSection valueSection( const void* value, u32 bytes ) {
+  SnapshotSection section = { nullptr, bytes, nullptr, 0, 0, {} };
+  ASSERT( bytes <= sizeof( section.value ), "Section value of %d bytes", bytes );
+  std::memcpy( section.value, value, bytes );
+  return section;
+}
+
+// One flag for each chunk of about HISTORY_CHUNK_SIZE bytes of an array of T,
+// set when anything in it changes, cleared once captureFrame() copied it
+template< typename T >
+struct ChangedChunks {
+  static const u32 CHUNK_LENGTH = sizeof( T ) < HISTORY_CHUNK_SIZE ? HISTORY_CHUNK_SIZE / sizeof( T ) : 1;
+  std::vector< u8 > flags;
+
+  void mark( u32 index ) {
+    u32 chunk = index / CHUNK_LENGTH;
+    if ( chunk >= flags.size() ) {
+      flags.resize( chunk + 1, 0 );
+    }
+    flags[ chunk ] = 1;
+  }
+  void mark( u32 first, u32 count ) {
+    if ( count == 0 ) {
+      return;
+    }
+    u32 lastChunk = ( first + count - 1 ) / CHUNK_LENGTH;
+    if ( lastChunk >= flags.size() ) {
+      flags.resize( lastChunk + 1, 0 );
+    }
+    std::fill( flags.begin() + first / CHUNK_LENGTH, flags.begin() + lastChunk + 1, 1 );
+  }
+  void mark( const std::vector< ComponentIndex >& indices ) {
+    for ( ComponentIndex index : indices ) {
+      mark( index );
+    }
+  }
+  void clear() {
+    std::fill( flags.begin(), flags.end(), 0 );
+  }
+  SnapshotSection section( const std::vector< T >& values ) const {
+    return { reinterpret_cast< const u8* >( values.data() ), ( u32 )( values.size() * sizeof( T ) ),
+             flags.data(), ( u32 )flags.size(), CHUNK_LENGTH * ( u32 )sizeof( T ), {} };
+  }
+};
+
+// Sparse entity index -> component index map. Instead of a flat array of
+// MAX_ENTITIES entries per component type, the index space is split into 4KB
+// pages which are only allocated when an entity in their range gets the
+// component. A page the last one in its range lost stays, empty, for the
+// next ones to come back to, until trim() frees it.
+struct PagedIndex {
+  static const u32 PAGE_SIZE = 1024; // ComponentIndex entries per page
+  static const u32 PAGE_BITS = 10;
+  std::vector< ComponentIndex* > pages;
+  std::vector< u16 > pageCounts; // non-zero entries in each page
+  std::vector< u8 > changedPages; // since the last captureFrame()
+  u32 residentPages = 0;
+
+  PagedIndex() = default;
+  PagedIndex( const PagedIndex& ) = delete;
+  PagedIndex& operator=( const PagedIndex& ) = delete;
+  ~PagedIndex();
+  ComponentIndex get( u32 index ) const;
+  void set( u32 index, ComponentIndex compInd );
+  void clear();
+  // frees the pages left empty
+  void trim();
+  u64 getResidentBytes() const;
+  // only the resident pages are written, but every page has its sections
+  void getSections( std::vector< SnapshotSection >* sections ) const;
+  void clearChanges();
+  // returns where an index that load() can read ends, with every entry below
+  // limit, or nullptr if the data isn't one
+  static const u8* check( const u8* data, const u8* end, u32 limit );
+  // replaces the whole index with one check() accepted, returns where the
+  // data read ends
+  const u8* load( const u8* data, const u8* end );
+};
+
+template< typename T >
+inline void writeSnapshot( FILE* file, const T* values, u32 count ) {
+  fwrite( values, sizeof( T ), count, file );
+}
+
+// The snapshot is not aligned for T, so it is always copied out. Returns
+// nullptr instead of reading past end, and from then on.
+template< typename T >
+inline const u8* readSnapshot( const u8* data, const u8* end, T* values, u32 count ) {
+  if ( data == nullptr || ( size_t )( end - data ) < sizeof( T ) * count ) {
+    return nullptr;
+  }
+  std::memcpy( values, data, sizeof( T ) * count );
+  return data + sizeof( T ) * count;
+}
+
+// steps over count values like readSnapshot() reads them
+template< typename T >
+inline const u8* skipSnapshot( const u8* data, const u8* end, u32 count ) {
+  if ( data == nullptr || ( size_t )( end - data ) < sizeof( T ) * count ) {
+    return nullptr;
+  }
+  return data + sizeof( T ) * count;
+}
+
+inline ComponentIndex PagedIndex::get( u32 index ) const {
+  u32 pageInd = index >> PAGE_BITS;
+  if ( pageInd >= pages.size() || pages[ pageInd ] == nullptr ) {
+    return 0;
+  }
+  return pages[ pageInd ][ index & ( PAGE_SIZE - 1 ) ];
+}
+
+// How EntityManager reaches into a ComponentMap without knowing its type
+struct ComponentStorage {
+  void* map;
+  PagedIndex* indices; // raw indices
+  void ( *swap )( void* map, ComponentIndex compIndA, ComponentIndex compIndB );
+  ComponentIndex ( *stamp )( const void* map, ComponentIndex compInd );
+  // appends the sections of the snapshot layout the map is saved as
+  void ( *getSections )( const void* map, std::vector< SnapshotSection >* sections );
+  // once captureFrame() copied the changes
+  void ( *clearChanges )( void* map );
+  // returns where a section load() can read ends and how many components,
+  // the null one included, it has, or nullptr if the data isn't one
+  const u8* ( *check )( const u8* data, const u8* end, u32 entityCount, u32* count );
+  const u8* ( *load )( void* map, const u8* data, const u8* end );
+};
+
+typedef u32 ViewIndex;
+
+// Entities that have all the components in mask, each with the index of every
+// one of those components, kept up to date as components are added, removed
+// and moved, so systems can iterate the arrays directly instead of looking up
+// each manager every frame. Rows are in no particular order.
+struct ComponentView {
+  ComponentMask mask;
+  std::vector< EntityHandle > entities;
+  // only the arrays of the types in mask are used, all parallel to entities,
+  // with stamped indices
+  std::vector< ComponentIndex > indices[ NUM_COMPONENT_TYPES ];
+  PagedIndex rows; // entity index -> row + 1
+};
+
+typedef u32 GroupIndex;
+
+// Entities that have all the components in mask. Every ComponentMap of those
+// types keeps their components packed at indices 1 to size, all in the same
+// order, so a joined iteration is a lockstep linear scan. Each component type
+// can be owned by a single group.
+struct OwningGroup {
+  ComponentMask mask;
+  u32 size;
+};
+
+struct SortEntry {
+  u64 key;
+  EntityHandle entity;
+};
+
+// writes the sort key and entity of up to count components, starting at raw
+// index first, and returns how many there were
+typedef u32 ( *SortKeysCallback )( ComponentIndex first, u32 count, SortEntry* result );
+
+// State of the reordering of a ComponentMap by a sort key, so that components
+// that are used together end up next to each other, done a bit every frame.
+// A pass reads the keys, merge sorts them and then swaps every component
+// into its place. Components added or removed meanwhile just end up out of
+// place until the next pass. Components in an owning group are not moved.
+struct Defragmentation {
+  enum Phase { IDLE, KEYS, SORT, APPLY };
+  ComponentType type;
+  SortKeysCallback getKeys;
+  Phase phase;
+  u32 cursor;
+  std::vector< SortEntry > entries;
+  std::vector< SortEntry > merged;
+  // bottom-up merge sort progress
+  u32 width, left, leftEnd, right, rightEnd;
+  ComponentIndex nextTarget;
+};
+
 class EntityManager {
-  struct Generation { // can't just use u32 since they overflow at different values
-    u32 generation : HANDLE_GENERATION_BITS;
-  };
   const static u32 MIN_FREE_INDICES = 1024;
-  static std::vector< Generation > generations;
-  static std::deque< u32 > freeIndices;
-  // ComponentMap is responsible, with it's set() method, to provide EntityManager
-  // with functions to call in order to delete all the components from an entity when
-  // it is to be deleted itself.
+  // both have MAX_ENTITIES slots, allocated up front so that they never move
+  // while other threads are reading them, of which the first entityCount are
+  // in use. Untouched slots cost no physical memory.
+  // Atomic since destroyConcurrent() changes them while isAlive() reads them.
+  static std::atomic< u32 >* generations;
+  // which component types each entity slot has, one bit per ComponentType
+  static ComponentMask* componentMasks;
+  // a flag for each ENTITY_CHUNK_LENGTH slots whose generation or mask
+  // changed since the last captureFrame(), MAX_ENTITIES of them up front too
+  static const u32 ENTITY_CHUNK_LENGTH = HISTORY_CHUNK_SIZE / sizeof( u32 );
+  static std::atomic< u8 >* entityChanges;
+  // the mask of a slot, to change
+  static ComponentMask& changeMask( u32 index );
+  static std::atomic< u32 > entityCount;
+  static std::deque< u32 > freeIndices; // main thread only
+  // Slots freed by destroyConcurrent(), and the ones freeIndices has past
+  // MIN_FREE_INDICES at the end of flushDeferred(), are kept in a lock-free
+  // stack linked through freeNext ( index + 1, 0 ends it ), which both create
+  // functions reuse from. The low half of the head is
+  // the top index + 1, the high half a tag bumped on every change against ABA.
+  static std::atomic< u32 >* freeNext;
+  static std::atomic< u64 > freeStackHead;
+  static std::atomic< u32 > freeStackSize;
+  // Each thread creates from, and destroys into, its own block of indices,
+  // so the shared counters are only touched once every RESERVATION_SIZE calls
+  static const u32 RESERVATION_SIZE = 64;
+  struct ThreadReservation {
+    u32 reserved[ RESERVATION_SIZE ];
+    u32 reservedCount;
+    u32 freed[ RESERVATION_SIZE ];
+    u32 freedCount;
+  };
+  static thread_local ThreadReservation reservation;
+  // claims count never used slots, returns the first one
+  static u32 claimSlots( u32 count );
+  // invalidates the handles to a slot, wrapping around at
+  // HANDLE_GENERATION_BITS like them. Only the thread destroying it writes it.
+  static void advanceGeneration( u32 index );
+  static void pushFreeIndices( const u32* indices, u32 count );
+  // pops up to count indices, returns how many
+  static u32 popFreeIndices( u32 count, u32* result );
+  // ComponentMap is responsible for keeping componentMasks up to date and, with
+  // its initialize() method, for providing EntityManager with functions to call
+  // in order to delete all the components from an entity when it is to be
+  // deleted itself, and to apply the changes deferred until the end of the frame.
   template< typename T > friend struct ComponentMap;
-  static std::unordered_multimap< u32, RmvCompCallback > removeComponentCallbacks;
+  template< typename... Fields > friend struct SoAComponentMap;
+  static CompCallbacks componentCallbacks[ NUM_COMPONENT_TYPES ];
+  static ComponentStorage componentStorages[ NUM_COMPONENT_TYPES ];
+  static void registerComponentType( ComponentType type, CompCallbacks callbacks, ComponentStorage storage );
+  static std::vector< EntityHandle > deferredDestroys;
+  // ComponentMap also reports every change to its arrays so the views stay valid
+  static const u32 MAX_VIEWS = 16;
+  static ComponentView views[ MAX_VIEWS ];
+  static u32 viewCount;
+  static u32 viewsByType[ NUM_COMPONENT_TYPES ]; // bit i set if views[ i ] uses the type
+  static void onComponentAdded( EntityHandle entity, ComponentType type );
+  static void onComponentRemoved( EntityHandle entity, ComponentType type );
+  // compInd is stamped
+  static void onComponentMoved( EntityHandle entity, ComponentType type, ComponentIndex compInd );
+  static void addViewRow( ComponentView& view, EntityHandle entity );
+  // add the rows of the entities that already have the components
+  static void fillView( ComponentView& view );
+  static const u32 MAX_GROUPS = 8;
+  static OwningGroup groups[ MAX_GROUPS ];
+  static u32 groupCount;
+  static u32 groupsByType[ NUM_COMPONENT_TYPES ]; // index + 1 of the owning group, 0 if none
+  static void addToGroup( OwningGroup& group, EntityHandle entity );
+  static void removeFromGroup( OwningGroup& group, EntityHandle entity );
+  // the component types registered
+  static ComponentMask getTypeMask();
+  // The snapshot layout, shared by the files and the history, up to the
+  // views. writeWorld() writes the views after it, the history rebuilds them
+  // on restore instead.
+  static void getWorldSections( std::vector< SnapshotSection >* sections, u32 savedViews );
+  static void writeWorld( FILE* file );
+  // returns the end of a world readWorld() can read, every count checked
+  // against the data and the limits of this build, or nullptr
+  static const u8* checkWorld( const u8* data, const u8* end );
+  // replaces the world with the one that is all of [ data, end ), returns
+  // false without touching it if it isn't one
+  static bool readWorld( const u8* data, const u8* end );
+  // Frames captured for restore(), in one ring of bytes allocated up front.
+  // A keyframe is every section of the world, the frames after it only keep
+  // the ranges of them that changed since the frame before, until the next
+  // keyframe. Sections are told apart by their position, so there is a new
+  // keyframe whenever their number changes.
+  struct HistoryFrame {
+    u32 offset; // in historyBytes
+    u32 bytes;
+    u32 worldBytes; // size of the serialized world
+    u32 keyframe; // frame number, its own if it is one
+  };
+  static HistoryFrame* historyFrames; // by frame number % historyLength
+  static u32 historyLength;
+  static u8* historyBytes;
+  static u32 historyCapacity;
+  static u32 historyWriteOffset;
+  static u8* historyWorld; // the world being restored
+  // the sections of the last frame captured, and the bytes of the ones that
+  // are compared, empty for the others
+  static std::vector< u32 > capturedBytes;
+  static std::vector< std::vector< u8 > > capturedSections;
+  struct HistoryRange {
+    u32 section;
+    u32 offset;
+    u32 bytes;
+  };
+  static std::vector< HistoryRange > changedRanges;
+  // the ranges of the sections different from the last frame captured
+  static void findChangedRanges( const std::vector< SnapshotSection >& sections );
+  static u32 oldestFrame;
+  static u32 nextFrame;
+  // drops the oldest frames until bytes fit at the returned offset
+  static u32 allocateHistory( u32 bytes );
 public:
   static void initialize();
   static void shutdown();
   static EntityHandle create();
+  // appends count new entities to result
+  static void createBatch( u32 count, std::vector< EntityHandle >* result );
   static void destroy( EntityHandle entity );
+  // entities must not contain duplicates
+  static void destroyBatch( const std::vector< EntityHandle >& entities );
+  // destroy the entity when flushDeferred() is next called
+  static void destroyDeferred( EntityHandle entity );
+  // apply every destruction, component addition and component removal recorded
+  // since the last call, so component indices stay valid for a whole frame
+  static void flushDeferred();
+  // createConcurrent() and destroyConcurrent() can be called from any thread,
+  // at the same time as each other and isAlive(). The rest of the methods, and
+  // the ComponentMaps, are still only for the main thread, outside of that.
+  static EntityHandle createConcurrent();
+  // entity must have no components
+  static void destroyConcurrent( EntityHandle entity );
+  // gives the indices the calling thread holds back to everyone, call it
+  // before the thread exits
+  static void releaseThreadReservation();
   static bool isAlive( EntityHandle entity );
+  static ComponentMask getComponentMask( EntityHandle entity );
+  // views should be created at initialization, they are never destroyed
+  static ViewIndex createView( ComponentMask mask );
+  static const ComponentView& getView( ViewIndex view );
+  // groups should also be created at initialization, they are never destroyed
+  static GroupIndex createOwningGroup( ComponentMask mask );
+  static u32 getGroupSize( GroupIndex group );
+  // how many components at the start of the type's map are owned by a group
+  static u32 getOwnedCount( ComponentType type );
+  // Writes the whole world, every entity and every component, to a binary
+  // file that loadSnapshot() can read back with a few bulk copies. There must
+  // be no deferred changes pending and no thread creating entities.
+  static bool saveSnapshot( const char* path );
+  // Replaces the whole world with the one in the file, returns false, leaving
+  // the world as it was, if it can't be read, is damaged or was written by
+  // another version. The same component types must be registered, and assets
+  // referenced by components, like textures, loaded in the same order as when
+  // it was saved.
+  static bool loadSnapshot( const char* path );
+  // frames between keyframes of the history
+  static const u32 KEYFRAME_INTERVAL = 30;
+  // Keeps the last frameCount frames for restore() in byteCapacity bytes,
+  // twice, allocated now. The frames whose keyframe was dropped can't be
+  // restored, so they are kept as long as byteCapacity fits a keyframe
+  // interval more of them.
+  static void initializeHistory( u32 frameCount, u32 byteCapacity );
+  static const u32 NO_FRAME = ~0u;
+  // call at the end of the frame, with no deferred changes pending, returns
+  // the frame number to pass to restore(), or NO_FRAME if the world doesn't
+  // fit in the history
+  static u32 captureFrame();
+  // Replaces the world with the one captured at that frame, and forgets the
+  // frames after it. Returns false if the frame is no longer kept.
+  static bool restore( u32 frame );
+  // the oldest frame restore() can still go back to, the next one to be
+  // captured if there are none
+  static u32 getOldestFrame();
+  static void initializeDefragmentation( Defragmentation* defrag, ComponentType type, SortKeysCallback getKeys );
+  // do up to budget elements of work of the current pass, or start a new one,
+  // returns true when a pass has just been completed
+  static bool defragment( Defragmentation& defrag, u32 budget );
+  // frees the index pages of the component maps and views that were left
+  // empty, call it now and then so the ones emptied and filled again in
+  // between stay allocated
+  static void trimIndices();
 };
+
+inline ComponentMask& EntityManager::changeMask( u32 index ) {
+  entityChanges[ index / ENTITY_CHUNK_LENGTH ].store( 1, std::memory_order_relaxed );
+  return componentMasks[ index ];
+}
   
 #ifdef NDEBUG
 
@@ -67,49 +456,273 @@ public:
 
 struct LookupResult {
   std::vector< EntityHandle > entities;
-  std::vector< ComponentIndex > indices;
+  std::vector< ComponentIndex > indices; // stamped
+};
+
+struct ComponentMemory {
+  u64 indexBytes;
+  u64 componentBytes;
 };
 
 template< typename T >
 struct ComponentMap {
   std::vector< T > components;
-  ComponentIndex map[ MAX_ENTITIES ];
+  PagedIndex map; // entity index -> raw component index
+  ComponentType type;
+#ifndef NDEBUG
+  std::vector< u16 > slotGenerations; // parallel to components, never shrinks
+#endif
+  ChangedChunks< T > changes; // of components
+  // changes recorded during the frame, applied by flushDeferred()
+  std::vector< T > deferredSets;
+  std::vector< EntityHandle > deferredRemoves;
 
   ComponentMap();
-  void set( EntityHandle entity, T component, RmvCompCallback rmvComp );
+  void initialize( ComponentType type, CompCallbacks callbacks );
+  void set( EntityHandle entity, T component );
   void remove( EntityHandle entity );
+  void removeBatch( const std::vector< EntityHandle >& entities );
+  void setDeferred( EntityHandle entity, T component );
+  void removeDeferred( EntityHandle entity );
+  void flushDeferred();
+  void swap( ComponentIndex compIndA, ComponentIndex compIndB );
+  static void swapErased( void* componentMap, ComponentIndex compIndA, ComponentIndex compIndB );
+  // a component has been put in the slot, indices stamped before are now stale
+  // and the history copies it again
+  void touch( ComponentIndex compInd );
+  ComponentIndex stamp( ComponentIndex compInd ) const;
+  static ComponentIndex stampErased( const void* componentMap, ComponentIndex compInd );
+  // raw index of a stamped one, halts if it is stale
+  ComponentIndex validate( ComponentIndex compInd ) const;
+  T& at( ComponentIndex compInd );
+  // the component at a raw index, to write to
+  T& change( ComponentIndex compInd );
   void lookup( const std::vector< EntityHandle >& entities, LookupResult* result );
+  ComponentMemory getMemoryUsage() const;
+  static void getSections( const void* componentMap, std::vector< SnapshotSection >* sections );
+  static void clearChanges( void* componentMap );
+  static const u8* check( const u8* data, const u8* end, u32 entityCount, u32* count );
+  static const u8* load( void* componentMap, const u8* data, const u8* end );
 };
 
 template< typename T >
 ComponentMap< T >::ComponentMap() {
   components.push_back( {} );
+#ifndef NDEBUG
+  slotGenerations.push_back( 0 );
+#endif
 }
 
+// tell the EntityManager how to remove this type of component
+// for when it needs to destroy an entity
 template< typename T >
-void ComponentMap< T >::set( EntityHandle entity, T component, RmvCompCallback rmvComp ) {
+void ComponentMap< T >::initialize( ComponentType type, CompCallbacks callbacks ) {
+  this->type = type;
+  EntityManager::registerComponentType( type, callbacks, { this, &map, &ComponentMap< T >::swapErased,
+                                                  &ComponentMap< T >::stampErased, &ComponentMap< T >::getSections,
+                                                  &ComponentMap< T >::clearChanges, &ComponentMap< T >::check,
+                                                  &ComponentMap< T >::load } );
+}
+
+template< typename T >
+void ComponentMap< T >::set( EntityHandle entity, T component ) {
   VALIDATE_ENTITY( entity );
+  ComponentMask& mask = EntityManager::changeMask( entity.index - 1 );
+  ASSERT( ( mask & ( 1 << type ) ) == 0, "Entity %d already has the given component", entity );
   components.push_back( component );
   u32 compInd = components.size() - 1;
-  map[ entity ] = compInd;
-  // tell the EntityManager how to remove this component
-  // for when it needs to destroy the entity
-  EntityManager::removeComponentCallbacks.insert( { entity, rmvComp } );
+  touch( compInd );
+  map.set( entity.index, compInd );
+  mask |= 1 << type;
+  EntityManager::onComponentAdded( entity, type );
 }
 
 template< typename T >
 void ComponentMap< T >::remove( EntityHandle entity ) {
   VALIDATE_ENTITY( entity );
-  ComponentIndex compInd = map[ entity ];
-  ASSERT( compInd > 0, "Entity %d has no given component", entity );
+  ASSERT( map.get( entity.index ) > 0, "Entity %d has no given component", entity );
+  EntityManager::changeMask( entity.index - 1 ) &= ~( 1 << type );
+  // this may move the component out of an owning group
+  EntityManager::onComponentRemoved( entity, type );
+  ComponentIndex compInd = map.get( entity.index );
   // replace comp-to-remove with last one, thus removing it,
   // and erase last element
   components[ compInd ] = components[ components.size() - 1 ];
   components.erase( components.end() - 1 );
-  // ...update comp-not-to-remove in map
-  map[ components[ compInd ].entity ] = compInd;
+  // ...update comp-not-to-remove in map (unless comp-to-remove was the last one)
+  if ( compInd < components.size() ) {
+    touch( compInd );
+    map.set( components[ compInd ].entity.index, compInd );
+    EntityManager::onComponentMoved( components[ compInd ].entity, type, stamp( compInd ) );
+  }
   // and remove comp-to-remove in map
-  map[ entity ] = 0;
+  map.set( entity.index, 0 );
+}
+
+// Removes the components of all the given entities in a single compaction
+// pass: every hole left below the new end of the array is filled with one
+// of the components past it that is not being removed itself.
+template< typename T >
+void ComponentMap< T >::removeBatch( const std::vector< EntityHandle >& entities ) {
+  VALIDATE_ENTITIES( entities );
+  static std::vector< ComponentIndex > holes;
+  holes.clear();
+  holes.reserve( entities.size() );
+  // clear the map first so that a zero in it marks a component to remove
+  for ( u32 entInd = 0; entInd < entities.size(); ++entInd ) {
+    EntityHandle entity = entities[ entInd ];
+    ASSERT( map.get( entity.index ) > 0, "Entity %d has no given component", entity );
+    EntityManager::changeMask( entity.index - 1 ) &= ~( 1 << type );
+    // this may move the component out of an owning group, but only components
+    // still in it get moved, never the ones already marked for removal
+    EntityManager::onComponentRemoved( entity, type );
+    holes.push_back( map.get( entity.index ) );
+    map.set( entity.index, 0 );
+  }
+  u32 newSize = components.size() - holes.size();
+  u32 tailInd = newSize;
+  for ( u32 holeInd = 0; holeInd < holes.size(); ++holeInd ) {
+    ComponentIndex hole = holes[ holeInd ];
+    if ( hole >= newSize ) {
+      // it is in the tail that is about to be erased
+      continue;
+    }
+    while ( map.get( components[ tailInd ].entity.index ) == 0 ) {
+      ++tailInd;
+    }
+    components[ hole ] = components[ tailInd ];
+    touch( hole );
+    map.set( components[ hole ].entity.index, hole );
+    EntityManager::onComponentMoved( components[ hole ].entity, type, stamp( hole ) );
+    ++tailInd;
+  }
+  components.erase( components.begin() + newSize, components.end() );
+}
+
+template< typename T >
+void ComponentMap< T >::setDeferred( EntityHandle entity, T component ) {
+  VALIDATE_ENTITY( entity );
+  ASSERT( component.entity == entity, "Component of entity %d given to entity %d", component.entity, entity );
+#ifdef NDEBUG
+  UNUSED( entity );
+#endif
+  deferredSets.push_back( component );
+}
+
+template< typename T >
+void ComponentMap< T >::removeDeferred( EntityHandle entity ) {
+  VALIDATE_ENTITY( entity );
+  deferredRemoves.push_back( entity );
+}
+
+// Removals are applied before additions, both in entity index order. Changes
+// to entities that have been destroyed in the meantime are dropped, and so
+// are additions to entities that still have the component. Of several
+// additions to one entity, the last one is applied.
+template< typename T >
+void ComponentMap< T >::flushDeferred() {
+  if ( !deferredRemoves.empty() ) {
+    std::sort( deferredRemoves.begin(), deferredRemoves.end(), []( EntityHandle a, EntityHandle b ) {
+        return a.index < b.index;
+      } );
+    u32 removeCount = 0;
+    for ( u32 entInd = 0; entInd < deferredRemoves.size(); ++entInd ) {
+      EntityHandle entity = deferredRemoves[ entInd ];
+      bool duplicate = removeCount > 0 && deferredRemoves[ removeCount - 1 ] == entity;
+      if ( !duplicate && EntityManager::isAlive( entity ) && map.get( entity.index ) > 0 ) {
+        deferredRemoves[ removeCount++ ] = entity;
+      }
+    }
+    deferredRemoves.resize( removeCount );
+    removeBatch( deferredRemoves );
+    deferredRemoves.clear();
+  }
+  if ( !deferredSets.empty() ) {
+    std::stable_sort( deferredSets.begin(), deferredSets.end(), []( const T& a, const T& b ) {
+        return a.entity.index < b.entity.index;
+      } );
+    components.reserve( components.size() + deferredSets.size() );
+    for ( u32 compInd = 0; compInd < deferredSets.size(); ++compInd ) {
+      EntityHandle entity = deferredSets[ compInd ].entity;
+      // the sort is stable, so a later addition to the same entity is next
+      bool replaced = compInd + 1 < deferredSets.size() && deferredSets[ compInd + 1 ].entity == entity;
+      if ( !replaced && EntityManager::isAlive( entity ) && map.get( entity.index ) == 0 ) {
+        set( entity, deferredSets[ compInd ] );
+      }
+    }
+    deferredSets.clear();
+  }
+}
+
+template< typename T >
+void ComponentMap< T >::swap( ComponentIndex compIndA, ComponentIndex compIndB ) {
+  if ( compIndA == compIndB ) {
+    return;
+  }
+  T component = components[ compIndA ];
+  components[ compIndA ] = components[ compIndB ];
+  components[ compIndB ] = component;
+  touch( compIndA );
+  touch( compIndB );
+  map.set( components[ compIndA ].entity.index, compIndA );
+  map.set( components[ compIndB ].entity.index, compIndB );
+  EntityManager::onComponentMoved( components[ compIndA ].entity, type, stamp( compIndA ) );
+  EntityManager::onComponentMoved( components[ compIndB ].entity, type, stamp( compIndB ) );
+}
+
+template< typename T >
+void ComponentMap< T >::swapErased( void* componentMap, ComponentIndex compIndA, ComponentIndex compIndB ) {
+  static_cast< ComponentMap< T >* >( componentMap )->swap( compIndA, compIndB );
+}
+
+template< typename T >
+inline void ComponentMap< T >::touch( ComponentIndex compInd ) {
+  changes.mark( compInd );
+#ifndef NDEBUG
+  if ( compInd >= slotGenerations.size() ) {
+    slotGenerations.resize( compInd + 1, 0 );
+  }
+  // wraps around like entity generations
+  slotGenerations[ compInd ] = ( slotGenerations[ compInd ] + 1 ) & ( ( 1 << HANDLE_GENERATION_BITS ) - 1 );
+#endif
+}
+
+template< typename T >
+inline ComponentIndex ComponentMap< T >::stamp( ComponentIndex compInd ) const {
+#ifndef NDEBUG
+  return compInd | slotGenerations[ compInd ] << COMPONENT_INDEX_BITS;
+#else
+  return compInd;
+#endif
+}
+
+template< typename T >
+ComponentIndex ComponentMap< T >::stampErased( const void* componentMap, ComponentIndex compInd ) {
+  return static_cast< const ComponentMap< T >* >( componentMap )->stamp( compInd );
+}
+
+template< typename T >
+inline ComponentIndex ComponentMap< T >::validate( ComponentIndex compInd ) const {
+#ifndef NDEBUG
+  ComponentIndex rawInd = compInd & COMPONENT_INDEX_MASK;
+  ASSERT( rawInd > 0 && rawInd < components.size(), "Component index %d out of bounds", rawInd );
+  ASSERT( compInd >> COMPONENT_INDEX_BITS == slotGenerations[ rawInd ],
+          "Stale component index %d, the component in it has changed", rawInd );
+  return rawInd;
+#else
+  return compInd;
+#endif
+}
+
+template< typename T >
+inline T& ComponentMap< T >::at( ComponentIndex compInd ) {
+  return change( validate( compInd ) );
+}
+
+template< typename T >
+inline T& ComponentMap< T >::change( ComponentIndex compInd ) {
+  changes.mark( compInd );
+  return components[ compInd ];
 }
 
 template< typename T >
@@ -121,10 +734,64 @@ void ComponentMap< T >::lookup( const std::vector< EntityHandle >& entities, Loo
   result->indices.reserve( maxSize );
   for ( u32 entInd = 0; entInd < maxSize; ++entInd ) {
     EntityHandle entity = entities[ entInd ];
-    ComponentIndex compInd = map[ entity ];
+    ComponentIndex compInd = map.get( entity.index );
     if ( compInd > 0 ) {
       result->entities.push_back( entity );
-      result->indices.push_back( compInd );
+      result->indices.push_back( stamp( compInd ) );
     }
   }
 }
+
+template< typename T >
+ComponentMemory ComponentMap< T >::getMemoryUsage() const {
+  return { map.getResidentBytes(), components.capacity() * sizeof( T ) };
+}
+
+template< typename T >
+void ComponentMap< T >::getSections( const void* componentMap, std::vector< SnapshotSection >* sections ) {
+  static_assert( std::is_trivially_copyable< T >::value, "Components are saved as raw bytes" );
+  const ComponentMap< T >* self = static_cast< const ComponentMap< T >* >( componentMap );
+  ASSERT( self->deferredSets.empty() && self->deferredRemoves.empty(), "Deferred component changes pending" );
+  u32 header[ 2 ] = { ( u32 )self->components.size(), sizeof( T ) };
+  sections->push_back( valueSection( header, sizeof( header ) ) );
+  sections->push_back( self->changes.section( self->components ) );
+  self->map.getSections( sections );
+}
+
+template< typename T >
+void ComponentMap< T >::clearChanges( void* componentMap ) {
+  ComponentMap< T >* self = static_cast< ComponentMap< T >* >( componentMap );
+  self->changes.clear();
+  self->map.clearChanges();
+}
+
+template< typename T >
+const u8* ComponentMap< T >::check( const u8* data, const u8* end, u32 entityCount, u32* count ) {
+  // the entities are inside the components, where they can't be checked
+  UNUSED( entityCount );
+  u32 header[ 2 ] = {};
+  data = readSnapshot( data, end, header, 2 );
+  // there is always the null component
+  if ( data == nullptr || header[ 0 ] == 0 || header[ 0 ] > MAX_ENTITIES || header[ 1 ] != sizeof( T ) ) {
+    return nullptr;
+  }
+  *count = header[ 0 ];
+  data = skipSnapshot< T >( data, end, header[ 0 ] );
+  return PagedIndex::check( data, end, header[ 0 ] );
+}
+
+template< typename T >
+const u8* ComponentMap< T >::load( void* componentMap, const u8* data, const u8* end ) {
+  ComponentMap< T >* self = static_cast< ComponentMap< T >* >( componentMap );
+  u32 header[ 2 ] = {};
+  data = readSnapshot( data, end, header, 2 );
+  self->components.resize( header[ 0 ] );
+  data = readSnapshot( data, end, self->components.data(), header[ 0 ] );
+  self->deferredSets.clear();
+  self->deferredRemoves.clear();
+  // indices stamped before the load are all stale
+  for ( u32 compInd = 1; compInd < self->components.size(); ++compInd ) {
+    self->touch( compInd );
+  }
+  return self->map.load( data, end );
+}
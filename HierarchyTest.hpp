@@ -0,0 +1,72 @@
+#pragma once
+
+#include "EngineCommon.hpp"
+
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+// Propagates world transforms down one long chain of parents and down one
+// parent with every other transform as its child.
+class HierarchyTest {
+  static constexpr const u32 NUM_HIERARCHY_NODES = 100000;
+  static constexpr const u32 NUM_HIERARCHY_UPDATES = 100;
+  static void benchmarkHierarchy( const char* name, bool chain );
+public:
+  static void run();
+};
+
+// Every node is parented to the one created after it, or to the last one,
+// so the storage has to be reordered before the first propagation.
+void HierarchyTest::benchmarkHierarchy( const char* name, bool chain ) {
+  std::vector< EntityHandle > entities;
+  EntityManager::createBatch( NUM_HIERARCHY_NODES, &entities );
+  for ( u32 i = 0; i < NUM_HIERARCHY_NODES; ++i ) {
+    TransformManager::set( entities[ i ], { { 1.0f, 0.0f }, VEC2_ONE, 0.0f } );
+  }
+  EntityHandle root = entities.back();
+  for ( u32 i = 0; i + 1 < NUM_HIERARCHY_NODES; ++i ) {
+    TransformManager::setParent( entities[ i ], chain ? entities[ i + 1 ] : root );
+  }
+  TimePoint start = Clock::now();
+  TransformManager::updateWorldTransforms();
+  u64 sortNanos = elapsedNanos( start );
+  EntityManager::flushDeferred();
+  // the root moves every node, the first one is a leaf in both
+  LookupResult lookupResult;
+  TransformManager::lookup( { root, entities[ 0 ] }, &lookupResult );
+  std::vector< ComponentIndex > rootIndex = { lookupResult.indices[ 0 ] };
+  std::vector< ComponentIndex > leafIndex = { lookupResult.indices[ 1 ] };
+  std::vector< Vec2 > translation = { { 0.0f, 1.0f } };
+  u64 rootNanos = 0, leafNanos = 0;
+  for ( u32 i = 0; i < NUM_HIERARCHY_UPDATES; ++i ) {
+    TransformManager::translate( rootIndex, translation );
+    start = Clock::now();
+    TransformManager::updateWorldTransforms();
+    rootNanos += elapsedNanos( start );
+    EntityManager::flushDeferred();
+  }
+  for ( u32 i = 0; i < NUM_HIERARCHY_UPDATES; ++i ) {
+    TransformManager::translate( leafIndex, translation );
+    start = Clock::now();
+    TransformManager::updateWorldTransforms();
+    leafNanos += elapsedNanos( start );
+    EntityManager::flushDeferred();
+  }
+  std::vector< Transform > leafWorld;
+  TransformManager::getWorld( leafIndex, &leafWorld );
+  Vec2 expected = { chain ? ( float )NUM_HIERARCHY_NODES : 2.0f, 2.0f * NUM_HIERARCHY_UPDATES };
+  ASSERT( leafWorld[ 0 ].position.x == expected.x && leafWorld[ 0 ].position.y == expected.y,
+          "Leaf at %f %f instead of %f %f", leafWorld[ 0 ].position.x, leafWorld[ 0 ].position.y, expected.x, expected.y );
+  UNUSED( expected );
+  Debug::write( "%d nodes in a %s: sorted and propagated in %.2f ms, root moved %.3f ms, leaf moved %.2f us\n",
+                NUM_HIERARCHY_NODES, name, sortNanos / 1.0e6, rootNanos / 1.0e6 / NUM_HIERARCHY_UPDATES,
+                leafNanos / 1.0e3 / NUM_HIERARCHY_UPDATES );
+  EntityManager::destroyBatch( entities );
+}
+
+void HierarchyTest::run() {
+  Debug::write( "Running transform hierarchy benchmark...\n" );
+  benchmarkHierarchy( "chain", true );
+  benchmarkHierarchy( "fan-out", false );
+}
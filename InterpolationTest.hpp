@@ -0,0 +1,59 @@
+#pragma once
+
+#include "EngineCommon.hpp"
+
+#include <vector>
+
+// Moves a sprite for a few simulation steps and then stops it, and checks
+// where it is rendered between the steps.
+class InterpolationTest {
+  static constexpr const u32 NUM_MOVING_STEPS = 5;
+  static constexpr const float STEP_TRANSLATION = 10.0f;
+  static void step( EntityHandle entity, Vec2 translation );
+  static Vec2 getRenderedPosition( EntityHandle entity, float interpolation );
+public:
+  // the sprite manager and the asset manager must have been initialized
+  static void run();
+};
+
+void InterpolationTest::step( EntityHandle entity, Vec2 translation ) {
+  TransformManager::translate( entity, translation );
+  SpriteManager::update();
+  EntityManager::flushDeferred();
+}
+
+Vec2 InterpolationTest::getRenderedPosition( EntityHandle entity, float interpolation ) {
+  LookupResult lookupResult;
+  SpriteManager::lookup( { entity }, &lookupResult );
+  std::vector< Vec2 > positions;
+  SpriteManager::getRenderedPositions( lookupResult.indices, interpolation, &positions );
+  return positions[ 0 ];
+}
+
+void InterpolationTest::run() {
+  Debug::write( "Running sprite interpolation test...\n" );
+  EntityHandle entity = EntityManager::create();
+  TransformManager::set( entity, { {}, VEC2_ONE, 0.0f } );
+  SpriteManager::set( entity, AssetManager::loadTexture( "astronaut.png" ), { { 0.0f, 0.0f }, { 1.0f / 5.0f, 1.0f } } );
+  // a new sprite has nothing to interpolate from
+  step( entity, {} );
+  u32 wrong = 0;
+  for ( u32 stepInd = 0; stepInd <= NUM_MOVING_STEPS; ++stepInd ) {
+    bool moving = stepInd < NUM_MOVING_STEPS;
+    step( entity, { moving ? STEP_TRANSLATION : 0.0f, 0.0f } );
+    // from the last step to this one, or standing still once it stopped
+    float current = STEP_TRANSLATION * ( moving ? stepInd + 1 : NUM_MOVING_STEPS );
+    float previous = moving ? current - STEP_TRANSLATION : current;
+    float atStep = getRenderedPosition( entity, 0.0f ).x;
+    float halfway = getRenderedPosition( entity, 0.5f ).x;
+    if ( atStep != previous || halfway != ( previous + current ) / 2.0f ) {
+      Debug::write( "\tstep %d rendered at %.1f and %.1f instead of %.1f and %.1f\n", stepInd + 1, atStep, halfway,
+                    previous, ( previous + current ) / 2.0f );
+      ++wrong;
+    }
+  }
+  ASSERT( wrong == 0, "%d steps rendered at the wrong position", wrong );
+  Debug::write( "%d steps, %d rendered at the wrong position\n", NUM_MOVING_STEPS + 1, wrong );
+  EntityManager::destroy( entity );
+  EntityManager::flushDeferred();
+}
@@ -16,14 +16,32 @@ static void APIENTRY printOpenglError( GLenum source, GLenum type, GLuint id, GL
 
 GLFWwindow* createWindowAndGlContext( const char* const windowTitle );
 
+// components each manager may reorder per frame
+const u32 DEFRAGMENT_BUDGET = 256;
+// one second of simulation steps to go back to. Every actor of the test
+// scene moves in every step, so each one is about its whole world.
+const u32 HISTORY_FRAMES = 30;
+const u32 HISTORY_FRAME_BYTES = 512 << 10;
+const u32 HISTORY_BYTES = ( HISTORY_FRAMES + EntityManager::KEYFRAME_INTERVAL ) * HISTORY_FRAME_BYTES;
+// simulation steps per second, rendering goes as fast as it can
+const double SIMULATION_RATE = 30.0;
+// past this the simulation slows down instead of falling further behind
+const u32 MAX_STEPS_PER_FRAME = 5;
+// how the colliders that may touch are found, BroadphaseTest compares them
+const ColliderManager::Broadphase BROADPHASE = ColliderManager::QUADTREE;
+
 s32 main() {
   // initialize managers
   Debug::initializeLogger();
   Profiler::initialize();
+  SIMD::initialize();
+  Scheduler::initialize( SIMULATION_RATE, MAX_STEPS_PER_FRAME );
   GLFWwindow* window = createWindowAndGlContext( "Space Adventure (working title)" );
   EntityManager::initialize();
+  EntityManager::initializeHistory( HISTORY_FRAMES, HISTORY_BYTES );
   TransformManager::initialize();
   ColliderManager::initialize();
+  ColliderManager::setBroadphase( BROADPHASE );
   SolidBodyManager::initialize();
   SpriteManager::initialize();
   Debug::initializeRenderer();
@@ -57,17 +75,39 @@ s32 main() {
         glfwSetWindowShouldClose( window, true );
       }
     
-      ColliderManager::updateAndCollide();
+      // simulate in fixed steps for the time the last frame took
+      u32 steps = Scheduler::advance( deltaT );
+      for ( u32 step = 0; step < steps; ++step ) {
+        // the debug shapes stay up until the next step draws them again
+        Debug::clear();
+
+        ColliderManager::updateAndCollide();
+
+        SolidBodyManager::update( Scheduler::getStepDuration() );
+
+        SpriteManager::update();
 
-      SolidBodyManager::update( 1.0 / 30.0 /*deltaT*/ );
-      UNUSED( deltaT );
+        // apply the structural changes recorded during the step
+        EntityManager::flushDeferred();
+
+        // keep the component arrays in spatial order, a little every step,
+        // and free the index pages left empty once in a while
+        if ( TransformManager::defragment( DEFRAGMENT_BUDGET ) ) {
+          EntityManager::trimIndices();
+        }
+        ColliderManager::defragment( DEFRAGMENT_BUDGET );
+        SpriteManager::defragment( DEFRAGMENT_BUDGET );
+
+        // keep the step to be able to go back to it
+        EntityManager::captureFrame();
+      }
     
       // render scene
       glClear( GL_COLOR_BUFFER_BIT );
-      SpriteManager::updateAndRender();
+      SpriteManager::render( Scheduler::getInterpolation() );
   
       // render debug shapes
-      Debug::renderAndClear();
+      Debug::render();
     
       glfwSwapBuffers( window );
 
@@ -107,6 +147,7 @@ s32 main() {
   ColliderManager::shutdown();
   TransformManager::shutdown();
   EntityManager::shutdown();
+  Scheduler::shutdown();
   Profiler::shutdown();
   Debug::shutdown();
   
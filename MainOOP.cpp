@@ -38,6 +38,9 @@ s32 main() {
 
   TestScene::initialize();
   
+  // collision pairs the quadtree leaves gave, and how many were different
+  u64 groupedPairs = 0, uniquePairs = 0;
+
   // main loop      
   double t1 = glfwGetTime();
   double t2;
@@ -54,6 +57,8 @@ s32 main() {
       }
     
       Collider::updateAndCollide();
+      groupedPairs += Collider::getPairStats().pairsGrouped;
+      uniquePairs += Collider::getPairStats().pairsUnique;
 
       SolidBody::update( 1.0 / 30.0 /*deltaT*/ );
       UNUSED( deltaT );
@@ -86,6 +91,10 @@ s32 main() {
     }
   }
   Debug::write( "Main loop exited.\n" );
+  if ( groupedPairs > 0 ) {
+    Debug::write( "%lu collision pairs from the quadtree leaves, %lu different, %.1f%% duplicates\n",
+                  groupedPairs, uniquePairs, 100.0 * ( groupedPairs - uniquePairs ) / groupedPairs );
+  }
   
   // free OpenGL resources
   glUseProgram( 0 );
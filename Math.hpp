@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 
 #define PI 3.14159265359
 
@@ -101,6 +102,49 @@ inline Vec2 rotateVec2( Vec2 vec, float orientation ) {
   return { vec.x * _cos - vec.y * _sin, vec.y * _cos + vec.x * _sin };
 }
 
+// cosine and sine of the orientation
+inline Vec2 unitRotation( float orientation ) {
+  float _cos = cos( orientation );
+  float _sin = sin( orientation );
+  return { _cos, _sin };
+}
+
+// by the rotation of the given cosine and sine
+inline Vec2 rotateVec2( Vec2 vec, Vec2 rotation ) {
+  return { vec.x * rotation.x - vec.y * rotation.y, vec.y * rotation.x + vec.x * rotation.y };
+}
+
 inline Vec2 normalized( Vec2 vec ) {
   return vec / magnitude( vec );
 }
+
+inline Vec2 lerp( Vec2 a, Vec2 b, float t ) {
+  return a + ( b - a ) * t;
+}
+
+// between two unit rotations, falls back to b when they are opposite
+inline Vec2 nlerp( Vec2 a, Vec2 b, float t ) {
+  Vec2 result = lerp( a, b, t );
+  float sqrLength = sqrMagnitude( result );
+  return sqrLength > 1e-6f ? result / std::sqrt( sqrLength ) : b;
+}
+
+// spreads the low 16 bits of value over the even bits of the result
+inline uint32_t spreadBits( uint32_t value ) {
+  value &= 0x0000ffff;
+  value = ( value | ( value << 8 ) ) & 0x00ff00ff;
+  value = ( value | ( value << 4 ) ) & 0x0f0f0f0f;
+  value = ( value | ( value << 2 ) ) & 0x33333333;
+  value = ( value | ( value << 1 ) ) & 0x55555555;
+  return value;
+}
+
+// Position along the Z-order curve of the cell of side cellSize the point is
+// in. Cells further than 32768 cells from the origin are clamped to the edge.
+inline uint32_t mortonCode( Vec2 point, float cellSize ) {
+  float x = floor( point.x / cellSize ) + 32768.0f;
+  float y = floor( point.y / cellSize ) + 32768.0f;
+  x = ( x < 0.0f ) ? 0.0f : ( ( x > 65535.0f ) ? 65535.0f : x );
+  y = ( y < 0.0f ) ? 0.0f : ( ( y > 65535.0f ) ? 65535.0f : y );
+  return spreadBits( ( uint32_t )x ) | spreadBits( ( uint32_t )y ) << 1;
+}
@@ -0,0 +1,385 @@
+#include "EngineCommon.hpp"
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#define X86_64
+// SSE2 is always there, the AVX2 kernels are compiled for it on their own
+#define TARGET_AVX2 __attribute__( ( target( "avx2,fma" ) ) )
+#endif
+
+const char* SIMD::LEVEL_NAMES[ NUM_LEVELS ] = { "scalar", "SSE2", "AVX2" };
+SIMD::Level SIMD::level = SIMD::SCALAR;
+
+////////////////////////////////// Scalar //////////////////////////////////
+
+static void sinCosScalar( const float* angles, u32 count, float* sines, float* cosines ) {
+  for ( u32 i = 0; i < count; ++i ) {
+    sines[ i ] = sin( angles[ i ] );
+    cosines[ i ] = cos( angles[ i ] );
+  }
+}
+
+static void addFloatsScalar( float* values, const ComponentIndex* indices, const float* addends, u32 count ) {
+  for ( u32 i = 0; i < count; ++i ) {
+    values[ indices[ i ] ] += addends[ i ];
+  }
+}
+
+static void addVec2sScalar( Vec2* values, const ComponentIndex* indices, const Vec2* addends, u32 count ) {
+  for ( u32 i = 0; i < count; ++i ) {
+    values[ indices[ i ] ] += addends[ i ];
+  }
+}
+
+static void addContiguousVec2sScalar( Vec2* values, const Vec2* addends, u32 count ) {
+  for ( u32 i = 0; i < count; ++i ) {
+    values[ i ] += addends[ i ];
+  }
+}
+
+// same as rotateVec2(), with the sine and cosine already computed
+static void rotateAroundScalar( Vec2* values, const ComponentIndex* indices, const Vec2* centers,
+                                const float* sines, const float* cosines, u32 count ) {
+  for ( u32 i = 0; i < count; ++i ) {
+    Vec2 vec = values[ indices[ i ] ] - centers[ i ];
+    values[ indices[ i ] ] = Vec2{ vec.x * cosines[ i ] - vec.y * sines[ i ],
+                                   vec.y * cosines[ i ] + vec.x * sines[ i ] } + centers[ i ];
+  }
+}
+
+static Rect boundsScalar( const Rect* rects, u32 count ) {
+  Rect result = { { INFINITY, INFINITY }, { -INFINITY, -INFINITY } };
+  for ( u32 i = 0; i < count; ++i ) {
+    result.min.x = std::min( result.min.x, rects[ i ].min.x );
+    result.min.y = std::min( result.min.y, rects[ i ].min.y );
+    result.max.x = std::max( result.max.x, rects[ i ].max.x );
+    result.max.y = std::max( result.max.y, rects[ i ].max.y );
+  }
+  return result;
+}
+
+#ifdef X86_64
+
+// Cephes' sinf and cosf: the angle is reduced to [ -pi/4, pi/4 ] around the
+// nearest multiple j of pi/4, j selects which polynomial and sign each gets
+const float FOUR_OVER_PI = 1.27323954473516f;
+const float PI_OVER_FOUR_PARTS[] = { 0.78515625f, 2.4187564849853515625e-4f, 3.77489497744594108e-8f };
+const float COS_COEFFICIENTS[] = { 2.443315711809948e-5f, -1.388731625493765e-3f, 4.166664568298827e-2f };
+const float SIN_COEFFICIENTS[] = { -1.9515295891e-4f, 8.3321608736e-3f, -1.6666654611e-1f };
+
+/////////////////////////////////// SSE2 ///////////////////////////////////
+
+static void sinCos4( __m128 angles, __m128* sines, __m128* cosines ) {
+  const __m128 signMask = _mm_castsi128_ps( _mm_set1_epi32( 0x80000000 ) );
+  __m128 sinSign = _mm_and_ps( angles, signMask );
+  __m128 x = _mm_andnot_ps( signMask, angles );
+  __m128i j = _mm_cvttps_epi32( _mm_mul_ps( x, _mm_set1_ps( FOUR_OVER_PI ) ) );
+  j = _mm_and_si128( _mm_add_epi32( j, _mm_set1_epi32( 1 ) ), _mm_set1_epi32( ~1 ) );
+  __m128 y = _mm_cvtepi32_ps( j );
+  sinSign = _mm_xor_ps( sinSign, _mm_castsi128_ps( _mm_slli_epi32( _mm_and_si128( j, _mm_set1_epi32( 4 ) ), 29 ) ) );
+  __m128 cosSign = _mm_castsi128_ps( _mm_slli_epi32( _mm_andnot_si128( _mm_sub_epi32( j, _mm_set1_epi32( 2 ) ),
+                                                                       _mm_set1_epi32( 4 ) ), 29 ) );
+  __m128 polyMask = _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_and_si128( j, _mm_set1_epi32( 2 ) ), _mm_setzero_si128() ) );
+  x = _mm_sub_ps( x, _mm_mul_ps( y, _mm_set1_ps( PI_OVER_FOUR_PARTS[ 0 ] ) ) );
+  x = _mm_sub_ps( x, _mm_mul_ps( y, _mm_set1_ps( PI_OVER_FOUR_PARTS[ 1 ] ) ) );
+  x = _mm_sub_ps( x, _mm_mul_ps( y, _mm_set1_ps( PI_OVER_FOUR_PARTS[ 2 ] ) ) );
+  __m128 z = _mm_mul_ps( x, x );
+  __m128 cosPoly = _mm_set1_ps( COS_COEFFICIENTS[ 0 ] );
+  cosPoly = _mm_add_ps( _mm_mul_ps( cosPoly, z ), _mm_set1_ps( COS_COEFFICIENTS[ 1 ] ) );
+  cosPoly = _mm_add_ps( _mm_mul_ps( cosPoly, z ), _mm_set1_ps( COS_COEFFICIENTS[ 2 ] ) );
+  cosPoly = _mm_mul_ps( _mm_mul_ps( cosPoly, z ), z );
+  cosPoly = _mm_add_ps( _mm_sub_ps( cosPoly, _mm_mul_ps( z, _mm_set1_ps( 0.5f ) ) ), _mm_set1_ps( 1.0f ) );
+  __m128 sinPoly = _mm_set1_ps( SIN_COEFFICIENTS[ 0 ] );
+  sinPoly = _mm_add_ps( _mm_mul_ps( sinPoly, z ), _mm_set1_ps( SIN_COEFFICIENTS[ 1 ] ) );
+  sinPoly = _mm_add_ps( _mm_mul_ps( sinPoly, z ), _mm_set1_ps( SIN_COEFFICIENTS[ 2 ] ) );
+  sinPoly = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( sinPoly, z ), x ), x );
+  __m128 sinVec = _mm_or_ps( _mm_and_ps( polyMask, sinPoly ), _mm_andnot_ps( polyMask, cosPoly ) );
+  __m128 cosVec = _mm_or_ps( _mm_and_ps( polyMask, cosPoly ), _mm_andnot_ps( polyMask, sinPoly ) );
+  *sines = _mm_xor_ps( sinVec, sinSign );
+  *cosines = _mm_xor_ps( cosVec, cosSign );
+}
+
+static void sinCosSSE2( const float* angles, u32 count, float* sines, float* cosines ) {
+  u32 i = 0;
+  __m128 sinVec, cosVec;
+  for ( ; i + 4 <= count; i += 4 ) {
+    sinCos4( _mm_loadu_ps( &angles[ i ] ), &sinVec, &cosVec );
+    _mm_storeu_ps( &sines[ i ], sinVec );
+    _mm_storeu_ps( &cosines[ i ], cosVec );
+  }
+  // the tail goes through the same polynomials, padded
+  if ( i < count ) {
+    float padded[ 4 ] = {}, paddedSines[ 4 ], paddedCosines[ 4 ];
+    std::copy( &angles[ i ], &angles[ count ], padded );
+    sinCos4( _mm_loadu_ps( padded ), &sinVec, &cosVec );
+    _mm_storeu_ps( paddedSines, sinVec );
+    _mm_storeu_ps( paddedCosines, cosVec );
+    std::copy( paddedSines, paddedSines + count - i, &sines[ i ] );
+    std::copy( paddedCosines, paddedCosines + count - i, &cosines[ i ] );
+  }
+}
+
+static void addContiguousVec2sSSE2( Vec2* values, const Vec2* addends, u32 count ) {
+  u32 i = 0;
+  for ( ; i + 2 <= count; i += 2 ) {
+    _mm_storeu_ps( &values[ i ].x, _mm_add_ps( _mm_loadu_ps( &values[ i ].x ), _mm_loadu_ps( &addends[ i ].x ) ) );
+  }
+  addContiguousVec2sScalar( &values[ i ], &addends[ i ], count - i );
+}
+
+static void rotateAroundSSE2( Vec2* values, const ComponentIndex* indices, const Vec2* centers,
+                              const float* sines, const float* cosines, u32 count ) {
+  // negates the x of x * cos - y * sin
+  const __m128 signs = _mm_castsi128_ps( _mm_setr_epi32( 0x80000000, 0, 0x80000000, 0 ) );
+  u32 i = 0;
+  for ( ; i + 2 <= count; i += 2 ) {
+    Vec2* a = &values[ indices[ i ] ];
+    Vec2* b = &values[ indices[ i + 1 ] ];
+    if ( a == b ) {
+      rotateAroundScalar( values, &indices[ i ], &centers[ i ], &sines[ i ], &cosines[ i ], 2 );
+      continue;
+    }
+    __m128 center = _mm_loadu_ps( &centers[ i ].x );
+    __m128 vec = _mm_sub_ps( _mm_loadh_pi( _mm_loadl_pi( _mm_setzero_ps(), ( const __m64* )a ), ( const __m64* )b ), center );
+    __m128 swapped = _mm_shuffle_ps( vec, vec, _MM_SHUFFLE( 2, 3, 0, 1 ) );
+    __m128 sinVec = _mm_setr_ps( sines[ i ], sines[ i ], sines[ i + 1 ], sines[ i + 1 ] );
+    __m128 cosVec = _mm_setr_ps( cosines[ i ], cosines[ i ], cosines[ i + 1 ], cosines[ i + 1 ] );
+    __m128 rotated = _mm_add_ps( _mm_mul_ps( vec, cosVec ), _mm_xor_ps( _mm_mul_ps( swapped, sinVec ), signs ) );
+    rotated = _mm_add_ps( rotated, center );
+    _mm_storel_pi( ( __m64* )a, rotated );
+    _mm_storeh_pi( ( __m64* )b, rotated );
+  }
+  rotateAroundScalar( values, &indices[ i ], &centers[ i ], &sines[ i ], &cosines[ i ], count - i );
+}
+
+// A Rect is min.x, min.y, max.x, max.y, so both the minimum and the maximum
+// of whole rects are kept and the result takes its halves from each. Two of
+// each run side by side to hide the latency of min and max.
+static Rect boundsSSE2( const Rect* rects, u32 count ) {
+  __m128 minsA = _mm_set1_ps( INFINITY ), minsB = minsA;
+  __m128 maxsA = _mm_set1_ps( -INFINITY ), maxsB = maxsA;
+  u32 i = 0;
+  for ( ; i + 2 <= count; i += 2 ) {
+    __m128 rectA = _mm_loadu_ps( &rects[ i ].min.x );
+    __m128 rectB = _mm_loadu_ps( &rects[ i + 1 ].min.x );
+    minsA = _mm_min_ps( minsA, rectA );
+    maxsA = _mm_max_ps( maxsA, rectA );
+    minsB = _mm_min_ps( minsB, rectB );
+    maxsB = _mm_max_ps( maxsB, rectB );
+  }
+  if ( i < count ) {
+    __m128 rect = _mm_loadu_ps( &rects[ i ].min.x );
+    minsA = _mm_min_ps( minsA, rect );
+    maxsA = _mm_max_ps( maxsA, rect );
+  }
+  Rect result;
+  _mm_storeu_ps( &result.min.x, _mm_shuffle_ps( _mm_min_ps( minsA, minsB ), _mm_max_ps( maxsA, maxsB ), _MM_SHUFFLE( 3, 2, 1, 0 ) ) );
+  return result;
+}
+
+// whether any two of the 4 indices are the same
+static bool repeats( __m128i indices ) {
+  __m128i byOne = _mm_shuffle_epi32( indices, _MM_SHUFFLE( 0, 3, 2, 1 ) );
+  __m128i byTwo = _mm_shuffle_epi32( indices, _MM_SHUFFLE( 1, 0, 3, 2 ) );
+  return _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi32( indices, byOne ), _mm_cmpeq_epi32( indices, byTwo ) ) ) != 0;
+}
+
+/////////////////////////////////// AVX2 ///////////////////////////////////
+
+// The kernels clear the upper halves of the registers before the scalar
+// tails, GCC doesn't always do it before a tail call, and SSE code running
+// with them dirty is many times slower.
+
+TARGET_AVX2 static void sinCos8( __m256 angles, __m256* sines, __m256* cosines ) {
+  const __m256 signMask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x80000000 ) );
+  __m256 sinSign = _mm256_and_ps( angles, signMask );
+  __m256 x = _mm256_andnot_ps( signMask, angles );
+  __m256i j = _mm256_cvttps_epi32( _mm256_mul_ps( x, _mm256_set1_ps( FOUR_OVER_PI ) ) );
+  j = _mm256_and_si256( _mm256_add_epi32( j, _mm256_set1_epi32( 1 ) ), _mm256_set1_epi32( ~1 ) );
+  __m256 y = _mm256_cvtepi32_ps( j );
+  sinSign = _mm256_xor_ps( sinSign, _mm256_castsi256_ps( _mm256_slli_epi32( _mm256_and_si256( j, _mm256_set1_epi32( 4 ) ), 29 ) ) );
+  __m256 cosSign = _mm256_castsi256_ps( _mm256_slli_epi32( _mm256_andnot_si256( _mm256_sub_epi32( j, _mm256_set1_epi32( 2 ) ),
+                                                                                _mm256_set1_epi32( 4 ) ), 29 ) );
+  __m256 polyMask = _mm256_castsi256_ps( _mm256_cmpeq_epi32( _mm256_and_si256( j, _mm256_set1_epi32( 2 ) ),
+                                                             _mm256_setzero_si256() ) );
+  x = _mm256_fnmadd_ps( y, _mm256_set1_ps( PI_OVER_FOUR_PARTS[ 0 ] ), x );
+  x = _mm256_fnmadd_ps( y, _mm256_set1_ps( PI_OVER_FOUR_PARTS[ 1 ] ), x );
+  x = _mm256_fnmadd_ps( y, _mm256_set1_ps( PI_OVER_FOUR_PARTS[ 2 ] ), x );
+  __m256 z = _mm256_mul_ps( x, x );
+  __m256 cosPoly = _mm256_set1_ps( COS_COEFFICIENTS[ 0 ] );
+  cosPoly = _mm256_fmadd_ps( cosPoly, z, _mm256_set1_ps( COS_COEFFICIENTS[ 1 ] ) );
+  cosPoly = _mm256_fmadd_ps( cosPoly, z, _mm256_set1_ps( COS_COEFFICIENTS[ 2 ] ) );
+  cosPoly = _mm256_mul_ps( _mm256_mul_ps( cosPoly, z ), z );
+  cosPoly = _mm256_add_ps( _mm256_fnmadd_ps( z, _mm256_set1_ps( 0.5f ), cosPoly ), _mm256_set1_ps( 1.0f ) );
+  __m256 sinPoly = _mm256_set1_ps( SIN_COEFFICIENTS[ 0 ] );
+  sinPoly = _mm256_fmadd_ps( sinPoly, z, _mm256_set1_ps( SIN_COEFFICIENTS[ 1 ] ) );
+  sinPoly = _mm256_fmadd_ps( sinPoly, z, _mm256_set1_ps( SIN_COEFFICIENTS[ 2 ] ) );
+  sinPoly = _mm256_fmadd_ps( _mm256_mul_ps( sinPoly, z ), x, x );
+  __m256 sinVec = _mm256_blendv_ps( cosPoly, sinPoly, polyMask );
+  __m256 cosVec = _mm256_blendv_ps( sinPoly, cosPoly, polyMask );
+  *sines = _mm256_xor_ps( sinVec, sinSign );
+  *cosines = _mm256_xor_ps( cosVec, cosSign );
+}
+
+TARGET_AVX2 static void sinCosAVX2( const float* angles, u32 count, float* sines, float* cosines ) {
+  u32 i = 0;
+  __m256 sinVec, cosVec;
+  for ( ; i + 8 <= count; i += 8 ) {
+    sinCos8( _mm256_loadu_ps( &angles[ i ] ), &sinVec, &cosVec );
+    _mm256_storeu_ps( &sines[ i ], sinVec );
+    _mm256_storeu_ps( &cosines[ i ], cosVec );
+  }
+  if ( i < count ) {
+    float padded[ 8 ] = {}, paddedSines[ 8 ], paddedCosines[ 8 ];
+    std::copy( &angles[ i ], &angles[ count ], padded );
+    sinCos8( _mm256_loadu_ps( padded ), &sinVec, &cosVec );
+    _mm256_storeu_ps( paddedSines, sinVec );
+    _mm256_storeu_ps( paddedCosines, cosVec );
+    std::copy( paddedSines, paddedSines + count - i, &sines[ i ] );
+    std::copy( paddedCosines, paddedCosines + count - i, &cosines[ i ] );
+  }
+}
+
+// stores the 4 Vec2 of a register at their indices, in order
+TARGET_AVX2 static void scatter4( Vec2* values, const ComponentIndex* indices, __m256 vecs ) {
+  __m128 low = _mm256_castps256_ps128( vecs );
+  __m128 high = _mm256_extractf128_ps( vecs, 1 );
+  _mm_storel_pi( ( __m64* )&values[ indices[ 0 ] ], low );
+  _mm_storeh_pi( ( __m64* )&values[ indices[ 1 ] ], low );
+  _mm_storel_pi( ( __m64* )&values[ indices[ 2 ] ], high );
+  _mm_storeh_pi( ( __m64* )&values[ indices[ 3 ] ], high );
+}
+
+TARGET_AVX2 static void addContiguousVec2sAVX2( Vec2* values, const Vec2* addends, u32 count ) {
+  u32 i = 0;
+  for ( ; i + 4 <= count; i += 4 ) {
+    _mm256_storeu_ps( &values[ i ].x, _mm256_add_ps( _mm256_loadu_ps( &values[ i ].x ), _mm256_loadu_ps( &addends[ i ].x ) ) );
+  }
+  _mm256_zeroupper();
+  addContiguousVec2sScalar( &values[ i ], &addends[ i ], count - i );
+}
+
+TARGET_AVX2 static void rotateAroundAVX2( Vec2* values, const ComponentIndex* indices, const Vec2* centers,
+                                          const float* sines, const float* cosines, u32 count ) {
+  // each sine and cosine twice, for x and y
+  const __m256i duplicate = _mm256_setr_epi32( 0, 0, 1, 1, 2, 2, 3, 3 );
+  // the masked gather with every lane on, the unmasked one leaves GCC warning
+  // about its uninitialized source
+  const __m256d allLanes = _mm256_castsi256_pd( _mm256_set1_epi64x( -1 ) );
+  u32 i = 0;
+  for ( ; i + 4 <= count; i += 4 ) {
+    __m128i gathered = _mm_loadu_si128( ( const __m128i* )&indices[ i ] );
+    if ( repeats( gathered ) ) {
+      rotateAroundScalar( values, &indices[ i ], &centers[ i ], &sines[ i ], &cosines[ i ], 4 );
+      continue;
+    }
+    __m256 center = _mm256_loadu_ps( &centers[ i ].x );
+    __m256d points = _mm256_mask_i32gather_pd( _mm256_setzero_pd(), ( const double* )values, gathered, allLanes, 8 );
+    __m256 vec = _mm256_sub_ps( _mm256_castpd_ps( points ), center );
+    __m256 swapped = _mm256_permute_ps( vec, _MM_SHUFFLE( 2, 3, 0, 1 ) );
+    __m256 sinVec = _mm256_permutevar8x32_ps( _mm256_castps128_ps256( _mm_loadu_ps( &sines[ i ] ) ), duplicate );
+    __m256 cosVec = _mm256_permutevar8x32_ps( _mm256_castps128_ps256( _mm_loadu_ps( &cosines[ i ] ) ), duplicate );
+    // x * cos - y * sin, y * cos + x * sin
+    __m256 rotated = _mm256_addsub_ps( _mm256_mul_ps( vec, cosVec ), _mm256_mul_ps( swapped, sinVec ) );
+    scatter4( values, &indices[ i ], _mm256_add_ps( rotated, center ) );
+  }
+  _mm256_zeroupper();
+  rotateAroundScalar( values, &indices[ i ], &centers[ i ], &sines[ i ], &cosines[ i ], count - i );
+}
+
+// as boundsSSE2(), two rects per register
+TARGET_AVX2 static Rect boundsAVX2( const Rect* rects, u32 count ) {
+  __m256 minsA = _mm256_set1_ps( INFINITY ), minsB = minsA;
+  __m256 maxsA = _mm256_set1_ps( -INFINITY ), maxsB = maxsA;
+  u32 i = 0;
+  for ( ; i + 4 <= count; i += 4 ) {
+    __m256 rectsA = _mm256_loadu_ps( &rects[ i ].min.x );
+    __m256 rectsB = _mm256_loadu_ps( &rects[ i + 2 ].min.x );
+    minsA = _mm256_min_ps( minsA, rectsA );
+    maxsA = _mm256_max_ps( maxsA, rectsA );
+    minsB = _mm256_min_ps( minsB, rectsB );
+    maxsB = _mm256_max_ps( maxsB, rectsB );
+  }
+  __m256 mins = _mm256_min_ps( minsA, minsB ), maxs = _mm256_max_ps( maxsA, maxsB );
+  __m128 min = _mm_min_ps( _mm256_castps256_ps128( mins ), _mm256_extractf128_ps( mins, 1 ) );
+  __m128 max = _mm_max_ps( _mm256_castps256_ps128( maxs ), _mm256_extractf128_ps( maxs, 1 ) );
+  _mm256_zeroupper();
+  Rect tail = boundsSSE2( &rects[ i ], count - i );
+  min = _mm_min_ps( min, _mm_loadu_ps( &tail.min.x ) );
+  max = _mm_max_ps( max, _mm_loadu_ps( &tail.min.x ) );
+  Rect result;
+  _mm_storeu_ps( &result.min.x, _mm_shuffle_ps( min, max, _MM_SHUFFLE( 3, 2, 1, 0 ) ) );
+  return result;
+}
+
+// The indexed adds stay scalar: gathers measured no faster than the scalar
+// loads and there is no scatter, so they only added the repeat checks.
+const SIMD::Kernels SIMD::KERNELS[ NUM_LEVELS ] = {
+  { &sinCosScalar, &addFloatsScalar, &addVec2sScalar, &addContiguousVec2sScalar, &rotateAroundScalar, &boundsScalar },
+  { &sinCosSSE2, &addFloatsScalar, &addVec2sScalar, &addContiguousVec2sSSE2, &rotateAroundSSE2, &boundsSSE2 },
+  { &sinCosAVX2, &addFloatsScalar, &addVec2sScalar, &addContiguousVec2sAVX2, &rotateAroundAVX2, &boundsAVX2 }
+};
+
+#else
+
+const SIMD::Kernels SIMD::KERNELS[ NUM_LEVELS ] = {
+  { &sinCosScalar, &addFloatsScalar, &addVec2sScalar, &addContiguousVec2sScalar, &rotateAroundScalar, &boundsScalar },
+  { &sinCosScalar, &addFloatsScalar, &addVec2sScalar, &addContiguousVec2sScalar, &rotateAroundScalar, &boundsScalar },
+  { &sinCosScalar, &addFloatsScalar, &addVec2sScalar, &addContiguousVec2sScalar, &rotateAroundScalar, &boundsScalar }
+};
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+
+void SIMD::initialize() {
+  level = SCALAR;
+  for ( u32 levelInd = NUM_LEVELS - 1; levelInd > SCALAR; --levelInd ) {
+    if ( setLevel( ( Level )levelInd ) ) {
+      break;
+    }
+  }
+  Debug::write( "Using %s transform kernels.\n", LEVEL_NAMES[ level ] );
+}
+
+SIMD::Level SIMD::getLevel() {
+  return level;
+}
+
+bool SIMD::setLevel( Level newLevel ) {
+  bool supported = newLevel == SCALAR;
+#ifdef X86_64
+  __builtin_cpu_init();
+  supported = supported || newLevel == SSE2 ||
+              ( newLevel == AVX2 && __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) );
+#endif
+  if ( supported ) {
+    level = newLevel;
+  }
+  return supported;
+}
+
+void SIMD::sinCos( const float* angles, u32 count, float* sines, float* cosines ) {
+  KERNELS[ level ].sinCos( angles, count, sines, cosines );
+}
+
+void SIMD::add( float* values, const ComponentIndex* indices, const float* addends, u32 count ) {
+  KERNELS[ level ].addFloats( values, indices, addends, count );
+}
+
+void SIMD::add( Vec2* values, const ComponentIndex* indices, const Vec2* addends, u32 count ) {
+  KERNELS[ level ].addVec2s( values, indices, addends, count );
+}
+
+void SIMD::add( Vec2* values, const Vec2* addends, u32 count ) {
+  KERNELS[ level ].addContiguousVec2s( values, addends, count );
+}
+
+void SIMD::rotateAround( Vec2* values, const ComponentIndex* indices, const Vec2* centers,
+                         const float* sines, const float* cosines, u32 count ) {
+  KERNELS[ level ].rotateAround( values, indices, centers, sines, cosines, count );
+}
+
+Rect SIMD::bounds( const Rect* rects, u32 count ) {
+  return KERNELS[ level ].bounds( rects, count );
+}
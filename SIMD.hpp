@@ -0,0 +1,39 @@
+#pragma once
+
+// Batch kernels for the transform and collider operations, in SSE2 and AVX2 versions
+// where they beat the scalar loop, picked at runtime from what the CPU
+// supports. The indexed ones give the same result as a plain loop over
+// values[ indices[ i ] ], even with repeated indices.
+class SIMD {
+public:
+  enum Level { SCALAR, SSE2, AVX2, NUM_LEVELS };
+  static const char* LEVEL_NAMES[ NUM_LEVELS ];
+  // picks the best level the CPU supports
+  static void initialize();
+  static Level getLevel();
+  // false if the CPU doesn't support it, for comparing the kernels
+  static bool setLevel( Level level );
+  // The vector levels approximate them with polynomials, within about 1e-7 of
+  // the scalar sin and cos for angles up to 8192 radians.
+  static void sinCos( const float* angles, u32 count, float* sines, float* cosines );
+  static void add( float* values, const ComponentIndex* indices, const float* addends, u32 count );
+  static void add( Vec2* values, const ComponentIndex* indices, const Vec2* addends, u32 count );
+  static void add( Vec2* values, const Vec2* addends, u32 count );
+  // rotate each point around the center by the angle of the given sine and cosine
+  static void rotateAround( Vec2* values, const ComponentIndex* indices, const Vec2* centers,
+                            const float* sines, const float* cosines, u32 count );
+  // the smallest rect containing all of them, min above max if there are none
+  static Rect bounds( const Rect* rects, u32 count );
+private:
+  struct Kernels {
+    void ( *sinCos )( const float* angles, u32 count, float* sines, float* cosines );
+    void ( *addFloats )( float* values, const ComponentIndex* indices, const float* addends, u32 count );
+    void ( *addVec2s )( Vec2* values, const ComponentIndex* indices, const Vec2* addends, u32 count );
+    void ( *addContiguousVec2s )( Vec2* values, const Vec2* addends, u32 count );
+    void ( *rotateAround )( Vec2* values, const ComponentIndex* indices, const Vec2* centers,
+                            const float* sines, const float* cosines, u32 count );
+    Rect ( *bounds )( const Rect* rects, u32 count );
+  };
+  static const Kernels KERNELS[ NUM_LEVELS ];
+  static Level level;
+};
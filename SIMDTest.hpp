@@ -0,0 +1,215 @@
+#pragma once
+
+#include "EngineCommon.hpp"
+
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+// Times the transform kernels and the collider bounds at every SIMD level
+// the CPU supports, from 1k to 1M elements, on their own and inside
+// TransformManager's batch operations, which also validate the indices and record the changes, and
+// translating by entity handle in shuffled batches and one at a time.
+class SIMDTest {
+  static constexpr const u32 NUM_SIZES = 4;
+  static constexpr const u32 ELEMENT_COUNTS[ NUM_SIZES ] = { 1000, 10000, 100000, 1000000 };
+  // elements per measurement, whatever the size
+  static constexpr const u32 ELEMENTS_TIMED = 10000000;
+  static constexpr const u32 NUM_CHECKED_ROTATIONS = 1000;
+  static constexpr const u32 NUM_OPERATIONS = 6;
+  static constexpr const char* OPERATION_NAMES[ NUM_OPERATIONS ] = {
+    "sinCos", "rotate", "translate", "translate contiguous", "rotateAround", "bounds" };
+  static double benchmarkKernel( u32 operation, u32 elementCount );
+  static double benchmarkManager( u32 operation, const std::vector< ComponentIndex >& indices );
+  static void benchmarkHandles( const std::vector< EntityHandle >& entities );
+public:
+  static void run();
+};
+
+constexpr const u32 SIMDTest::ELEMENT_COUNTS[];
+constexpr const char* SIMDTest::OPERATION_NAMES[];
+
+// in ns per element, at the current level
+double SIMDTest::benchmarkKernel( u32 operation, u32 elementCount ) {
+  std::vector< Vec2 > positions( elementCount + 1, VEC2_ONE );
+  std::vector< float > orientations( elementCount + 1, 0.0f );
+  std::vector< ComponentIndex > indices( elementCount );
+  std::vector< Vec2 > translations( elementCount ), centers( elementCount );
+  std::vector< float > angles( elementCount ), sines( elementCount ), cosines( elementCount );
+  std::vector< Rect > rects( elementCount );
+  for ( u32 i = 0; i < elementCount; ++i ) {
+    indices[ i ] = i + 1;
+    translations[ i ] = { 0.001f, -0.001f };
+    centers[ i ] = { 0.5f, 0.5f };
+    angles[ i ] = ( std::rand() % 1000 ) / 100.0f - 5.0f;
+    rects[ i ].min = { angles[ i ], -angles[ i ] };
+    rects[ i ].max = rects[ i ].min + VEC2_ONE;
+  }
+  u32 repetitions = std::max( 1u, ELEMENTS_TIMED / elementCount );
+  TimePoint start = Clock::now();
+  for ( u32 repetition = 0; repetition < repetitions; ++repetition ) {
+    switch ( operation ) {
+    case 0:
+      SIMD::sinCos( angles.data(), elementCount, sines.data(), cosines.data() );
+      break;
+    case 1:
+      SIMD::add( orientations.data(), indices.data(), angles.data(), elementCount );
+      break;
+    case 2:
+      SIMD::add( positions.data(), indices.data(), translations.data(), elementCount );
+      break;
+    case 3:
+      SIMD::add( &positions[ 1 ], translations.data(), elementCount );
+      break;
+    case 4:
+      SIMD::sinCos( angles.data(), elementCount, sines.data(), cosines.data() );
+      SIMD::add( orientations.data(), indices.data(), angles.data(), elementCount );
+      SIMD::rotateAround( positions.data(), indices.data(), centers.data(), sines.data(), cosines.data(), elementCount );
+      break;
+    case 5:
+      SIMD::bounds( rects.data(), elementCount );
+      break;
+    }
+  }
+  u64 nanos = elapsedNanos( start );
+  return nanos / ( double )repetitions / elementCount;
+}
+
+double SIMDTest::benchmarkManager( u32 operation, const std::vector< ComponentIndex >& indices ) {
+  u32 elementCount = indices.size();
+  std::vector< float > rotations( elementCount, 0.01f );
+  std::vector< Vec2 > translations( elementCount, { 0.001f, -0.001f } );
+  std::vector< std::pair< Vec2, float > > aroundRotations( elementCount, { { 0.5f, 0.5f }, 0.01f } );
+  u32 repetitions = std::max( 1u, ELEMENTS_TIMED / elementCount / 10 );
+  TimePoint start = Clock::now();
+  for ( u32 repetition = 0; repetition < repetitions; ++repetition ) {
+    switch ( operation ) {
+    case 1:
+      TransformManager::rotate( indices, rotations );
+      break;
+    case 2:
+      TransformManager::translate( indices, translations );
+      break;
+    case 3:
+      TransformManager::translate( indices[ 0 ] & COMPONENT_INDEX_MASK, translations );
+      break;
+    case 4:
+      TransformManager::rotateAround( indices, aroundRotations );
+      break;
+    }
+    // the changes recorded are what a frame would see
+    EntityManager::flushDeferred();
+  }
+  u64 nanos = elapsedNanos( start );
+  return nanos / ( double )repetitions / elementCount;
+}
+
+// at the best level, in ns per element
+void SIMDTest::benchmarkHandles( const std::vector< EntityHandle >& entities ) {
+  u32 elementCount = entities.size();
+  std::vector< EntityHandle > shuffled( entities );
+  std::random_shuffle( shuffled.begin(), shuffled.end() );
+  std::vector< Vec2 > translations( elementCount, { 0.001f, -0.001f } );
+  u32 repetitions = std::max( 1u, ELEMENTS_TIMED / elementCount / 10 );
+  double nanos[ 3 ];
+  for ( u32 way = 0; way < 3; ++way ) {
+    TimePoint start = Clock::now();
+    for ( u32 repetition = 0; repetition < repetitions; ++repetition ) {
+      if ( way == 0 ) {
+        // what the caller had to do before
+        LookupResult lookupResult;
+        TransformManager::lookup( shuffled, &lookupResult );
+        TransformManager::translate( lookupResult.indices, translations );
+      } else if ( way == 1 ) {
+        TransformManager::translate( shuffled, translations );
+      } else {
+        for ( u32 i = 0; i < elementCount; ++i ) {
+          TransformManager::translate( shuffled[ i ], translations[ i ] );
+        }
+      }
+      EntityManager::flushDeferred();
+    }
+    nanos[ way ] = elapsedNanos( start );
+  }
+  Debug::write( "%7d translate by entity ns/element: lookup then by index %.2f, batch %.2f, one at a time %.2f\n",
+                elementCount, nanos[ 0 ] / repetitions / elementCount, nanos[ 1 ] / repetitions / elementCount,
+                nanos[ 2 ] / repetitions / elementCount );
+}
+
+void SIMDTest::run() {
+  Debug::write( "Running SIMD transform kernel benchmark...\n" );
+  SIMD::Level bestLevel = SIMD::getLevel();
+  // the vector sinCos against the scalar one
+  std::vector< float > angles, sines[ SIMD::NUM_LEVELS ], cosines[ SIMD::NUM_LEVELS ];
+  std::vector< Vec2 > rotated[ SIMD::NUM_LEVELS ];
+  for ( float angle = -100.0f; angle < 100.0f; angle += 0.001f ) {
+    angles.push_back( angle );
+  }
+  for ( u32 level = 0; level < SIMD::NUM_LEVELS; ++level ) {
+    if ( SIMD::setLevel( ( SIMD::Level )level ) ) {
+      sines[ level ].resize( angles.size() );
+      cosines[ level ].resize( angles.size() );
+      SIMD::sinCos( angles.data(), angles.size(), sines[ level ].data(), cosines[ level ].data() );
+      float maxError = 0.0f;
+      for ( u32 i = 0; i < angles.size(); ++i ) {
+        maxError = std::max( maxError, std::abs( sines[ level ][ i ] - sines[ SIMD::SCALAR ][ i ] ) );
+        maxError = std::max( maxError, std::abs( cosines[ level ][ i ] - cosines[ SIMD::SCALAR ][ i ] ) );
+      }
+      ASSERT( maxError < 1.0e-6f, "%s sinCos off by %g", SIMD::LEVEL_NAMES[ level ], maxError );
+      Debug::write( "%s sinCos largest error %g\n", SIMD::LEVEL_NAMES[ level ], maxError );
+      // the same rotations, each index 10 times, must end up exactly where the scalar loop puts them
+      std::vector< Vec2 > centers( NUM_CHECKED_ROTATIONS, { 0.5f, -0.5f } );
+      std::vector< ComponentIndex > indices( NUM_CHECKED_ROTATIONS );
+      for ( u32 i = 0; i < NUM_CHECKED_ROTATIONS; ++i ) {
+        indices[ i ] = 1 + ( i * 7 ) % ( NUM_CHECKED_ROTATIONS / 10 );
+      }
+      rotated[ level ].assign( NUM_CHECKED_ROTATIONS / 10 + 1, VEC2_ONE );
+      SIMD::rotateAround( rotated[ level ].data(), indices.data(), centers.data(),
+                          sines[ SIMD::SCALAR ].data(), cosines[ SIMD::SCALAR ].data(), NUM_CHECKED_ROTATIONS );
+      ASSERT( rotated[ level ] == rotated[ SIMD::SCALAR ], "%s rotateAround differs from the scalar loop", SIMD::LEVEL_NAMES[ level ] );
+      // every count, for the tails, of rects spread around by the angles
+      for ( u32 count = 0; count < 10; ++count ) {
+        std::vector< Rect > rects( count );
+        for ( u32 i = 0; i < count; ++i ) {
+          rects[ i ] = { { angles[ i * 997 ], sines[ SIMD::SCALAR ][ i * 997 ] }, { angles[ i * 997 ] + 1.0f, 1.0f } };
+        }
+        Rect bounds = SIMD::bounds( rects.data(), count );
+        SIMD::setLevel( SIMD::SCALAR );
+        Rect scalarBounds = SIMD::bounds( rects.data(), count );
+        SIMD::setLevel( ( SIMD::Level )level );
+        ASSERT( bounds.min == scalarBounds.min && bounds.max == scalarBounds.max,
+                "%s bounds differ from the scalar loop", SIMD::LEVEL_NAMES[ level ] );
+      }
+    }
+  }
+  for ( u32 sizeInd = 0; sizeInd < NUM_SIZES; ++sizeInd ) {
+    u32 elementCount = ELEMENT_COUNTS[ sizeInd ];
+    std::vector< EntityHandle > entities;
+    EntityManager::createBatch( elementCount, &entities );
+    for ( u32 i = 0; i < elementCount; ++i ) {
+      TransformManager::set( entities[ i ], { {}, VEC2_ONE, 0.0f } );
+    }
+    LookupResult lookupResult;
+    TransformManager::lookup( entities, &lookupResult );
+    for ( u32 operation = 0; operation < NUM_OPERATIONS; ++operation ) {
+      Debug::write( "%7d %-20s ns/element:", elementCount, OPERATION_NAMES[ operation ] );
+      for ( u32 level = 0; level < SIMD::NUM_LEVELS; ++level ) {
+        if ( !SIMD::setLevel( ( SIMD::Level )level ) ) {
+          continue;
+        }
+        Debug::write( " %s %.2f", SIMD::LEVEL_NAMES[ level ], benchmarkKernel( operation, elementCount ) );
+        // translating contiguous components needs them to be, as in a group
+        bool contiguous = ( lookupResult.indices.back() & COMPONENT_INDEX_MASK ) -
+                          ( lookupResult.indices.front() & COMPONENT_INDEX_MASK ) == elementCount - 1;
+        if ( operation > 0 && operation < 5 && ( operation != 3 || contiguous ) ) {
+          Debug::write( " (%.2f in TransformManager)", benchmarkManager( operation, lookupResult.indices ) );
+        }
+      }
+      Debug::write( "\n" );
+    }
+    SIMD::setLevel( bestLevel );
+    benchmarkHandles( entities );
+    EntityManager::destroyBatch( entities );
+  }
+  SIMD::setLevel( bestLevel );
+}
@@ -0,0 +1,37 @@
+#include "EngineCommon.hpp"
+
+double Scheduler::stepDuration = 1.0 / 30.0;
+u32 Scheduler::maxStepsPerFrame = 1;
+double Scheduler::accumulated = 0.0;
+
+void Scheduler::initialize( double stepsPerSecond, u32 maxStepsPerFrame ) {
+  ASSERT( stepsPerSecond > 0.0, "Invalid simulation rate %f", stepsPerSecond );
+  ASSERT( maxStepsPerFrame > 0, "The simulation needs at least one step per frame" );
+  stepDuration = 1.0 / stepsPerSecond;
+  Scheduler::maxStepsPerFrame = maxStepsPerFrame;
+  // the first frame gets a step, so there is a state to render
+  accumulated = stepDuration;
+}
+
+void Scheduler::shutdown() {
+}
+
+u32 Scheduler::advance( double deltaT ) {
+  accumulated += deltaT;
+  u32 steps = ( u32 )( accumulated / stepDuration );
+  if ( steps > maxStepsPerFrame ) {
+    steps = maxStepsPerFrame;
+    accumulated = fmod( accumulated, stepDuration );
+  } else {
+    accumulated -= steps * stepDuration;
+  }
+  return steps;
+}
+
+double Scheduler::getStepDuration() {
+  return stepDuration;
+}
+
+float Scheduler::getInterpolation() {
+  return ( float )( accumulated / stepDuration );
+}
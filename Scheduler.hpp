@@ -0,0 +1,19 @@
+#pragma once
+
+// Fixed timestep for the simulation, decoupled from the render rate.
+// The frame time accumulates and is spent in whole steps; whatever is
+// left is how far the rendered frame is into the next step.
+class Scheduler {
+  static double stepDuration;
+  static u32 maxStepsPerFrame;
+  static double accumulated;
+public:
+  static void initialize( double stepsPerSecond, u32 maxStepsPerFrame );
+  static void shutdown();
+  // how many steps to run for the frame time that passed; the time of the
+  // ones over the cap is dropped so a slow frame doesn't snowball
+  static u32 advance( double deltaT );
+  static double getStepDuration();
+  // from 0 at the last step to 1 at the next one
+  static float getInterpolation();
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "EngineCommon.hpp"
+
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+// Saves a world of a million entities to a snapshot and loads it back, checks
+// damaged snapshots are refused, and captures every frame of a running
+// simulation then restores some of them.
+class SnapshotTest {
+  static constexpr const u32 NUM_SNAPSHOT_ENTITIES = 1000000;
+  static constexpr const char* SNAPSHOT_PATH = "SnapshotTest.snapshot";
+  static constexpr const u32 NUM_HISTORY_ENTITIES = 10000;
+  static constexpr const u32 NUM_HISTORY_FRAMES = 300;
+  static constexpr const u32 NUM_DAMAGED_ENTITIES = 1000;
+  static double sumPositions( const std::vector< EntityHandle >& entities );
+  // writes the first size bytes of snapshot, with the u32 at offset set to
+  // value unless offset is past them
+  static void writeDamaged( const std::vector< u8 >& snapshot, u32 size, u32 offset, u32 value );
+public:
+  // build a world one entity at a time, then save it and load it back
+  static void run();
+  // snapshots cut short, too long or with wrong counts must be refused,
+  // leaving the world as it was
+  static void runDamaged();
+  // simulate with every frame captured, then go back to some of the ones
+  // kept, the history must have been initialized with room for a few frames
+  // of its 10k entities, about 1 MB each
+  static void runHistory();
+};
+
+constexpr const char* SnapshotTest::SNAPSHOT_PATH;
+
+void SnapshotTest::run() {
+  Debug::write( "Running world snapshot benchmark...\n" );
+  std::vector< EntityHandle > entities;
+  entities.reserve( NUM_SNAPSHOT_ENTITIES );
+  TimePoint start = Clock::now();
+  for ( u32 i = 0; i < NUM_SNAPSHOT_ENTITIES; ++i ) {
+    EntityHandle entity = EntityManager::create();
+    entities.push_back( entity );
+    Vec2 position = { ( std::rand() % 800 ) - 400.0f, ( std::rand() % 460 ) - 230.0f };
+    TransformManager::set( entity, { position, VEC2_ONE, 0.0f } );
+    ColliderManager::addCircle( entity, { {}, 1.0f } );
+    SolidBodyManager::set( entity, { { 1.0f, 1.0f } } );
+  }
+  u64 buildNanos = elapsedNanos( start );
+  ComponentMemory built = TransformManager::getMemoryUsage();
+  start = Clock::now();
+  bool saved = EntityManager::saveSnapshot( SNAPSHOT_PATH );
+  u64 saveNanos = elapsedNanos( start );
+  ASSERT( saved, "Couldn't save snapshot %s", SNAPSHOT_PATH );
+  EntityManager::destroyBatch( entities );
+  start = Clock::now();
+  bool loaded = EntityManager::loadSnapshot( SNAPSHOT_PATH );
+  u64 loadNanos = elapsedNanos( start );
+  ASSERT( loaded, "Couldn't load snapshot %s", SNAPSHOT_PATH );
+#ifdef NDEBUG
+  UNUSED( saved );
+  UNUSED( loaded );
+#endif
+  // every entity must be back with its components
+  LookupResult lookupResult;
+  TransformManager::lookup( entities, &lookupResult );
+  ASSERT( lookupResult.indices.size() == NUM_SNAPSHOT_ENTITIES, "%d transforms loaded", ( u32 )lookupResult.indices.size() );
+  ComponentMemory restored = TransformManager::getMemoryUsage();
+  ASSERT( restored.indexBytes <= built.indexBytes, "Transform index grew from %lu to %lu bytes",
+          built.indexBytes, restored.indexBytes );
+  UNUSED( built );
+  UNUSED( restored );
+  FILE* file = fopen( SNAPSHOT_PATH, "rb" );
+  fseek( file, 0, SEEK_END );
+  double megabytes = ftell( file ) / 1.0e6;
+  fclose( file );
+  std::remove( SNAPSHOT_PATH );
+  Debug::write( "%d entities: built one by one in %.2f ms, saved in %.2f ms, loaded in %.2f ms (%.2f MB, %.2f GB/s)\n",
+                NUM_SNAPSHOT_ENTITIES, buildNanos / 1.0e6, saveNanos / 1.0e6, loadNanos / 1.0e6,
+                megabytes, megabytes / 1.0e3 / ( loadNanos / 1.0e9 ) );
+  EntityManager::destroyBatch( entities );
+}
+
+void SnapshotTest::writeDamaged( const std::vector< u8 >& snapshot, u32 size, u32 offset, u32 value ) {
+  std::vector< u8 > damaged( snapshot.begin(), snapshot.begin() + std::min( size, ( u32 )snapshot.size() ) );
+  damaged.resize( size, 0 );
+  if ( offset + sizeof( u32 ) <= size ) {
+    std::memcpy( &damaged[ offset ], &value, sizeof( u32 ) );
+  }
+  FILE* file = fopen( SNAPSHOT_PATH, "wb" );
+  fwrite( damaged.data(), 1, damaged.size(), file );
+  fclose( file );
+}
+
+void SnapshotTest::runDamaged() {
+  Debug::write( "Running damaged snapshot test...\n" );
+  std::vector< EntityHandle > entities;
+  EntityManager::createBatch( NUM_DAMAGED_ENTITIES, &entities );
+  for ( u32 i = 0; i < NUM_DAMAGED_ENTITIES; ++i ) {
+    Vec2 position = { ( std::rand() % 800 ) - 400.0f, ( std::rand() % 460 ) - 230.0f };
+    TransformManager::set( entities[ i ], { position, VEC2_ONE, 0.0f } );
+    ColliderManager::addCircle( entities[ i ], { {}, 1.0f } );
+  }
+  bool saved = EntityManager::saveSnapshot( SNAPSHOT_PATH );
+  ASSERT( saved, "Couldn't save snapshot %s", SNAPSHOT_PATH );
+  UNUSED( saved );
+  FILE* file = fopen( SNAPSHOT_PATH, "rb" );
+  fseek( file, 0, SEEK_END );
+  std::vector< u8 > snapshot( ftell( file ) );
+  fseek( file, 0, SEEK_SET );
+  size_t read = fread( snapshot.data(), 1, snapshot.size(), file );
+  fclose( file );
+  ASSERT( read == snapshot.size(), "Read %d bytes of snapshot %s", ( u32 )read, SNAPSHOT_PATH );
+  UNUSED( read );
+  u32 size = snapshot.size();
+  // offsets of the entity, free index, group and view counts in the header
+  struct Damage {
+    const char* name;
+    u32 size, offset, value;
+  } damages[] = {
+    { "cut after the header", 7 * sizeof( u32 ), size, 0 },
+    { "cut in half", size / 2, size, 0 },
+    { "one byte short", size - 1, size, 0 },
+    { "one byte too long", size + 1, size, 0 },
+    { "too many entities", size, 8, MAX_ENTITIES },
+    { "more free indices than entities", size, 12, NUM_DAMAGED_ENTITIES + 2 },
+    { "too many groups", size, 20, 1000 },
+    { "an extra view", size, 24, 1000 },
+  };
+  double sum = sumPositions( entities );
+  u32 refused = 0;
+  for ( const Damage& damage : damages ) {
+    writeDamaged( snapshot, damage.size, damage.offset, damage.value );
+    bool loaded = EntityManager::loadSnapshot( SNAPSHOT_PATH );
+    ASSERT( !loaded, "Snapshot %s loaded", damage.name );
+    refused += !loaded;
+    double sumAfter = sumPositions( entities );
+    ASSERT( sumAfter == sum, "Snapshot %s changed the world", damage.name );
+    UNUSED( sumAfter );
+  }
+  std::remove( SNAPSHOT_PATH );
+  Debug::write( "%d of %d damaged snapshots refused\n", refused, ( u32 )( sizeof( damages ) / sizeof( damages[ 0 ] ) ) );
+  EntityManager::destroyBatch( entities );
+}
+
+double SnapshotTest::sumPositions( const std::vector< EntityHandle >& entities ) {
+  LookupResult lookupResult;
+  TransformManager::lookup( entities, &lookupResult );
+  std::vector< Transform > transforms;
+  TransformManager::get( lookupResult.indices, &transforms );
+  double sum = 0.0;
+  for ( u32 i = 0; i < transforms.size(); ++i ) {
+    sum += transforms[ i ].position.x * 3.0 + transforms[ i ].position.y;
+  }
+  return sum;
+}
+
+void SnapshotTest::runHistory() {
+  Debug::write( "Running world history benchmark...\n" );
+  std::vector< EntityHandle > entities;
+  EntityManager::createBatch( NUM_HISTORY_ENTITIES, &entities );
+  for ( u32 i = 0; i < NUM_HISTORY_ENTITIES; ++i ) {
+    // far enough from the edges not to leave the quadtree in the frames simulated
+    Vec2 position = { ( std::rand() % 700 ) - 350.0f, ( std::rand() % 360 ) - 180.0f };
+    TransformManager::set( entities[ i ], { position, VEC2_ONE, 0.0f } );
+    ColliderManager::addCircle( entities[ i ], { {}, 1.0f } );
+    Vec2 direction = normalized( { ( std::rand() % 200 ) - 100.0f, ( std::rand() % 200 ) - 100.0f } );
+    SolidBodyManager::set( entities[ i ], { direction * 5.0f } );
+  }
+  std::vector< u32 > frames;
+  std::vector< double > sums;
+  u64 captureNanos = 0, maxCaptureNanos = 0;
+  for ( u32 i = 0; i < NUM_HISTORY_FRAMES; ++i ) {
+    ColliderManager::updateAndCollide();
+    SolidBodyManager::update( 1.0 / 30.0 );
+    EntityManager::flushDeferred();
+    TimePoint start = Clock::now();
+    u32 frame = EntityManager::captureFrame();
+    u64 nanos = elapsedNanos( start );
+    ASSERT( frame != EntityManager::NO_FRAME, "Frame %d of %d entities not captured", i, NUM_HISTORY_ENTITIES );
+    frames.push_back( frame );
+    captureNanos += nanos;
+    maxCaptureNanos = std::max( maxCaptureNanos, nanos );
+    sums.push_back( sumPositions( entities ) );
+  }
+  // newest to oldest, so every restore has the frame still kept
+  u32 oldest = EntityManager::getOldestFrame();
+  u32 kept = 0;
+  while ( kept < frames.size() && frames[ frames.size() - 1 - kept ] != EntityManager::NO_FRAME &&
+          frames[ frames.size() - 1 - kept ] >= oldest ) {
+    ++kept;
+  }
+  ASSERT( kept > 0, "No frame of %d entities kept", NUM_HISTORY_ENTITIES );
+  u32 restored = 0;
+  u64 restoreNanos = 0;
+  for ( u32 back = 1; back <= kept; back *= 2 ) {
+    u32 i = NUM_HISTORY_FRAMES - back;
+    TimePoint start = Clock::now();
+    bool restoredFrame = EntityManager::restore( frames[ i ] );
+    restoreNanos += elapsedNanos( start );
+    ASSERT( restoredFrame, "Frame %d not restored, %d frames back of the %d kept", frames[ i ], back, kept );
+    UNUSED( restoredFrame );
+    ++restored;
+    double sum = sumPositions( entities );
+    ASSERT( sum == sums[ i ], "Frame %d restored with sum %f instead of %f", frames[ i ], sum, sums[ i ] );
+    UNUSED( sum );
+  }
+  Debug::write( "%d entities: capture %.3f ms on average, %.3f ms at most, %d frames kept, %d of them restored in %.3f ms on average\n",
+                NUM_HISTORY_ENTITIES, captureNanos / 1.0e6 / NUM_HISTORY_FRAMES, maxCaptureNanos / 1.0e6, kept,
+                restored, restored > 0 ? restoreNanos / 1.0e6 / restored : 0.0 );
+  // the same world with a tenth of it moving and an entity respawned every
+  // frame, the frames captured only hold what changed
+  std::vector< EntityHandle > stopped( entities.begin() + NUM_HISTORY_ENTITIES / 10, entities.end() );
+  SolidBodyManager::removeBatch( stopped );
+  captureNanos = 0;
+  maxCaptureNanos = 0;
+  for ( u32 i = 0; i < NUM_HISTORY_FRAMES; ++i ) {
+    u32 respawned = NUM_HISTORY_ENTITIES / 10 + i;
+    EntityManager::destroy( entities[ respawned ] );
+    entities[ respawned ] = EntityManager::create();
+    Vec2 position = { ( std::rand() % 700 ) - 350.0f, ( std::rand() % 360 ) - 180.0f };
+    TransformManager::set( entities[ respawned ], { position, VEC2_ONE, 0.0f } );
+    ColliderManager::addCircle( entities[ respawned ], { {}, 1.0f } );
+    ColliderManager::updateAndCollide();
+    SolidBodyManager::update( 1.0 / 30.0 );
+    EntityManager::flushDeferred();
+    TimePoint start = Clock::now();
+    u32 frame = EntityManager::captureFrame();
+    u64 nanos = elapsedNanos( start );
+    ASSERT( frame != EntityManager::NO_FRAME, "Frame %d of %d entities not captured", i, NUM_HISTORY_ENTITIES );
+    UNUSED( frame );
+    captureNanos += nanos;
+    maxCaptureNanos = std::max( maxCaptureNanos, nanos );
+  }
+  Debug::write( "%d entities, a tenth moving and one respawned each frame: capture %.3f ms on average, %.3f ms at most\n",
+                NUM_HISTORY_ENTITIES, captureNanos / 1.0e6 / NUM_HISTORY_FRAMES, maxCaptureNanos / 1.0e6 );
+  EntityManager::destroyBatch( entities );
+}
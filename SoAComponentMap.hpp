@@ -0,0 +1,546 @@
+#pragma once
+
+#include <tuple>
+#include <algorithm>
+
+// Same as ComponentMap, but every field of the component is stored in its own
+// array, or column, so an operation that only needs some of the fields only
+// brings those into the cache. The fields are declared as the list of
+// template arguments and are accessed by their position in it, e.g. with
+//   SoAComponentMap< Vec2, float > map;
+// map.column< 0 >() is the std::vector< Vec2 > of the first field. The entity
+// of every component has its own column too. Index 0 of every column is null.
+// Columns are read only, writes go through change(), changeColumn() or at(),
+// which mark what they change for the history.
+template< typename... Fields >
+struct SoAComponentMap {
+  typedef std::tuple< Fields... > Values;
+  template< u32 Field >
+  using FieldType = typename std::tuple_element< Field, Values >::type;
+  static const u32 NUM_FIELDS = sizeof...( Fields );
+
+  std::vector< EntityHandle > entities;
+  std::tuple< std::vector< Fields >... > columns;
+  PagedIndex map; // entity index -> raw component index
+  ComponentType type;
+#ifndef NDEBUG
+  std::vector< u16 > slotGenerations; // parallel to the columns, never shrinks
+#endif
+  ChangedChunks< EntityHandle > entityChanges;
+  std::tuple< ChangedChunks< Fields >... > changes; // of each column
+  // changes recorded during the frame, applied by flushDeferred()
+  std::vector< std::pair< EntityHandle, Values > > deferredSets;
+  std::vector< EntityHandle > deferredRemoves;
+  // Optional, for fields that hold indices of other components of the map.
+  // Called after the components at a and b swap places, or after the one at
+  // b is copied over the one at a that is being removed.
+  typedef void ( *MovedCallback )( ComponentIndex a, ComponentIndex b );
+  MovedCallback moved;
+
+  SoAComponentMap();
+  void initialize( ComponentType type, CompCallbacks callbacks );
+  // number of slots, counting the null one
+  u32 size() const;
+  template< u32 Field >
+  const std::vector< FieldType< Field > >& column() const {
+    return std::get< Field >( columns );
+  }
+  // field of the component at a raw index, to write to
+  template< u32 Field >
+  FieldType< Field >& change( ComponentIndex compInd ) {
+    std::get< Field >( changes ).mark( compInd );
+    return std::get< Field >( columns )[ compInd ];
+  }
+  // the column, to write count fields from first to
+  template< u32 Field >
+  std::vector< FieldType< Field > >& changeColumn( ComponentIndex first, u32 count ) {
+    std::get< Field >( changes ).mark( first, count );
+    return std::get< Field >( columns );
+  }
+  // the column, to write the fields at the raw indices to
+  template< u32 Field >
+  std::vector< FieldType< Field > >& changeColumn( const std::vector< ComponentIndex >& indices ) {
+    std::get< Field >( changes ).mark( indices );
+    return std::get< Field >( columns );
+  }
+  // field of the component at a stamped index, halts if the index is stale
+  template< u32 Field >
+  FieldType< Field >& at( ComponentIndex compInd ) {
+    return change< Field >( validate( compInd ) );
+  }
+  void set( EntityHandle entity, const Fields&... values );
+  void remove( EntityHandle entity );
+  void removeBatch( const std::vector< EntityHandle >& entities );
+  void setDeferred( EntityHandle entity, const Fields&... values );
+  void removeDeferred( EntityHandle entity );
+  void flushDeferred();
+  void swap( ComponentIndex compIndA, ComponentIndex compIndB );
+  // moves the component at order[ i ] to i + 1, order has every component once,
+  // moved isn't called
+  void permute( const std::vector< ComponentIndex >& order );
+  static void swapErased( void* componentMap, ComponentIndex compIndA, ComponentIndex compIndB );
+  // a component has been put in the slot, indices stamped before are now stale
+  // and the history copies all of it again
+  void touch( ComponentIndex compInd );
+  ComponentIndex stamp( ComponentIndex compInd ) const;
+  static ComponentIndex stampErased( const void* componentMap, ComponentIndex compInd );
+  ComponentIndex validate( ComponentIndex compInd ) const;
+  void lookup( const std::vector< EntityHandle >& entities, LookupResult* result );
+  ComponentMemory getMemoryUsage() const;
+  static void getSections( const void* componentMap, std::vector< SnapshotSection >* sections );
+  static void clearChanges( void* componentMap );
+  static const u8* check( const u8* data, const u8* end, u32 entityCount, u32* count );
+  static const u8* load( void* componentMap, const u8* data, const u8* end );
+
+private:
+  // calls op.apply< I >( column I ) on every column
+  template< u32 I = 0, typename Op >
+  typename std::enable_if< I == NUM_FIELDS >::type forEachColumn( Op& ) const {}
+  template< u32 I = 0, typename Op >
+  typename std::enable_if< I < NUM_FIELDS >::type forEachColumn( Op& op ) const {
+    op.template apply< I >( std::get< I >( columns ) );
+    forEachColumn< I + 1 >( op );
+  }
+  template< u32 I = 0, typename Op >
+  typename std::enable_if< I == NUM_FIELDS >::type forEachColumn( Op& ) {}
+  template< u32 I = 0, typename Op >
+  typename std::enable_if< I < NUM_FIELDS >::type forEachColumn( Op& op ) {
+    op.template apply< I >( std::get< I >( columns ) );
+    forEachColumn< I + 1 >( op );
+  }
+  // steps over the saved columns from I on, checking their field sizes
+  template< u32 I = 0 >
+  static typename std::enable_if< I == NUM_FIELDS, const u8* >::type checkColumns( const u8* data, const u8*, u32 ) {
+    return data;
+  }
+  template< u32 I = 0 >
+  static typename std::enable_if< I < NUM_FIELDS, const u8* >::type checkColumns( const u8* data, const u8* end, u32 count ) {
+    u32 fieldSize;
+    data = readSnapshot( data, end, &fieldSize, 1 );
+    if ( data == nullptr || fieldSize != sizeof( FieldType< I > ) ) {
+      return nullptr;
+    }
+    return checkColumns< I + 1 >( skipSnapshot< FieldType< I > >( data, end, count ), end, count );
+  }
+  struct PushOp {
+    const Values& values;
+    template< u32 I, typename Column > void apply( Column& column ) { column.push_back( std::get< I >( values ) ); }
+  };
+  struct CopyOp {
+    ComponentIndex to, from;
+    template< u32 I, typename Column > void apply( Column& column ) { column[ to ] = column[ from ]; }
+  };
+  struct SwapOp {
+    ComponentIndex a, b;
+    template< u32 I, typename Column > void apply( Column& column ) { std::swap( column[ a ], column[ b ] ); }
+  };
+  struct PermuteOp {
+    const std::vector< ComponentIndex >& order;
+    template< u32 I, typename Column > void apply( Column& column ) {
+      Column permuted;
+      permuted.reserve( column.size() );
+      permuted.push_back( column[ 0 ] );
+      for ( u32 i = 0; i < order.size(); ++i ) {
+        permuted.push_back( column[ order[ i ] ] );
+      }
+      column.swap( permuted );
+    }
+  };
+  struct ResizeOp {
+    u32 size;
+    template< u32 I, typename Column > void apply( Column& column ) { column.resize( size ); }
+  };
+  struct ReserveOp {
+    u32 size;
+    template< u32 I, typename Column > void apply( Column& column ) { column.reserve( size ); }
+  };
+  struct SectionsOp {
+    const SoAComponentMap* self;
+    std::vector< SnapshotSection >* sections;
+    template< u32 I, typename Column > void apply( const Column& column ) {
+      static_assert( std::is_trivially_copyable< FieldType< I > >::value, "Fields are saved as raw bytes" );
+      u32 fieldSize = sizeof( FieldType< I > );
+      sections->push_back( valueSection( &fieldSize, sizeof( fieldSize ) ) );
+      sections->push_back( std::get< I >( self->changes ).section( column ) );
+    }
+  };
+  struct MarkOp {
+    SoAComponentMap* self;
+    ComponentIndex compInd;
+    template< u32 I, typename Column > void apply( Column& ) { std::get< I >( self->changes ).mark( compInd ); }
+  };
+  struct ClearOp {
+    SoAComponentMap* self;
+    template< u32 I, typename Column > void apply( Column& ) { std::get< I >( self->changes ).clear(); }
+  };
+  struct LoadOp {
+    const u8* data;
+    const u8* end;
+    u32 count;
+    template< u32 I, typename Column > void apply( Column& column ) {
+      u32 fieldSize;
+      data = readSnapshot( data, end, &fieldSize, 1 );
+      column.resize( count );
+      data = readSnapshot( data, end, column.data(), count );
+    }
+  };
+  struct BytesOp {
+    u64 bytes;
+    template< u32 I, typename Column > void apply( const Column& column ) { bytes += column.capacity() * sizeof( column[ 0 ] ); }
+  };
+  void push( EntityHandle entity, const Values& values );
+  void move( ComponentIndex to, ComponentIndex from );
+  void insert( EntityHandle entity, const Values& values );
+};
+
+template< typename... Fields >
+SoAComponentMap< Fields... >::SoAComponentMap() : moved( nullptr ) {
+  push( {}, Values() );
+#ifndef NDEBUG
+  slotGenerations.push_back( 0 );
+#endif
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::initialize( ComponentType type, CompCallbacks callbacks ) {
+  this->type = type;
+  EntityManager::registerComponentType( type, callbacks, { this, &map, &SoAComponentMap< Fields... >::swapErased,
+                                                           &SoAComponentMap< Fields... >::stampErased,
+                                                           &SoAComponentMap< Fields... >::getSections,
+                                                           &SoAComponentMap< Fields... >::clearChanges,
+                                                           &SoAComponentMap< Fields... >::check,
+                                                           &SoAComponentMap< Fields... >::load } );
+}
+
+template< typename... Fields >
+inline u32 SoAComponentMap< Fields... >::size() const {
+  return entities.size();
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::push( EntityHandle entity, const Values& values ) {
+  entities.push_back( entity );
+  PushOp op = { values };
+  forEachColumn( op );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::move( ComponentIndex to, ComponentIndex from ) {
+  entities[ to ] = entities[ from ];
+  CopyOp op = { to, from };
+  forEachColumn( op );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::set( EntityHandle entity, const Fields&... values ) {
+  insert( entity, Values( values... ) );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::insert( EntityHandle entity, const Values& values ) {
+  VALIDATE_ENTITY( entity );
+  ComponentMask& mask = EntityManager::changeMask( entity.index - 1 );
+  ASSERT( ( mask & ( 1 << type ) ) == 0, "Entity %d already has the given component", entity );
+  push( entity, values );
+  u32 compInd = entities.size() - 1;
+  touch( compInd );
+  map.set( entity.index, compInd );
+  mask |= 1 << type;
+  EntityManager::onComponentAdded( entity, type );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::remove( EntityHandle entity ) {
+  VALIDATE_ENTITY( entity );
+  ASSERT( map.get( entity.index ) > 0, "Entity %d has no given component", entity );
+  EntityManager::changeMask( entity.index - 1 ) &= ~( 1 << type );
+  // this may move the component out of an owning group
+  EntityManager::onComponentRemoved( entity, type );
+  ComponentIndex compInd = map.get( entity.index );
+  // replace comp-to-remove with last one in every column and erase last element
+  u32 lastInd = entities.size() - 1;
+  move( compInd, lastInd );
+  if ( moved != nullptr && compInd < lastInd ) {
+    moved( compInd, lastInd );
+  }
+  ResizeOp op = { lastInd };
+  forEachColumn( op );
+  entities.pop_back();
+  // ...update comp-not-to-remove in map (unless comp-to-remove was the last one)
+  if ( compInd < lastInd ) {
+    touch( compInd );
+    map.set( entities[ compInd ].index, compInd );
+    EntityManager::onComponentMoved( entities[ compInd ], type, stamp( compInd ) );
+  }
+  // and remove comp-to-remove in map
+  map.set( entity.index, 0 );
+}
+
+// Same single compaction pass as ComponentMap::removeBatch, on every column.
+template< typename... Fields >
+void SoAComponentMap< Fields... >::removeBatch( const std::vector< EntityHandle >& entities ) {
+  VALIDATE_ENTITIES( entities );
+  static std::vector< ComponentIndex > holes;
+  holes.clear();
+  holes.reserve( entities.size() );
+  // clear the map first so that a zero in it marks a component to remove
+  for ( u32 entInd = 0; entInd < entities.size(); ++entInd ) {
+    EntityHandle entity = entities[ entInd ];
+    ASSERT( map.get( entity.index ) > 0, "Entity %d has no given component", entity );
+    EntityManager::changeMask( entity.index - 1 ) &= ~( 1 << type );
+    EntityManager::onComponentRemoved( entity, type );
+    holes.push_back( map.get( entity.index ) );
+    map.set( entity.index, 0 );
+  }
+  u32 newSize = this->entities.size() - holes.size();
+  u32 tailInd = newSize;
+  for ( u32 holeInd = 0; holeInd < holes.size(); ++holeInd ) {
+    ComponentIndex hole = holes[ holeInd ];
+    if ( hole >= newSize ) {
+      // it is in the tail that is about to be erased
+      continue;
+    }
+    while ( map.get( this->entities[ tailInd ].index ) == 0 ) {
+      ++tailInd;
+    }
+    move( hole, tailInd );
+    if ( moved != nullptr ) {
+      moved( hole, tailInd );
+    }
+    touch( hole );
+    map.set( this->entities[ hole ].index, hole );
+    EntityManager::onComponentMoved( this->entities[ hole ], type, stamp( hole ) );
+    ++tailInd;
+  }
+  this->entities.resize( newSize );
+  ResizeOp op = { newSize };
+  forEachColumn( op );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::setDeferred( EntityHandle entity, const Fields&... values ) {
+  VALIDATE_ENTITY( entity );
+  deferredSets.push_back( { entity, Values( values... ) } );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::removeDeferred( EntityHandle entity ) {
+  VALIDATE_ENTITY( entity );
+  deferredRemoves.push_back( entity );
+}
+
+// Removals are applied before additions, both in entity index order. Changes
+// to entities that have been destroyed in the meantime are dropped, and so
+// are additions to entities that still have the component. Of several
+// additions to one entity, the last one is applied.
+template< typename... Fields >
+void SoAComponentMap< Fields... >::flushDeferred() {
+  if ( !deferredRemoves.empty() ) {
+    std::sort( deferredRemoves.begin(), deferredRemoves.end(), []( EntityHandle a, EntityHandle b ) {
+        return a.index < b.index;
+      } );
+    u32 removeCount = 0;
+    for ( u32 entInd = 0; entInd < deferredRemoves.size(); ++entInd ) {
+      EntityHandle entity = deferredRemoves[ entInd ];
+      bool duplicate = removeCount > 0 && deferredRemoves[ removeCount - 1 ] == entity;
+      if ( !duplicate && EntityManager::isAlive( entity ) && map.get( entity.index ) > 0 ) {
+        deferredRemoves[ removeCount++ ] = entity;
+      }
+    }
+    deferredRemoves.resize( removeCount );
+    removeBatch( deferredRemoves );
+    deferredRemoves.clear();
+  }
+  if ( !deferredSets.empty() ) {
+    typedef std::pair< EntityHandle, Values > DeferredSet;
+    std::stable_sort( deferredSets.begin(), deferredSets.end(), []( const DeferredSet& a, const DeferredSet& b ) {
+        return a.first.index < b.first.index;
+      } );
+    ReserveOp op = { ( u32 )( entities.size() + deferredSets.size() ) };
+    forEachColumn( op );
+    entities.reserve( op.size );
+    for ( u32 setInd = 0; setInd < deferredSets.size(); ++setInd ) {
+      EntityHandle entity = deferredSets[ setInd ].first;
+      // the sort is stable, so a later addition to the same entity is next
+      bool replaced = setInd + 1 < deferredSets.size() && deferredSets[ setInd + 1 ].first == entity;
+      if ( !replaced && EntityManager::isAlive( entity ) && map.get( entity.index ) == 0 ) {
+        insert( entity, deferredSets[ setInd ].second );
+      }
+    }
+    deferredSets.clear();
+  }
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::swap( ComponentIndex compIndA, ComponentIndex compIndB ) {
+  if ( compIndA == compIndB ) {
+    return;
+  }
+  std::swap( entities[ compIndA ], entities[ compIndB ] );
+  SwapOp op = { compIndA, compIndB };
+  forEachColumn( op );
+  if ( moved != nullptr ) {
+    moved( compIndA, compIndB );
+  }
+  touch( compIndA );
+  touch( compIndB );
+  map.set( entities[ compIndA ].index, compIndA );
+  map.set( entities[ compIndB ].index, compIndB );
+  EntityManager::onComponentMoved( entities[ compIndA ], type, stamp( compIndA ) );
+  EntityManager::onComponentMoved( entities[ compIndB ], type, stamp( compIndB ) );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::permute( const std::vector< ComponentIndex >& order ) {
+  ASSERT( order.size() + 1 == entities.size(), "Permutation of %d components instead of %d", ( u32 )order.size(), size() - 1 );
+  PermuteOp op = { order };
+  forEachColumn( op );
+  std::vector< EntityHandle > permuted;
+  permuted.reserve( entities.size() );
+  permuted.push_back( entities[ 0 ] );
+  for ( u32 i = 0; i < order.size(); ++i ) {
+    permuted.push_back( entities[ order[ i ] ] );
+  }
+  entities.swap( permuted );
+  // we count from 1
+  for ( ComponentIndex compInd = 1; compInd < entities.size(); ++compInd ) {
+    if ( order[ compInd - 1 ] != compInd ) {
+      touch( compInd );
+      map.set( entities[ compInd ].index, compInd );
+      EntityManager::onComponentMoved( entities[ compInd ], type, stamp( compInd ) );
+    }
+  }
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::swapErased( void* componentMap, ComponentIndex compIndA, ComponentIndex compIndB ) {
+  static_cast< SoAComponentMap< Fields... >* >( componentMap )->swap( compIndA, compIndB );
+}
+
+template< typename... Fields >
+inline void SoAComponentMap< Fields... >::touch( ComponentIndex compInd ) {
+  entityChanges.mark( compInd );
+  MarkOp op = { this, compInd };
+  forEachColumn( op );
+#ifndef NDEBUG
+  if ( compInd >= slotGenerations.size() ) {
+    slotGenerations.resize( compInd + 1, 0 );
+  }
+  slotGenerations[ compInd ] = ( slotGenerations[ compInd ] + 1 ) & ( ( 1 << HANDLE_GENERATION_BITS ) - 1 );
+#endif
+}
+
+template< typename... Fields >
+inline ComponentIndex SoAComponentMap< Fields... >::stamp( ComponentIndex compInd ) const {
+#ifndef NDEBUG
+  return compInd | slotGenerations[ compInd ] << COMPONENT_INDEX_BITS;
+#else
+  return compInd;
+#endif
+}
+
+template< typename... Fields >
+ComponentIndex SoAComponentMap< Fields... >::stampErased( const void* componentMap, ComponentIndex compInd ) {
+  return static_cast< const SoAComponentMap< Fields... >* >( componentMap )->stamp( compInd );
+}
+
+template< typename... Fields >
+inline ComponentIndex SoAComponentMap< Fields... >::validate( ComponentIndex compInd ) const {
+#ifndef NDEBUG
+  ComponentIndex rawInd = compInd & COMPONENT_INDEX_MASK;
+  ASSERT( rawInd > 0 && rawInd < entities.size(), "Component index %d out of bounds", rawInd );
+  ASSERT( compInd >> COMPONENT_INDEX_BITS == slotGenerations[ rawInd ],
+          "Stale component index %d, the component in it has changed", rawInd );
+  return rawInd;
+#else
+  return compInd;
+#endif
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::lookup( const std::vector< EntityHandle >& entities, LookupResult* result ) {
+  VALIDATE_ENTITIES( entities );
+  ASSERT( result->entities.size() == 0 && result->indices.size() == 0, "" );
+  u32 maxSize = entities.size();
+  result->entities.reserve( maxSize );
+  result->indices.reserve( maxSize );
+  for ( u32 entInd = 0; entInd < maxSize; ++entInd ) {
+    EntityHandle entity = entities[ entInd ];
+    ComponentIndex compInd = map.get( entity.index );
+    if ( compInd > 0 ) {
+      result->entities.push_back( entity );
+      result->indices.push_back( stamp( compInd ) );
+    }
+  }
+}
+
+template< typename... Fields >
+ComponentMemory SoAComponentMap< Fields... >::getMemoryUsage() const {
+  BytesOp op = { entities.capacity() * sizeof( EntityHandle ) };
+  forEachColumn( op );
+  return { map.getResidentBytes(), op.bytes };
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::getSections( const void* componentMap, std::vector< SnapshotSection >* sections ) {
+  const SoAComponentMap< Fields... >* self = static_cast< const SoAComponentMap< Fields... >* >( componentMap );
+  ASSERT( self->deferredSets.empty() && self->deferredRemoves.empty(), "Deferred component changes pending" );
+  u32 header[ 2 ] = { self->size(), NUM_FIELDS };
+  sections->push_back( valueSection( header, sizeof( header ) ) );
+  sections->push_back( self->entityChanges.section( self->entities ) );
+  SectionsOp op = { self, sections };
+  self->forEachColumn( op );
+  self->map.getSections( sections );
+}
+
+template< typename... Fields >
+void SoAComponentMap< Fields... >::clearChanges( void* componentMap ) {
+  SoAComponentMap< Fields... >* self = static_cast< SoAComponentMap< Fields... >* >( componentMap );
+  self->entityChanges.clear();
+  ClearOp op = { self };
+  self->forEachColumn( op );
+  self->map.clearChanges();
+}
+
+template< typename... Fields >
+const u8* SoAComponentMap< Fields... >::check( const u8* data, const u8* end, u32 entityCount, u32* count ) {
+  u32 header[ 2 ] = {};
+  data = readSnapshot( data, end, header, 2 );
+  // there is always the null component
+  if ( data == nullptr || header[ 0 ] == 0 || header[ 0 ] > MAX_ENTITIES || header[ 1 ] != NUM_FIELDS ) {
+    return nullptr;
+  }
+  *count = header[ 0 ];
+  const u8* entities = data;
+  data = skipSnapshot< EntityHandle >( data, end, header[ 0 ] );
+  if ( data == nullptr ) {
+    return nullptr;
+  }
+  for ( u32 compInd = 1; compInd < header[ 0 ]; ++compInd ) {
+    EntityHandle entity;
+    std::memcpy( &entity, entities + compInd * sizeof( EntityHandle ), sizeof( EntityHandle ) );
+    // we count from 1
+    if ( entity.index == 0 || entity.index > entityCount ) {
+      return nullptr;
+    }
+  }
+  return PagedIndex::check( checkColumns( data, end, header[ 0 ] ), end, header[ 0 ] );
+}
+
+template< typename... Fields >
+const u8* SoAComponentMap< Fields... >::load( void* componentMap, const u8* data, const u8* end ) {
+  SoAComponentMap< Fields... >* self = static_cast< SoAComponentMap< Fields... >* >( componentMap );
+  u32 header[ 2 ] = {};
+  data = readSnapshot( data, end, header, 2 );
+  self->entities.resize( header[ 0 ] );
+  data = readSnapshot( data, end, self->entities.data(), header[ 0 ] );
+  LoadOp op = { data, end, header[ 0 ] };
+  self->forEachColumn( op );
+  self->deferredSets.clear();
+  self->deferredRemoves.clear();
+  // indices stamped before the load are all stale
+  for ( u32 compInd = 1; compInd < self->size(); ++compInd ) {
+    self->touch( compInd );
+  }
+  return self->map.load( op.data, end );
+}